@@ -0,0 +1,170 @@
+#include "arena.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+// enough for pointers and sizes, nothing with a larger alignment is allocated
+// from arenas
+#define ARENA_ALIGN sizeof(void *)
+
+static char *block_data(arena_block *block) { return (char *)(block + 1); }
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void arena_init(arena *a) {
+  a->block = NULL;
+  a->free_blocks = NULL;
+  a->capacity = 0;
+  a->allocations = 0;
+  a->blocks_allocated = 0;
+}
+
+static void free_blocks(arena_block *block) {
+  while (block) {
+    arena_block *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+}
+
+void arena_free(arena *a) {
+  free_blocks(a->block);
+  free_blocks(a->free_blocks);
+  a->block = NULL;
+  a->free_blocks = NULL;
+  a->capacity = 0;
+}
+
+// make sure the current block has `size` free bytes
+static int reserve(arena *a, size_t size) {
+  if (a->block && a->block->cap - a->block->len >= size) {
+    return 1;
+  }
+
+  arena_block *block = NULL;
+  if (a->free_blocks && a->free_blocks->cap >= size) {
+    block = a->free_blocks;
+    a->free_blocks = block->prev;
+  } else {
+    size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof *block + cap);
+    if (!block) {
+      return 0;
+    }
+    block->cap = cap;
+    a->capacity += sizeof *block + cap;
+    ++a->blocks_allocated;
+  }
+
+  block->len = 0;
+  block->prev = a->block;
+  a->block = block;
+  return 1;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+  if (a->block) {
+    a->block->len = align_up(a->block->len);
+    if (a->block->len > a->block->cap) {
+      a->block->len = a->block->cap;
+    }
+  }
+
+  if (!reserve(a, size)) {
+    return NULL;
+  }
+
+  void *ptr = block_data(a->block) + a->block->len;
+  a->block->len += size;
+  ++a->allocations;
+  return ptr;
+}
+
+char *arena_printf(arena *a, const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int length = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  if (length < 0) {
+    return NULL;
+  }
+
+  char *string = arena_alloc(a, (size_t)length + 1);
+  if (!string) {
+    return NULL;
+  }
+
+  va_start(va, fmt);
+  vsnprintf(string, (size_t)length + 1, fmt, va);
+  va_end(va);
+  return string;
+}
+
+arena_mark arena_save(const arena *a) {
+  arena_mark mark;
+  mark.block = a->block;
+  mark.len = a->block ? a->block->len : 0;
+  return mark;
+}
+
+void arena_rewind(arena *a, arena_mark mark) {
+  while (a->block != mark.block) {
+    arena_block *block = a->block;
+    a->block = block->prev;
+    block->prev = a->free_blocks;
+    a->free_blocks = block;
+  }
+
+  if (a->block) {
+    a->block->len = mark.len;
+  }
+}
+
+int arena_string_append(arena *a, arena_string *str, const char *src,
+                        size_t n) {
+  if (!str->data) {
+    if (!reserve(a, n)) {
+      return 0;
+    }
+    str->data = block_data(a->block) + a->block->len;
+  }
+
+  char *top = block_data(a->block) + a->block->len;
+  if (str->data + str->len == top && a->block->cap - a->block->len >= n) {
+    // grow in place
+    memcpy(top, src, n);
+    a->block->len += n;
+    str->len += n;
+    return 1;
+  }
+
+  // move the string to a new block
+  size_t new_len = str->len + n;
+  size_t cap = new_len * 2 > ARENA_BLOCK_SIZE ? new_len * 2 : ARENA_BLOCK_SIZE;
+  char *old_data = str->data;
+  if (!reserve(a, cap)) {
+    return 0;
+  }
+
+  char *data = block_data(a->block) + a->block->len;
+  memcpy(data, old_data, str->len);
+  memcpy(data + str->len, src, n);
+  a->block->len += new_len;
+  str->data = data;
+  str->len = new_len;
+  return 1;
+}
+
+void arena_string_truncate(arena *a, arena_string *str, size_t len) {
+  // give the bytes back if the string is still at the top of the arena
+  char *top = a->block ? block_data(a->block) + a->block->len : NULL;
+  if (str->data && str->data + str->len == top) {
+    a->block->len -= str->len - len;
+  }
+  str->len = len;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+
+// Bump allocator for short-lived allocations.
+//
+// Everything a command needs (tokens, argv, the resolved binary path...) is
+// allocated from the shell arena and released at once by rewinding the arena
+// to a mark taken before the command started. Marks nest, so a script can run
+// its own commands while the command that started it is still alive.
+typedef struct arena_block {
+  struct arena_block *prev;
+  size_t cap;
+  size_t len;
+} arena_block;
+
+typedef struct {
+  arena_block *block;
+  // blocks released by arena_rewind, reused before allocating new ones
+  arena_block *free_blocks;
+  // total size of the blocks owned by the arena
+  size_t capacity;
+  // number of arena_alloc calls and of blocks taken from malloc, callers may
+  // reset them
+  size_t allocations;
+  size_t blocks_allocated;
+} arena;
+
+typedef struct {
+  arena_block *block;
+  size_t len;
+} arena_mark;
+
+// a string growing at the top of an arena, no other allocation may be made from
+// the same arena until the string is complete
+typedef struct {
+  char *data;
+  size_t len;
+} arena_string;
+
+void arena_init(arena *a);
+void arena_free(arena *a);
+
+void *arena_alloc(arena *a, size_t size);
+char *arena_printf(arena *a, const char *fmt, ...);
+
+arena_mark arena_save(const arena *a);
+void arena_rewind(arena *a, arena_mark mark);
+
+int arena_string_append(arena *a, arena_string *str, const char *src, size_t n);
+// shrink the string to `len` bytes
+void arena_string_truncate(arena *a, arena_string *str, size_t len);
@@ -0,0 +1,64 @@
+#pragma once
+
+// Atomic ints shared between the shell and the reaper thread.
+//
+// Loads acquire and stores release, so a value written before a store is
+// visible to whoever loads the stored value. MSVC only ships <stdatomic.h> in
+// recent versions (with /experimental:c11atomics), the Interlocked functions
+// (full barriers) are used there instead.
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <windows.h>
+
+typedef volatile long atomic_int_t;
+
+inline static int atomic_int_load(atomic_int_t *p) {
+  return (int)InterlockedCompareExchange(p, 0, 0);
+}
+
+inline static void atomic_int_store(atomic_int_t *p, int value) {
+  InterlockedExchange(p, value);
+}
+
+inline static int atomic_int_exchange(atomic_int_t *p, int value) {
+  return (int)InterlockedExchange(p, value);
+}
+
+// returns the previous value
+inline static int atomic_int_fetch_add(atomic_int_t *p, int value) {
+  return (int)InterlockedExchangeAdd(p, value);
+}
+
+// stores `desired` if the value is `expected`, returns whether it did
+inline static int atomic_int_compare_exchange(atomic_int_t *p, int expected,
+                                              int desired) {
+  return InterlockedCompareExchange(p, desired, expected) == expected;
+}
+#else
+#include <stdatomic.h>
+
+typedef _Atomic int atomic_int_t;
+
+inline static int atomic_int_load(atomic_int_t *p) {
+  return atomic_load_explicit(p, memory_order_acquire);
+}
+
+inline static void atomic_int_store(atomic_int_t *p, int value) {
+  atomic_store_explicit(p, value, memory_order_release);
+}
+
+inline static int atomic_int_exchange(atomic_int_t *p, int value) {
+  return atomic_exchange_explicit(p, value, memory_order_acq_rel);
+}
+
+// returns the previous value
+inline static int atomic_int_fetch_add(atomic_int_t *p, int value) {
+  return atomic_fetch_add_explicit(p, value, memory_order_acq_rel);
+}
+
+// stores `desired` if the value is `expected`, returns whether it did
+inline static int atomic_int_compare_exchange(atomic_int_t *p, int expected,
+                                              int desired) {
+  return atomic_compare_exchange_strong_explicit(
+      p, &expected, desired, memory_order_acq_rel, memory_order_acquire);
+}
+#endif
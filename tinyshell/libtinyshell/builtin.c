@@ -1,10 +1,14 @@
 #include "builtin.h"
+#include "ls.h"
+#include "output.h"
 #include "parse_cmd.h"
 #include "process.h"
+#include "redirect.h"
 #include "tinyshell.h"
 #include "utils.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,91 +16,235 @@
 
 #ifdef _WIN32
 #include <direct.h>
-#include <fileapi.h>
-#include <handleapi.h>
-#include <timezoneapi.h>
-#include <winnt.h>
 #else
-#include <dirent.h>
-#include <grp.h>
-#include <pwd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <unistd.h>
 #endif
 
+typedef struct {
+  const char *name;
+  tinyshell_builtin func;
+} builtin_entry;
+
+// Static builtins, in any order. They are looked up through a perfect hash of
+// their names:
+//   index = (hash_string(name) * seed) >> (32 - bits)
+// with a seed searched once, when the first name is looked up, so adding a
+// builtin only means adding it here.
+static const builtin_entry builtin_list[] = {
+    {"cd", builtin_cd},           {"pwd", builtin_pwd},
+    {"date", builtin_date},       {"time", builtin_time},
+    {"exit", builtin_exit},       {"help", builtin_help},
+    {"ls", builtin_ls},           {"dir", builtin_ls},
+    {"jobs", builtin_jobs},       {"list", builtin_jobs},
+    {"kill", builtin_kill},       {"stop", builtin_stop},
+    {"resume", builtin_resume},   {"addpath", builtin_addpath},
+    {"setpath", builtin_setpath}, {"path", builtin_path},
+    {"hash", builtin_hash},       {"pipesize", builtin_pipesize},
+    {"spawn", builtin_spawn},     {"maxjobs", builtin_maxjobs},
+    {"stats", builtin_stats},     {"export", builtin_export},
+    {"unset", builtin_unset},     {"env", builtin_env},
+    {"history", builtin_history},
+};
+
+#define BUILTIN_COUNT ((int)(sizeof builtin_list / sizeof builtin_list[0]))
+#define BUILTIN_HASH_MAX_BITS 12
+// seeds tried before the table is made larger
+#define BUILTIN_SEED_ATTEMPTS 65536
+
+static struct {
+  unsigned seed;
+  int bits;
+  const builtin_entry *slots[1 << BUILTIN_HASH_MAX_BITS];
+} builtin_table;
+static once_flag builtin_table_once = ONCE_FLAG_INIT;
+
+static unsigned builtin_index(unsigned hash, unsigned seed, int bits) {
+  return ((hash * seed) & 0xffffffffu) >> (32 - bits);
+}
+
+// with a table at least twice as large as the list, a seed without collisions
+// is found in a few hundred attempts
+static void build_builtin_table(void) {
+  unsigned hashes[BUILTIN_COUNT];
+  for (int i = 0; i < BUILTIN_COUNT; ++i) {
+    hashes[i] = hash_string(builtin_list[i].name);
+  }
+
+  int bits = 1;
+  while (1 << bits < 2 * BUILTIN_COUNT) {
+    ++bits;
+  }
+  // the same seed on every run, the search is deterministic
+  unsigned seed = 0x9e3779b9u;
+  for (; bits <= BUILTIN_HASH_MAX_BITS; ++bits) {
+    for (int attempt = 0; attempt < BUILTIN_SEED_ATTEMPTS; ++attempt) {
+      seed = seed * 1664525u + 1013904223u;
+      memset(builtin_table.slots, 0, sizeof builtin_table.slots);
+      int i = 0;
+      for (; i < BUILTIN_COUNT; ++i) {
+        unsigned index = builtin_index(hashes[i], seed | 1, bits);
+        if (builtin_table.slots[index]) {
+          break;
+        }
+        builtin_table.slots[index] = &builtin_list[i];
+      }
+      if (i == BUILTIN_COUNT) {
+        builtin_table.seed = seed | 1;
+        builtin_table.bits = bits;
+        return;
+      }
+    }
+  }
+
+  // two names with the same hash_string
+  fprintf(stderr, "unable to build the builtin table\n");
+  abort();
+}
+
+static const builtin_entry *find_static_builtin(const char *name,
+                                                unsigned hash) {
+  call_once(&builtin_table_once, build_builtin_table);
+  const builtin_entry *entry = builtin_table.slots[builtin_index(
+      hash, builtin_table.seed, builtin_table.bits)];
+  return entry && strcmp(entry->name, name) == 0 ? entry : NULL;
+}
+
+static tinyshell_builtin_entry *find_registered_builtin(const tinyshell *shell,
+                                                        const char *name,
+                                                        unsigned hash) {
+  if (shell->builtins_bucket_count == 0) {
+    return NULL;
+  }
+
+  for (tinyshell_builtin_entry *entry =
+           shell->builtins[hash % shell->builtins_bucket_count];
+       entry; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+tinyshell_builtin find_builtin(const tinyshell *shell, const char *name) {
+  unsigned hash = hash_string(name);
+  const builtin_entry *entry = find_static_builtin(name, hash);
+  if (entry) {
+    return entry->func;
+  }
+
+  tinyshell_builtin_entry *registered =
+      find_registered_builtin(shell, name, hash);
+  return registered ? registered->func : NULL;
+}
+
+int tinyshell_register_builtin(tinyshell *shell, const char *name,
+                               tinyshell_builtin func) {
+  unsigned hash = hash_string(name);
+  if (find_static_builtin(name, hash) ||
+      find_registered_builtin(shell, name, hash)) {
+    return 0;
+  }
+
+  if (shell->builtins_len >= shell->builtins_bucket_count) {
+    int new_count = shell->builtins_bucket_count * 2 + 8;
+    tinyshell_builtin_entry **new_buckets =
+        calloc(new_count, sizeof *new_buckets);
+    if (!new_buckets) {
+      return 0;
+    }
+
+    for (int i = 0; i < shell->builtins_bucket_count; ++i) {
+      tinyshell_builtin_entry *entry = shell->builtins[i];
+      while (entry) {
+        tinyshell_builtin_entry *next = entry->next;
+        entry->next = new_buckets[entry->hash % new_count];
+        new_buckets[entry->hash % new_count] = entry;
+        entry = next;
+      }
+    }
+
+    free(shell->builtins);
+    shell->builtins = new_buckets;
+    shell->builtins_bucket_count = new_count;
+  }
+
+  size_t name_len = strlen(name);
+  tinyshell_builtin_entry *entry = malloc(sizeof *entry + name_len + 1);
+  if (!entry) {
+    return 0;
+  }
+
+  memcpy(entry->name, name, name_len + 1);
+  entry->hash = hash;
+  entry->func = func;
+  entry->next = shell->builtins[hash % shell->builtins_bucket_count];
+  shell->builtins[hash % shell->builtins_bucket_count] = entry;
+  ++shell->builtins_len;
+  return 1;
+}
+
+void free_registered_builtins(tinyshell *shell) {
+  for (int i = 0; i < shell->builtins_bucket_count; ++i) {
+    tinyshell_builtin_entry *entry = shell->builtins[i];
+    while (entry) {
+      tinyshell_builtin_entry *next = entry->next;
+      free(entry);
+      entry = next;
+    }
+  }
+
+  free(shell->builtins);
+}
+
+int list_builtins(const tinyshell *shell,
+                  int (*callback)(void *userdata, const char *name),
+                  void *userdata) {
+  for (int i = 0; i < BUILTIN_COUNT; ++i) {
+    if (!callback(userdata, builtin_list[i].name)) {
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < shell->builtins_bucket_count; ++i) {
+    for (tinyshell_builtin_entry *entry = shell->builtins[i]; entry;
+         entry = entry->next) {
+      if (!callback(userdata, entry->name)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
 int try_run_builtin(tinyshell *shell, command_parse_result *result,
                     int *status_code) {
-  const char *arg0 = result->argv[0];
-  if (strcmp(arg0, "cd") == 0) {
-    *status_code = builtin_cd(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "pwd") == 0) {
-    *status_code = builtin_pwd(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "date") == 0) {
-    *status_code = builtin_date(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "time") == 0) {
-    *status_code = builtin_time(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "exit") == 0) {
-    *status_code = builtin_exit(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "help") == 0) {
-    *status_code = builtin_help(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "ls") == 0 || strcmp(arg0, "dir") == 0) {
-    *status_code = builtin_ls(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "jobs") == 0 || strcmp(arg0, "list") == 0) {
-    *status_code = builtin_jobs(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "kill") == 0) {
-    *status_code = builtin_kill(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "stop") == 0) {
-    *status_code = builtin_stop(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "resume") == 0) {
-    *status_code = builtin_resume(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "addpath") == 0) {
-    *status_code = builtin_addpath(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "setpath") == 0) {
-    *status_code = builtin_setpath(shell, result->argc, result->argv);
-    command_parse_result_free(result);
-    return 1;
-  } else if (strcmp(arg0, "path") == 0) {
-    *status_code = builtin_path(shell, result->argc, result->argv);
-    command_parse_result_free(result);
+  tinyshell_builtin func = find_builtin(shell, result->argv[0]);
+  if (!func) {
+    return 0;
+  }
+
+  const command_stage *stage = &result->stages[0];
+  int *saved;
+  if (!redirect_stage_apply(stage, &shell->arena, &saved)) {
+    *status_code = 1;
     return 1;
   }
 
-  return 0;
+  *status_code = func(shell, result->argc, result->argv);
+  redirect_stage_restore(stage, saved);
+  return 1;
 }
 
 int builtin_cd(tinyshell *shell, int argc, char *argv[]) {
   if (argc != 2) {
-    puts("usage: cd <directory>");
+    output_puts("usage: cd <directory>");
     return 1;
   }
 
   if (POSIX_WIN32(chdir)(argv[1])) {
-    printf("unable to change directory to %s\n", argv[1]);
+    output_printf("unable to change directory to %s\n", argv[1]);
     return 1;
   }
 
@@ -109,7 +257,7 @@ int builtin_pwd(tinyshell *shell, int argc, char *argv[]) {
     return 1;
   }
 
-  puts(cwd);
+  output_puts(cwd);
   free(cwd);
   return 0;
 }
@@ -132,7 +280,7 @@ static int print_datetime(const char *format) {
     size *= 2;
   } while (strftime(timestamp, size, format, timeinfo) == 0);
 
-  printf("%s\n", timestamp);
+  output_printf("%s\n", timestamp);
   free(timestamp); // Free the dynamically allocated memory
   return 0;
 }
@@ -156,18 +304,25 @@ int builtin_time(tinyshell *shell, int argc, char *argv[]) {
 }
 
 int builtin_exit(tinyshell *shell, int argc, char *argv[]) {
+  if (argc > 2) {
+    output_puts("usage: exit [status]");
+    return 1;
+  }
+
   shell->exit = 1;
-  return 0;
+  // the status of the shell, the last one by default
+  return argc == 2 ? atoi(argv[1]) : shell->last_status;
 }
 
 int builtin_help(tinyshell *shell, int argc, char *argv[]) {
-  printf(
+  output_printf(
 // clang-format off
 "= tinyshell (pre-release version)\n"
 "Git reposistory: https://github.com/btmxh/IT3070 (in the `tinyshell` directory)\n"
 "\n"
 "= Builtin commands\n"
-"- `exit`      - exit this shell\n"
+"- `exit`      - exit this shell, with the given status or the status of\n"
+"                the last command\n"
 "- `help`      - print help\n"
 "- `cd`        - change directory\n"
 "- `pwd`       - print working directory\n"
@@ -176,22 +331,52 @@ int builtin_help(tinyshell *shell, int argc, char *argv[]) {
 "                the format is interpreted as defined here:\n"
 "                (https://en.cppreference.com/w/c/chrono/strftime)\n"
 "                the only differences between date/time are the default format\n"
+"                `time <command>` runs the command and prints its wall, user\n"
+"                and system time, max resident set size and context switches\n"
 "- `ls/dir`    - print information about files in a directory\n"
 "                (default: the current working directory).\n"
 "                add option `-l` to print more details\n"
+"                add option `-f` to print entries unsorted as they are read,\n"
+"                which keeps memory use flat in huge directories\n"
+"                add option `-R` to also list every subdirectory (read in\n"
+"                parallel, Unix/POSIX only), followed by the totals\n"
 "- `jobs`      - print all currently active jobs (background process)\n"
 "                to create a new job, append an ampersand (&) to the command\n"
 "                when launching a process\n"
-"- `kill`      - kill jobs specified in the arguments\n"
+"                `jobs -v` also prints the resources used by each job\n"
+"- `kill`      - kill jobs specified in the arguments (queued jobs are\n"
+"                cancelled)\n"
 "- `stop`      - stop jobs specified in the arguments\n"
 "- `resume`    - resume jobs specified in the arguments\n"
+"- `maxjobs`   - print or set the number of jobs running at once (0 for no\n"
+"                limit, the number of processors by default), the other jobs\n"
+"                are queued and start when a running job finishes\n"
 "- `setpath`   - set the shell PATH to the value specified in the argument\n"
-"                note that when processes are started, the shell will not pass\n"
-"                the PATH environment variable to the process\n"
 "- `addpath`   - add paths to the shell PATH. use `setpath` to clear this value\n"
 "- `path`      - print the current shell PATH\n"
 "                the separator between paths is system-dependent:\n"
 "                Win32 - ';', Unix/POSIX - ':'\n"
+"- `export`    - set environment variables, given as NAME=value\n"
+"                the environment is inherited from the process that started\n"
+"                the shell and passed to every process the shell starts\n"
+"- `unset`     - remove the environment variables given as arguments\n"
+"- `env`       - print the environment variables\n"
+"- `pipesize`  - print or set the pipe buffer size used for pipelines\n"
+"                (Linux only, 0 keeps the system default)\n"
+"- `hash`      - print the cached locations of executables found in the PATH\n"
+"                `hash -r` clears the cache, `hash <name>...` looks up the\n"
+"                given executables and adds them to the cache\n"
+"- `spawn`     - print the process creation backends and their latency\n"
+"                `spawn <backend>` picks the backend for new processes,\n"
+"                `spawn -r` resets the latency statistics and\n"
+"                `spawn -b <count> <command>...` starts the command <count>\n"
+"                times with every backend\n"
+"- `stats`     - print the latency (p50/p99/max) of each step of running a\n"
+"                command and counters of spawns, PATH lookups and allocations\n"
+"                `stats -r` resets them\n"
+"- `history`   - print the commands entered before, each one once\n"
+"                `history <count>` prints the last <count> commands and\n"
+"                `history -s <prefix>` those starting with <prefix>\n"
 "\n"
 "= Jobs and processes\n"
 "\n"
@@ -202,9 +387,48 @@ int builtin_help(tinyshell *shell, int argc, char *argv[]) {
 "Add an ampersand ('&') to the end of the command to launch as a job\n"
 "(background process).\n"
 "\n"
+"Separate commands with '|' to connect the output of each command to the input\n"
+"of the next one (pipelines, Unix/POSIX only). The whole pipeline is one job.\n"
+"\n"
+"Redirect the input and output of a command with '< file', '> file',\n"
+"'>> file' (append) and 'n>&m' (e.g. '2>&1'), where n and m are 0-9.\n"
+"\n"
 "Use CTRL+C to cancel a currently running process. This is a SIGINT on Unix, so\n"
 "the process could catch the signal and refuse to terminate.\n"
 "\n"
+"= History\n"
+"\n"
+"Commands are saved in the file named by TINYSHELL_HISTORY (an empty value\n"
+"disables the history), or in ~/.tinyshell_history if the shell is interactive.\n"
+"The file is shared by every shell and kept across sessions. A line starting\n"
+"with a space is not saved.\n"
+"\n"
+"At the start of a line, `!!` is replaced by the last command, `!<n>` by the\n"
+"command numbered <n> by `history` (`!-<n>` counts from the end) and\n"
+"`!<prefix>` by the last command starting with <prefix>.\n"
+"\n"
+"= Line editing\n"
+"\n"
+"When the input is a terminal (Unix/POSIX only), the line can be edited with the\n"
+"arrow keys, Home/End, Backspace/Delete and the CTRL+A/E/B/F/U/K/W/L shortcuts.\n"
+"CTRL+C discards the line and CTRL+D on an empty line exits.\n"
+"\n"
+"Tab completes the word before the cursor: the first word of a command with the\n"
+"builtins and the executables of the PATH, the other words with file names. A\n"
+"second Tab lists the candidates when they have nothing more in common.\n"
+"\n"
+"= Variables\n"
+"\n"
+"$NAME and ${NAME} are replaced by the value of an environment variable, and $?\n"
+"by the status code of the last command, except inside single quotes. The value\n"
+"is never split into several arguments, but an unquoted variable which is unset\n"
+"or empty makes no argument at all.\n"
+"\n"
+"On Linux, unquoted *, ? and [...] in an argument match file names, one path\n"
+"component at a time, and the argument is replaced by the sorted matches. A\n"
+"pattern which matches nothing is kept as it is. Files starting with a dot only\n"
+"match a pattern starting with a dot.\n"
+"\n"
 "= Scripts\n"
 "\n"
 "For Windows batch files (*.bat), tinyshell uses cmd.exe internally to process\n"
@@ -214,157 +438,22 @@ int builtin_help(tinyshell *shell, int argc, char *argv[]) {
 "tinyshell batch script (.tbat). The shell simply execute the scripts line by\n"
 "line. *.tsh is only supported on Unix/POSIX, and *.tbat is only supported on\n"
 "Windows.\n"
+"\n"
+"`tinyshell <script>` runs a script of either kind, `tinyshell -c <command>` runs\n"
+"one command line and `tinyshell -q` runs the lines of its input. None of them\n"
+"print a prompt, echo the commands or report failed commands, and the exit\n"
+"status of the shell is the status of the last command.\n"
 // clang-format on
   );
   return 0;
 }
 
-#ifdef _WIN32
-static int exec_ls(const char* dir, int show_details) {
-  if(show_details) {
-    printf("\nDirectory of %s\n\n", dir);
-  }
-
-  char *pattern = printf_to_string("%s\\*", dir);
-  if (!pattern) {
-    return 1;
-  }
-
-  WIN32_FIND_DATA file_data;
-  HANDLE find = FindFirstFile(pattern, &file_data);
-  if (find == INVALID_HANDLE_VALUE) {
-    free(pattern);
-    return 1;
-  }
-
-  do {
-    if(!show_details) {
-      puts(file_data.cFileName);
-      continue;
-    }
-
-    SYSTEMTIME last_access_time;
-    if (!FileTimeToSystemTime(&file_data.ftLastAccessTime, &last_access_time)) {
-      puts("error converting last access time");
-      free(pattern);
-      return 1;
-    }
-
-    int hour = last_access_time.wHour;
-    if (hour == 0) {
-      hour = 12;
-    } else if (hour > 12) {
-      hour -= 12;
-    }
-
-    ULARGE_INTEGER ul;
-    ul.HighPart = file_data.nFileSizeHigh;
-    ul.LowPart = file_data.nFileSizeLow;
-
-    if (file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-      printf("%02d/%02d/%04d  %02d:%02d %cM   <DIR>        %s\n",
-             last_access_time.wMonth, last_access_time.wDay,
-             last_access_time.wYear, hour, last_access_time.wMinute,
-             last_access_time.wHour < 12 ? 'A' : 'P', file_data.cFileName);
-    } else {
-      printf("%02d/%02d/%04d  %02d:%02d %cM        %7lld %s\n",
-             last_access_time.wMonth, last_access_time.wDay,
-             last_access_time.wYear, hour, last_access_time.wMinute,
-             last_access_time.wHour < 12 ? 'A' : 'P', ul.QuadPart,
-             file_data.cFileName);
-    }
-  } while (FindNextFile(find, &file_data));
-  free(pattern);
-
-  return 0;
-}
-#else
-// Hàm để hiển thị quyền truy cập tệp tin
-static void printPermissions(mode_t mode) {
-  char permissions[11];
-  permissions[0] = (S_ISDIR(mode)) ? 'd' : '-';
-  permissions[1] = (mode & S_IRUSR) ? 'r' : '-';
-  permissions[2] = (mode & S_IWUSR) ? 'w' : '-';
-  permissions[3] = (mode & S_IXUSR) ? 'x' : '-';
-  permissions[4] = (mode & S_IRGRP) ? 'r' : '-';
-  permissions[5] = (mode & S_IWGRP) ? 'w' : '-';
-  permissions[6] = (mode & S_IXGRP) ? 'x' : '-';
-  permissions[7] = (mode & S_IROTH) ? 'r' : '-';
-  permissions[8] = (mode & S_IWOTH) ? 'w' : '-';
-  permissions[9] = (mode & S_IXOTH) ? 'x' : '-';
-  permissions[10] = '\0';
-
-  printf("%s ", permissions);
-}
-
-// Hàm so sánh cho qsort
-static int compare(const void *a, const void *b) {
-  const struct dirent *ea = a, *eb = b;
-  return strcmp(ea->d_name, eb->d_name);
-}
-
-static int exec_ls(const char* dir, int show_details) {
-  DIR *pDir;
-  struct stat fileStat;
-  struct dirent *entries = NULL;
-  int entries_len = 0, entries_cap = 0;
-
-  pDir = opendir(dir);
-
-  if (pDir == NULL) {
-    printf("cannot open directory '%s'\n", dir);
-    return 1;
-  }
-
-  // Đọc các entry trong thư mục và lưu tên vào mảng
-  struct dirent *entry;
-  while ((entry = readdir(pDir)) != NULL) {
-    vecpush(&entries, &entries_len, &entries_cap, sizeof *entry, entry, 1);
-  }
-
-  closedir(pDir);
-
-  // Sắp xếp các mục theo thứ tự bảng chữ cái
-  qsort(entries, entries_len, sizeof *entries, compare);
-
-  // In ra tên các mục
-  printf("total %d\n", entries_len);
-  for (int i = 0; i < entries_len; i++) {
-    if (show_details) {
-      char* name = printf_to_string("%s/%s", dir, entries[i].d_name);
-      if(!name) {
-        puts("error formatting path");
-        continue;
-      }
-
-      if (stat(name, &fileStat) < 0) {
-        perror("stat");
-        continue;
-      }
-      printPermissions(fileStat.st_mode);
-      printf("%ld ", fileStat.st_nlink);
-      printf("%s ", getpwuid(fileStat.st_uid)->pw_name);
-      printf("%s ", getgrgid(fileStat.st_gid)->gr_name);
-      printf("%5ld ", fileStat.st_size);
-
-      char timeBuf[80];
-      struct tm *timeInfo = localtime(&fileStat.st_mtime);
-      strftime(timeBuf, sizeof(timeBuf), "%m-%d-%Y", timeInfo);
-      printf("%s ", timeBuf);
-    }
-    printf("%s\n", entries[i].d_name);
-  }
-
-  free(entries); // Giải phóng bộ nhớ sau khi in
-  return 0;
-}
-#endif
 int builtin_ls(tinyshell *shell, int argc, char *argv[]) {
-  int showDetails = 0;
+  int flags = 0;
 
   // Kiểm tra các tham số đầu vào
-  if (argc > 3) {
-    printf("Usage: %s [-l] <dirname>\n", argv[0]);
+  if (argc > 5) {
+    output_printf("Usage: %s [-l] [-f] [-R] <dirname>\n", argv[0]);
     return 1;
   }
 
@@ -375,11 +464,21 @@ int builtin_ls(tinyshell *shell, int argc, char *argv[]) {
 
     if (arg[0] == '-') { // arg là một option
       if (strcmp(arg, "-l") == 0) {
-        showDetails = 1;
+        flags |= LS_DETAILS;
         continue;
       }
 
-      printf("Invalid option: %s\n", arg);
+      if (strcmp(arg, "-f") == 0) {
+        flags |= LS_UNSORTED;
+        continue;
+      }
+
+      if (strcmp(arg, "-R") == 0) {
+        flags |= LS_RECURSIVE;
+        continue;
+      }
+
+      output_printf("Invalid option: %s\n", arg);
       return 1;
     }
 
@@ -388,7 +487,7 @@ int builtin_ls(tinyshell *shell, int argc, char *argv[]) {
       continue;
     }
 
-    printf("Trailing argument: %s\n", arg);
+    output_printf("Trailing argument: %s\n", arg);
     return 1;
   }
 
@@ -396,184 +495,562 @@ int builtin_ls(tinyshell *shell, int argc, char *argv[]) {
     dir_path = ".";
   }
 
-  return exec_ls(dir_path, showDetails);
+  return exec_ls(dir_path, flags);
 }
 
+// jobs are only added and removed by the shell thread, so the job builtins
+// read them without bg_lock and only take it to touch the queue
 int builtin_jobs(tinyshell *shell, int argc, char *argv[]) {
-  tinyshell_lock_bg_procs(shell);
-  for (int i = 0; i < shell->bg_cap; ++i) {
-    if (shell->bg[i].status != BG_PROCESS_EMPTY &&
-        shell->bg[i].status != BG_PROCESS_FINISHED) {
-      printf("job %%%d (%s): %s\n", i + 1,
-             shell->bg[i].status == BG_PROCESS_RUNNING ? "running" : "stopped",
-             shell->bg[i].cmd);
+  int verbose = argc == 2 && strcmp(argv[1], "-v") == 0;
+  if (argc > 1 && !verbose) {
+    output_puts("usage: jobs [-v]");
+    return 1;
+  }
+
+  long long now = monotonic_ns();
+  for (int slot = shell->jobs.first; slot >= 0;) {
+    bg_process *bg = job_table_get(&shell->jobs, slot);
+    int status = atomic_int_load(&bg->status);
+    if (status != BG_PROCESS_FINISHED) {
+      const char *name = status == BG_PROCESS_RUNNING  ? "running"
+                         : status == BG_PROCESS_QUEUED ? "queued"
+                                                       : "stopped";
+      output_printf("job %%%d (%s): %s\n", bg->id, name, bg->cmd);
+      // CPU time and memory are only known for the stages which exited
+      if (verbose && status != BG_PROCESS_QUEUED) {
+        process_usage usage;
+        tinyshell_job_usage(bg, &usage);
+        output_printf("    ");
+        tinyshell_print_usage(&usage, now - bg->start_ns);
+        output_puts("");
+      }
     }
+    slot = bg->live_next;
   }
-  tinyshell_unlock_bg_procs(shell);
 
   return 0;
 }
 
+// `*slot` is the slot of the job in shell->jobs
 static int parse_job_identifier(const tinyshell *shell, const char *job,
-                                bg_process **p) {
-  int job_index;
+                                int *slot, bg_process **p) {
   if (job[0] != '%') {
-    printf("invalid job identifier: %s\n", job);
+    output_printf("invalid job identifier: %s\n", job);
     return 0;
   }
 
   char *end;
   errno = 0;
-  job_index = (int)strtol(&job[1], &end, 10) - 1;
-  if (end != job + strlen(job) || errno) {
-    printf("invalid job identifier: %s\n", job);
+  long id = strtol(&job[1], &end, 10);
+  if (end == &job[1] || *end != '\0' || errno || id <= 0 || id > INT_MAX) {
+    output_printf("invalid job identifier: %s\n", job);
     return 0;
   }
 
-  if (job_index < 0 || job_index >= shell->bg_cap ||
-      shell->bg[job_index].status == BG_PROCESS_EMPTY) {
-    printf("job not found: %s\n", job);
+  int found = job_table_find(&shell->jobs, (int)id);
+  if (found < 0 ||
+      atomic_int_load(&job_table_get(&shell->jobs, found)->status) ==
+          BG_PROCESS_FINISHED) {
+    output_printf("job not found: %s\n", job);
     return 0;
   }
 
+  if (slot) {
+    *slot = found;
+  }
   if (p) {
-    *p = &shell->bg[job_index];
+    *p = job_table_get(&shell->jobs, found);
   }
 
   return 1;
 }
 
-int builtin_kill(tinyshell *shell, int argc, char *argv[]) {
+// applies `action` to every process of the job that did not exit yet, the
+// stages must have been published by a RUNNING or STOPPED status
+static int for_each_job_process(bg_process *job, int (*action)(process *p)) {
+  int success = 1;
+  for (int i = 0; i < job->stages_len; ++i) {
+    if (!atomic_int_load(&job->stages[i].exited) &&
+        !action(&job->stages[i].p)) {
+      success = 0;
+    }
+  }
+  return success;
+}
+
+// cancels the job if it is still queued, it may have been started by the
+// reaper thread since its status was read
+static int cancel_queued_job(tinyshell *shell, int slot, bg_process *p) {
   tinyshell_lock_bg_procs(shell);
+  int queued = atomic_int_load(&p->status) == BG_PROCESS_QUEUED;
+  if (queued) {
+    tinyshell_cancel_queued_job(shell, slot);
+  }
+  tinyshell_unlock_bg_procs(shell);
+  return queued;
+}
+
+int builtin_kill(tinyshell *shell, int argc, char *argv[]) {
   for (int i = 1; i < argc; ++i) {
+    int slot;
     bg_process *p;
-    if (!parse_job_identifier(shell, argv[i], &p)) {
+    if (!parse_job_identifier(shell, argv[i], &slot, &p)) {
       return 1;
     }
 
-    int status_code;
-    if (!process_kill(&p->p)) {
-      printf("unable to kill job %s\n", argv[i]);
-      return 1;
+    if (atomic_int_load(&p->status) == BG_PROCESS_QUEUED &&
+        cancel_queued_job(shell, slot, p)) {
+      output_printf("job %s cancelled\n", argv[i]);
+      continue;
     }
 
-    tinyshell_unlock_bg_procs(shell);
-    thrd_join(p->thread, NULL);
-    p->status = BG_PROCESS_EMPTY;
+    // the exit is reported once the reaper sees the process go away
+    if (!for_each_job_process(p, process_kill)) {
+      output_printf("unable to kill job %s\n", argv[i]);
+      return 1;
+    }
   }
-  tinyshell_unlock_bg_procs(shell);
 
   return 0;
 }
 
 int builtin_stop(tinyshell *shell, int argc, char *argv[]) {
-  tinyshell_lock_bg_procs(shell);
   for (int i = 1; i < argc; ++i) {
     bg_process *p;
-    if (!parse_job_identifier(shell, argv[i], &p)) {
+    if (!parse_job_identifier(shell, argv[i], NULL, &p)) {
       return 1;
     }
 
-    if (p->status == BG_PROCESS_STOPPED) {
-      printf("job %s is already stopped\n", argv[i]);
+    int status = atomic_int_load(&p->status);
+    if (status == BG_PROCESS_STOPPED) {
+      output_printf("job %s is already stopped\n", argv[i]);
       continue;
     }
 
-    if (!process_suspend(&p->p)) {
-      printf("unable to suspend job %s\n", argv[i]);
+    if (status == BG_PROCESS_QUEUED) {
+      output_printf("job %s is queued\n", argv[i]);
+      continue;
+    }
+
+    if (!for_each_job_process(p, process_suspend)) {
+      output_printf("unable to suspend job %s\n", argv[i]);
       return 1;
     }
 
-    p->status = BG_PROCESS_STOPPED;
+    // fails if the job finished meanwhile, it must stay finished
+    atomic_int_compare_exchange(&p->status, BG_PROCESS_RUNNING,
+                                BG_PROCESS_STOPPED);
   }
-  tinyshell_unlock_bg_procs(shell);
 
   return 0;
 }
 
 int builtin_resume(tinyshell *shell, int argc, char *argv[]) {
-  tinyshell_lock_bg_procs(shell);
   for (int i = 1; i < argc; ++i) {
     bg_process *p;
-    if (!parse_job_identifier(shell, argv[i], &p)) {
+    if (!parse_job_identifier(shell, argv[i], NULL, &p)) {
       return 1;
     }
 
-    if (p->status == BG_PROCESS_RUNNING) {
-      printf("job %s is already running\n", argv[i]);
+    int status = atomic_int_load(&p->status);
+    if (status == BG_PROCESS_RUNNING) {
+      output_printf("job %s is already running\n", argv[i]);
       continue;
     }
 
-    if (!process_resume(&p->p)) {
-      printf("unable to resume job %s\n", argv[i]);
+    if (status == BG_PROCESS_QUEUED) {
+      output_printf("job %s is queued\n", argv[i]);
+      continue;
+    }
+
+    if (!for_each_job_process(p, process_resume)) {
+      output_printf("unable to resume job %s\n", argv[i]);
       return 1;
     }
 
-    p->status = BG_PROCESS_RUNNING;
+    atomic_int_compare_exchange(&p->status, BG_PROCESS_STOPPED,
+                                BG_PROCESS_RUNNING);
   }
-  tinyshell_unlock_bg_procs(shell);
 
   return 0;
 }
 
-static int add_path(tinyshell *shell, char **append, int free_path) {
+int builtin_addpath(tinyshell *shell, int argc, char *argv[]) {
 #ifdef _WIN32
 #define DELIM ";"
 #else
 #define DELIM ":"
 #endif
-  if (!shell->path) {
-    shell->path = *append;
-    *append = NULL;
+  char *path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    const char *prefix = path ? path : tinyshell_get_path_env(shell);
+    char *new_path = *prefix
+                         ? printf_to_string("%s" DELIM "%s", prefix, argv[i])
+                         : printf_to_string("%s", argv[i]);
+    free(path);
+    if (!new_path) {
+      output_printf("unable to allocate memory for the new path\n");
+      return 1;
+    }
+
+    path = new_path;
+  }
+
+  if (path && !tinyshell_set_env(shell, "PATH", path)) {
+    output_printf("unable to allocate memory for the new path\n");
+    free(path);
     return 1;
   }
 
-  char *new_path = printf_to_string("%s" DELIM "%s", shell->path, *append);
-  if (!new_path) {
-    if (free_path) {
-      free(shell->path);
-    }
+  free(path);
+  return 0;
+}
 
-    return 0;
+int builtin_setpath(tinyshell *shell, int argc, char *argv[]) {
+  if (argc != 2) {
+    output_printf("usage: %s <new path>\n", argc > 0 ? argv[0] : "setpath");
+    return 1;
   }
 
-  if (free_path) {
-    free(shell->path);
+  if (!tinyshell_set_env(shell, "PATH", argv[1])) {
+    output_printf("unable to allocate memory for the new path\n");
+    return 1;
   }
 
-  shell->path = new_path;
+  return 0;
+}
+
+int builtin_export(tinyshell *shell, int argc, char *argv[]) {
+  if (argc == 1) {
+    return builtin_env(shell, argc, argv);
+  }
 
-  return 1;
+  int status_code = 0;
+  for (int i = 1; i < argc; ++i) {
+    char *equals = strchr(argv[i], '=');
+    int name_len = equals ? (int)(equals - argv[i]) : (int)strlen(argv[i]);
+    if (!env_valid_name(argv[i], name_len)) {
+      output_printf("export: not a valid name: %s\n", argv[i]);
+      status_code = 1;
+      continue;
+    }
+
+    // every variable is exported already
+    if (!equals) {
+      continue;
+    }
+
+    *equals = '\0';
+    int ok = tinyshell_set_env(shell, argv[i], equals + 1);
+    *equals = '=';
+    if (!ok) {
+      output_printf("unable to allocate memory for %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  return status_code;
 }
 
-int builtin_addpath(tinyshell *shell, int argc, char *argv[]) {
-  char *old_path = shell->path;
+int builtin_unset(tinyshell *shell, int argc, char *argv[]) {
+  int status_code = 0;
   for (int i = 1; i < argc; ++i) {
-    if (!add_path(shell, &argv[i], i != 1)) {
-      goto fail_add_path;
+    if (!env_valid_name(argv[i], (int)strlen(argv[i]))) {
+      output_printf("unset: not a valid name: %s\n", argv[i]);
+      status_code = 1;
+      continue;
     }
+
+    tinyshell_set_env(shell, argv[i], NULL);
+  }
+
+  return status_code;
+}
+
+int builtin_env(tinyshell *shell, int argc, char *argv[]) {
+  if (argc != 1) {
+    output_printf("usage: %s\n", argv[0]);
+    return 1;
+  }
+
+  const env_block *env = env_get_block(&shell->env);
+  if (!env) {
+    output_printf("unable to allocate memory for the environment\n");
+    return 1;
   }
 
-  free(old_path);
+  for (int i = 0; i < env->len; ++i) {
+    output_puts(env->envp[i]);
+  }
   return 0;
+}
 
-fail_add_path:
-  shell->path = old_path;
+static int print_history_entry(void *userdata, int number,
+                               const char *command, size_t len) {
+  output_printf("%5d  %.*s\n", number, (int)len, command);
   return 1;
 }
 
-int builtin_setpath(tinyshell *shell, int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("usage: %s <new path>", argc > 0 ? argv[0] : "setpath");
+int builtin_history(tinyshell *shell, int argc, char *argv[]) {
+  const char *prefix = "";
+  int arg = 1;
+  if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+    prefix = argc >= 3 ? argv[2] : NULL;
+    arg = 3;
+  }
+
+  long count = 0;
+  char *end = "";
+  errno = 0;
+  if (arg < argc) {
+    count = strtol(argv[arg], &end, 10);
+  }
+  if (!prefix || argc > arg + 1 || *end != '\0' || errno || count < 0 ||
+      count > INT_MAX) {
+    output_printf("usage: %s [-s <prefix>] [count]\n", argv[0]);
+    return 1;
+  }
+
+  if (!shell->has_history) {
+    output_puts("history is disabled");
+    return 1;
+  }
+
+  if (!history_list(&shell->history, prefix, strlen(prefix), (int)count,
+                    print_history_entry, NULL)) {
+    output_printf("unable to read the history\n");
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_pipesize(tinyshell *shell, int argc, char *argv[]) {
+  if (argc == 1) {
+    output_printf("%d\n", shell->pipe_size);
+    return 0;
   }
 
-  free(shell->path);
-  shell->path = argv[1];
-  argv[1] = NULL;
+  char *end;
+  errno = 0;
+  long size = strtol(argv[1], &end, 10);
+  if (argc != 2 || *end != '\0' || errno || size < 0 || size > INT_MAX) {
+    output_printf("usage: %s [size in bytes, 0 for the system default]\n",
+                  argv[0]);
+    return 1;
+  }
+
+  shell->pipe_size = (int)size;
+  return 0;
+}
+
+int builtin_maxjobs(tinyshell *shell, int argc, char *argv[]) {
+  if (argc == 1) {
+    tinyshell_lock_bg_procs(shell);
+    output_printf("%d (%d running)\n", shell->max_jobs, shell->running_jobs);
+    tinyshell_unlock_bg_procs(shell);
+    return 0;
+  }
+
+  char *end;
+  errno = 0;
+  long max_jobs = strtol(argv[1], &end, 10);
+  if (argc != 2 || *end != '\0' || errno || max_jobs < 0 ||
+      max_jobs > INT_MAX) {
+    output_printf("usage: %s [number of jobs, 0 for no limit]\n", argv[0]);
+    return 1;
+  }
+
+  tinyshell_lock_bg_procs(shell);
+  shell->max_jobs = (int)max_jobs;
+  tinyshell_unlock_bg_procs(shell);
+  // the limit may have been raised
+  tinyshell_start_queued_jobs(shell);
   return 0;
 }
 
 int builtin_path(tinyshell *shell, int argc, char *argv[]) {
-  puts(tinyshell_get_path_env(shell));
+  output_puts(tinyshell_get_path_env(shell));
+  return 0;
+}
+
+int builtin_hash(tinyshell *shell, int argc, char *argv[]) {
+  exec_cache *cache = &shell->exec_cache;
+  if (argc == 1) {
+    if (cache->size == 0) {
+      output_puts("hash table empty");
+      return 0;
+    }
+
+    output_puts("hits    command");
+    for (int i = 0; i < cache->bucket_count; ++i) {
+      for (exec_cache_entry *entry = cache->buckets[i]; entry;
+           entry = entry->next) {
+        output_printf("%4d    %s -> %s\n", entry->hits, entry->name,
+                      entry->path ? entry->path : "(not found)");
+      }
+    }
+
+    return 0;
+  }
+
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    exec_cache_flush(cache);
+    // executables may also have been added since the completion index was built
+    if (shell->has_editor &&
+        !exec_index_update(&shell->exec_index, tinyshell_get_path_env(shell))) {
+      output_printf("unable to update the completion index\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  int status_code = 0;
+  for (int i = 1; i < argc; ++i) {
+    arena_mark mark = arena_save(&shell->arena);
+    if (!find_executable(argv[i], shell, &shell->arena)) {
+      output_printf("hash: %s: not found\n", argv[i]);
+      status_code = 1;
+    }
+    arena_rewind(&shell->arena, mark);
+  }
+
+  return status_code;
+}
+
+static void print_spawn_stats(const tinyshell *shell) {
+  output_puts("  backend          spawns   avg (us)   min (us)   max (us)");
+  for (int i = 0; i < spawn_backends_len; ++i) {
+    const spawn_stats *stats = &shell->spawn_stats[i];
+    output_printf("%c %-14s %8lld", i == shell->spawn_backend ? '*' : ' ',
+                  spawn_backends[i], stats->count);
+    if (stats->count > 0) {
+      output_printf(" %10.1f %10.1f %10.1f",
+                    stats->total_ns / 1000.0 / stats->count,
+                    stats->min_ns / 1000.0, stats->max_ns / 1000.0);
+    }
+    output_puts("");
+  }
+}
+
+// starts argv[0] `count` times with every backend
+static int benchmark_spawn(tinyshell *shell, int count, int argc,
+                           char *argv[]) {
+  const char *binary_path = find_executable(argv[0], shell, &shell->arena);
+  if (!binary_path) {
+    output_printf("executable not found: %s\n", argv[0]);
+    return 1;
+  }
+
+  arena_string command = {NULL, 0};
+  for (int i = 0; i < argc; ++i) {
+    if (!arena_string_append(&shell->arena, &command, argv[i],
+                             strlen(argv[i])) ||
+        !arena_string_append(&shell->arena, &command, i + 1 < argc ? " " : "",
+                             1)) {
+      output_puts("unable to allocate memory for command");
+      return 1;
+    }
+  }
+
+  command_stage stage = {argc, argv, NULL, 0};
+  command_parse_result parse_result = {argc, argv, 1, &stage, 1};
+  const env_block *env = env_get_block(&shell->env);
+  if (!env) {
+    output_puts("unable to allocate memory for the environment");
+    return 1;
+  }
+
+  output_flush();
+  spawn_context ctx;
+  spawn_context_current(&ctx, shell);
+  for (int b = 0; b < spawn_backends_len; ++b) {
+    ctx.backend = b;
+    for (int i = 0; i < count; ++i) {
+      process p;
+      char *error = NULL;
+      long long start = monotonic_ns();
+      if (!process_create(&p, &binary_path, &ctx, env, command.data,
+                          &parse_result, &error)) {
+        output_printf("%s: %s\n", spawn_backends[b],
+                      error ? error : "spawn failed");
+        free(error);
+        break;
+      }
+      tinyshell_record_spawn(shell, b, monotonic_ns() - start, 1);
+      process_wait_for(&p, NULL, NULL);
+      process_free(&p);
+    }
+  }
+
+  print_spawn_stats(shell);
+  return 0;
+}
+
+int builtin_spawn(tinyshell *shell, int argc, char *argv[]) {
+  if (argc == 1) {
+    print_spawn_stats(shell);
+    return 0;
+  }
+
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    memset(shell->spawn_stats, 0, sizeof shell->spawn_stats);
+    return 0;
+  }
+
+  if (argc >= 4 && strcmp(argv[1], "-b") == 0) {
+    int count = atoi(argv[2]);
+    if (count <= 0) {
+      output_printf("%s: invalid count %s\n", argv[0], argv[2]);
+      return 1;
+    }
+    return benchmark_spawn(shell, count, argc - 3, argv + 3);
+  }
+
+  if (argc == 2) {
+    for (int i = 0; i < spawn_backends_len; ++i) {
+      if (strcmp(argv[1], spawn_backends[i]) == 0) {
+        shell->spawn_backend = i;
+        return 0;
+      }
+    }
+    output_printf("%s: unknown backend %s\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  output_printf("usage: %s [backend | -r | -b <count> <command> [args...]]\n",
+                argv[0]);
+  return 1;
+}
+
+int builtin_stats(tinyshell *shell, int argc, char *argv[]) {
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    stats_reset(&shell->stats);
+    shell->arena.allocations = 0;
+    shell->arena.blocks_allocated = 0;
+    return 0;
+  }
+
+  if (argc != 1) {
+    output_puts("usage: stats [-r]");
+    return 1;
+  }
+
+  output_puts("step                  count   p50 (us)   p99 (us)   max (us)");
+  for (int i = 0; i < STATS_STEPS_LEN; ++i) {
+    const stats_histogram *histogram = &shell->stats.steps[i];
+    output_printf("%-16s %10lld %10.1f %10.1f %10.1f\n", stats_step_names[i],
+                  histogram->count, stats_percentile(histogram, 50) / 1000.0,
+                  stats_percentile(histogram, 99) / 1000.0,
+                  histogram->max_ns / 1000.0);
+  }
+
+  output_puts("");
+  for (int i = 0; i < STATS_COUNTERS_LEN; ++i) {
+    output_printf("%-26s %lld\n", stats_counter_names[i],
+                  shell->stats.counters[i]);
+  }
+  output_printf("%-26s %zu (%zu blocks)\n", "arena allocations",
+                shell->arena.allocations, shell->arena.blocks_allocated);
+
   return 0;
 }
@@ -6,6 +6,15 @@
 int try_run_builtin(tinyshell *shell, command_parse_result *result,
                     int *status_code);
 
+// returns NULL if `name` is neither a builtin nor a registered command
+tinyshell_builtin find_builtin(const tinyshell *shell, const char *name);
+void free_registered_builtins(tinyshell *shell);
+// calls `callback` with the name of every builtin and registered command,
+// returns 0 if `callback` failed
+int list_builtins(const tinyshell *shell,
+                  int (*callback)(void *userdata, const char *name),
+                  void *userdata);
+
 int builtin_cd(tinyshell *shell, int argc, char *argv[]);
 int builtin_pwd(tinyshell *shell, int argc, char *argv[]);
 int builtin_date(tinyshell *shell, int argc, char *argv[]);
@@ -20,3 +29,12 @@ int builtin_resume(tinyshell *shell, int argc, char *argv[]);
 int builtin_addpath(tinyshell *shell, int argc, char *argv[]);
 int builtin_setpath(tinyshell *shell, int argc, char *argv[]);
 int builtin_path(tinyshell *shell, int argc, char *argv[]);
+int builtin_hash(tinyshell *shell, int argc, char *argv[]);
+int builtin_pipesize(tinyshell *shell, int argc, char *argv[]);
+int builtin_spawn(tinyshell *shell, int argc, char *argv[]);
+int builtin_maxjobs(tinyshell *shell, int argc, char *argv[]);
+int builtin_stats(tinyshell *shell, int argc, char *argv[]);
+int builtin_export(tinyshell *shell, int argc, char *argv[]);
+int builtin_unset(tinyshell *shell, int argc, char *argv[]);
+int builtin_env(tinyshell *shell, int argc, char *argv[]);
+int builtin_history(tinyshell *shell, int argc, char *argv[]);
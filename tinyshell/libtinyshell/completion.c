@@ -0,0 +1,222 @@
+#include "completion.h"
+#include "builtin.h"
+#include "exec_index.h"
+#include "glob.h"
+#include "tinyshell.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// what parse_command needs escaped in an argument
+#ifdef _WIN32
+#define ESCAPE_CHAR '^'
+#define IS_QUOTE(c) ((c) == '"')
+#define SPECIAL_CHARS " \t\"^|&<>$"
+#else
+#define ESCAPE_CHAR '\\'
+#define IS_QUOTE(c) ((c) == '"' || (c) == '\'')
+#define SPECIAL_CHARS " \t\"'\\|&<>$*?["
+#endif
+
+typedef struct {
+  // replaces the word
+  char *full;
+  // shown to the user
+  char *display;
+} candidate;
+
+typedef struct {
+  arena *arena;
+  const char *word;
+  size_t word_len;
+  // the directory part of file names is not shown
+  size_t display_offset;
+  candidate *items;
+  int len;
+  int cap;
+} candidate_list;
+
+void completion_init(completion *c) {
+  arena_init(&c->arena);
+  c->word_start = 0;
+  c->replacement = NULL;
+  c->candidates = NULL;
+  c->candidates_len = 0;
+  c->candidates_cap = 0;
+}
+
+void completion_destroy(completion *c) {
+  free(c->candidates);
+  arena_free(&c->arena);
+}
+
+static int add_candidate(candidate_list *list, const char *full,
+                         const char *suffix) {
+  char *copy = arena_printf(list->arena, "%s%s", full, suffix);
+  candidate c = {copy, copy ? copy + list->display_offset : NULL};
+  return copy && vecpush(&list->items, &list->len, &list->cap, sizeof c, &c, 1);
+}
+
+static int add_command(void *userdata, const char *name) {
+  candidate_list *list = userdata;
+  if (strncmp(name, list->word, list->word_len) != 0) {
+    return 1;
+  }
+  return add_candidate(list, name, "");
+}
+
+static int add_file(void *userdata, const char *path) {
+  candidate_list *list = userdata;
+  struct stat st;
+  int is_dir = stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+  return add_candidate(list, path, is_dir ? "/" : "");
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  return strcmp(((const candidate *)a)->full, ((const candidate *)b)->full);
+}
+
+// finds the word before the cursor, without its quotes and escapes, and
+// whether it is the first word of a command
+static int scan_word(const char *line, size_t cursor, completion *result,
+                     arena_string *word, int *is_command) {
+  int command_next = 1;
+  int in_word = 0;
+  char quote = '\0';
+  result->word_start = cursor;
+  *is_command = 1;
+  for (size_t i = 0; i < cursor; ++i) {
+    char c = line[i];
+    int special = !quote && (c == ' ' || c == '\t' || strchr("|&<>", c));
+    if (!in_word && !special) {
+      in_word = 1;
+      result->word_start = i;
+      arena_string_truncate(&result->arena, word, 0);
+      *is_command = command_next;
+    }
+
+    if (c == ESCAPE_CHAR && i + 1 < cursor) {
+      if (!arena_string_append(&result->arena, word, &line[++i], 1)) {
+        return 0;
+      }
+    } else if (quote ? c == quote : IS_QUOTE(c)) {
+      quote = quote ? '\0' : c;
+    } else if (special) {
+      if (in_word) {
+        in_word = 0;
+        command_next = 0;
+      }
+      if (c != ' ' && c != '\t') {
+        command_next = c == '|';
+      }
+    } else if (!arena_string_append(&result->arena, word, &c, 1)) {
+      return 0;
+    }
+  }
+
+  if (!in_word) {
+    result->word_start = cursor;
+    arena_string_truncate(&result->arena, word, 0);
+    *is_command = command_next;
+  }
+  return arena_string_append(&result->arena, word, "", 1);
+}
+
+static int list_files(candidate_list *list) {
+  const char *slash = strrchr(list->word, '/');
+  list->display_offset = slash ? (size_t)(slash - list->word) + 1 : 0;
+
+  // the word is matched literally
+  arena_string pattern = {NULL, 0};
+  for (const char *c = list->word; *c; ++c) {
+    if ((strchr("*?[\\", *c) &&
+         !arena_string_append(list->arena, &pattern, "\\", 1)) ||
+        !arena_string_append(list->arena, &pattern, c, 1)) {
+      return 0;
+    }
+  }
+  if (!arena_string_append(list->arena, &pattern, "*", 2)) {
+    return 0;
+  }
+
+  glob_cache globs;
+  glob_cache_init(&globs);
+  int ok = glob_expand(&globs, pattern.data, add_file, list) >= 0;
+  glob_cache_destroy(&globs);
+  return ok;
+}
+
+static char *escape(arena *a, const char *str, size_t len, const char *suffix) {
+  arena_string escaped = {NULL, 0};
+  for (size_t i = 0; i < len; ++i) {
+    if ((strchr(SPECIAL_CHARS, str[i]) &&
+         !arena_string_append(a, &escaped, (char[]){ESCAPE_CHAR}, 1)) ||
+        !arena_string_append(a, &escaped, &str[i], 1)) {
+      return NULL;
+    }
+  }
+  return arena_string_append(a, &escaped, suffix, strlen(suffix) + 1)
+             ? escaped.data
+             : NULL;
+}
+
+int complete_line(tinyshell *shell, const char *line, size_t cursor,
+                  completion *result) {
+  arena_string word = {NULL, 0};
+  int is_command;
+  if (!scan_word(line, cursor, result, &word, &is_command)) {
+    return 0;
+  }
+
+  candidate_list list = {&result->arena, word.data, word.len - 1, 0, NULL, 0,
+                         0};
+  int ok;
+  if (is_command && !strchr(list.word, '/')) {
+    ok = list_builtins(shell, add_command, &list) &&
+         exec_index_complete(&shell->exec_index, list.word, add_command,
+                             &list);
+  } else {
+    ok = list_files(&list);
+  }
+  if (!ok) {
+    goto done;
+  }
+
+  // a builtin may also be an executable
+  qsort(list.items, list.len, sizeof *list.items, compare_candidates);
+  for (int i = 0; i < list.len && ok; ++i) {
+    if (i == 0 || strcmp(list.items[i].full, list.items[i - 1].full) != 0) {
+      ok = vecpush(&result->candidates, &result->candidates_len,
+                   &result->candidates_cap, sizeof(char *),
+                   &list.items[i].display, 1);
+    }
+  }
+  if (!ok || list.len == 0) {
+    goto done;
+  }
+
+  // the longest prefix of every candidate, the first and the last are enough
+  // since they are sorted
+  const char *first = list.items[0].full;
+  const char *last = list.items[list.len - 1].full;
+  size_t common = 0;
+  while (first[common] && first[common] == last[common]) {
+    ++common;
+  }
+
+  // a single candidate is complete, so the next word can be typed right away
+  if (result->candidates_len == 1) {
+    const char *suffix = common > 0 && first[common - 1] == '/' ? "" : " ";
+    ok = (result->replacement = escape(&result->arena, first, common,
+                                       suffix)) != NULL;
+  } else if (common > list.word_len) {
+    ok = (result->replacement = escape(&result->arena, first, common, "")) !=
+         NULL;
+  }
+
+done:
+  free(list.items);
+  return ok;
+}
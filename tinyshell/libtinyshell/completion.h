@@ -0,0 +1,35 @@
+#pragma once
+
+#include "arena.h"
+
+#include <stddef.h>
+
+typedef struct tinyshell tinyshell;
+
+// Completion of the word before the cursor, for the line editor: command names
+// (builtins, and the executables of the PATH from shell->exec_index) for the
+// first word of a command, file names for the other words and for any word
+// with a slash.
+
+typedef struct {
+  // every string of the completion
+  arena arena;
+  // the completed word is line[word_start..cursor)
+  size_t word_start;
+  // replaces the word, with the special characters escaped, or NULL if the
+  // candidates have nothing in common beyond the word
+  char *replacement;
+  // what the word may complete to, sorted and unique, as they are shown to the
+  // user: file names are without their directory and directories end with a
+  // slash
+  char **candidates;
+  int candidates_len;
+  int candidates_cap;
+} completion;
+
+void completion_init(completion *c);
+void completion_destroy(completion *c);
+
+// `line` is not null-terminated at `cursor`, the part after it is left as it is
+int complete_line(tinyshell *shell, const char *line, size_t cursor,
+                  completion *result);
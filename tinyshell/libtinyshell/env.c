@@ -0,0 +1,263 @@
+#include "env.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENV_INITIAL_BUCKETS 64
+
+#ifdef _WIN32
+#define FOLD(c) tolower((unsigned char)(c))
+#else
+#define FOLD(c) ((unsigned char)(c))
+#endif
+
+// 32-bit FNV-1a, like hash_string, of the first `len` characters
+static unsigned hash_name(const char *name, int len) {
+  unsigned hash = 2166136261u;
+  for (int i = 0; i < len; ++i) {
+    hash ^= (unsigned)FOLD(name[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int compare_names(const char *a, int a_len, const char *b, int b_len) {
+  for (int i = 0; i < a_len && i < b_len; ++i) {
+    if (FOLD(a[i]) != FOLD(b[i])) {
+      return FOLD(a[i]) < FOLD(b[i]) ? -1 : 1;
+    }
+  }
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+void env_init(shell_env *env) {
+  env->buckets = NULL;
+  env->bucket_count = 0;
+  env->size = 0;
+  env->block = NULL;
+}
+
+void env_destroy(shell_env *env) {
+  for (int i = 0; i < env->bucket_count; ++i) {
+    env_var *var = env->buckets[i];
+    while (var) {
+      env_var *next = var->next;
+      free(var);
+      var = next;
+    }
+  }
+  free(env->buckets);
+  env_block_release(env->block);
+  env_init(env);
+}
+
+static void invalidate_block(shell_env *env) {
+  env_block_release(env->block);
+  env->block = NULL;
+}
+
+static env_var **find_var(const shell_env *env, const char *name, int len,
+                          unsigned hash) {
+  if (env->bucket_count == 0) {
+    return NULL;
+  }
+
+  for (env_var **link = &env->buckets[hash % env->bucket_count]; *link;
+       link = &(*link)->next) {
+    env_var *var = *link;
+    if (var->hash == hash &&
+        compare_names(var->entry, var->name_len, name, len) == 0) {
+      return link;
+    }
+  }
+
+  return NULL;
+}
+
+static int grow(shell_env *env) {
+  int bucket_count =
+      env->bucket_count ? env->bucket_count * 2 : ENV_INITIAL_BUCKETS;
+  env_var **buckets = calloc(bucket_count, sizeof *buckets);
+  if (!buckets) {
+    return 0;
+  }
+
+  for (int i = 0; i < env->bucket_count; ++i) {
+    env_var *var = env->buckets[i];
+    while (var) {
+      env_var *next = var->next;
+      var->next = buckets[var->hash % bucket_count];
+      buckets[var->hash % bucket_count] = var;
+      var = next;
+    }
+  }
+
+  free(env->buckets);
+  env->buckets = buckets;
+  env->bucket_count = bucket_count;
+  return 1;
+}
+
+// `name` is the first `name_len` characters of `name`
+static int set_var(shell_env *env, const char *name, int name_len,
+                   const char *value) {
+  size_t value_len = strlen(value);
+  env_var *var = malloc(sizeof *var + name_len + 1 + value_len + 1);
+  if (!var) {
+    return 0;
+  }
+
+  var->hash = hash_name(name, name_len);
+  var->name_len = name_len;
+  memcpy(var->entry, name, name_len);
+  var->entry[name_len] = '=';
+  memcpy(var->entry + name_len + 1, value, value_len + 1);
+
+  env_var **link = find_var(env, name, name_len, var->hash);
+  if (link) {
+    env_var *old = *link;
+    var->next = old->next;
+    *link = var;
+    free(old);
+  } else {
+    if (env->size >= env->bucket_count && !grow(env)) {
+      free(var);
+      return 0;
+    }
+
+    env_var **bucket = &env->buckets[var->hash % env->bucket_count];
+    var->next = *bucket;
+    *bucket = var;
+    ++env->size;
+  }
+
+  invalidate_block(env);
+  return 1;
+}
+
+int env_import(shell_env *env, char *const *envp) {
+  for (; envp && *envp; ++envp) {
+    const char *equals = strchr(*envp, '=');
+    // Win32 keeps the current directory of each drive in variables such as
+    // `=C:`, they are not variables of the shell
+    if (!equals || equals == *envp) {
+      continue;
+    }
+
+    if (!set_var(env, *envp, (int)(equals - *envp), equals + 1)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+const char *env_get(const shell_env *env, const char *name) {
+  return env_lookup(env, name, (int)strlen(name));
+}
+
+const char *env_lookup(const shell_env *env, const char *name, int len) {
+  env_var **link = find_var(env, name, len, hash_name(name, len));
+  return link ? (*link)->entry + (*link)->name_len + 1 : NULL;
+}
+
+int env_set(shell_env *env, const char *name, const char *value) {
+  return set_var(env, name, (int)strlen(name), value);
+}
+
+int env_unset(shell_env *env, const char *name) {
+  int len = (int)strlen(name);
+  env_var **link = find_var(env, name, len, hash_name(name, len));
+  if (!link) {
+    return 0;
+  }
+
+  env_var *var = *link;
+  *link = var->next;
+  free(var);
+  --env->size;
+  invalidate_block(env);
+  return 1;
+}
+
+int env_valid_name(const char *name, int len) {
+  if (len <= 0 || isdigit((unsigned char)name[0])) {
+    return 0;
+  }
+
+  for (int i = 0; i < len; ++i) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int env_same_name(const char *a, const char *b) {
+  return compare_names(a, (int)strlen(a), b, (int)strlen(b)) == 0;
+}
+
+static int compare_vars(const void *a, const void *b) {
+  const env_var *x = *(env_var *const *)a, *y = *(env_var *const *)b;
+  return compare_names(x->entry, x->name_len, y->entry, y->name_len);
+}
+
+env_block *env_get_block(shell_env *env) {
+  if (env->block) {
+    return env->block;
+  }
+
+  env_var **vars = malloc((env->size + 1) * sizeof *vars);
+  if (!vars) {
+    return NULL;
+  }
+
+  int len = 0;
+  // one more terminator ends the Win32 block (and keeps it valid when empty)
+  size_t data_size = 2;
+  for (int i = 0; i < env->bucket_count; ++i) {
+    for (env_var *var = env->buckets[i]; var; var = var->next) {
+      vars[len++] = var;
+      data_size += strlen(var->entry) + 1;
+    }
+  }
+  qsort(vars, len, sizeof *vars, compare_vars);
+
+  env_block *block = malloc(sizeof *block + (len + 1) * sizeof(char *));
+  char *data = block ? malloc(data_size) : NULL;
+  if (!data) {
+    free(block);
+    free(vars);
+    return NULL;
+  }
+
+  atomic_int_store(&block->refs, 1);
+  block->len = len;
+  block->data = data;
+  for (int i = 0; i < len; ++i) {
+    size_t size = strlen(vars[i]->entry) + 1;
+    memcpy(data, vars[i]->entry, size);
+    block->envp[i] = data;
+    data += size;
+  }
+  block->envp[len] = NULL;
+  data[0] = data[1] = '\0';
+  free(vars);
+
+  env->block = block;
+  return block;
+}
+
+env_block *env_block_acquire(env_block *block) {
+  atomic_int_fetch_add(&block->refs, 1);
+  return block;
+}
+
+void env_block_release(env_block *block) {
+  if (block && atomic_int_fetch_add(&block->refs, -1) == 1) {
+    free(block->data);
+    free(block);
+  }
+}
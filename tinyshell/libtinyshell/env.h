@@ -0,0 +1,67 @@
+#pragma once
+
+#include "atomics.h"
+
+// Environment variables of the shell, passed to every process it starts.
+//
+// Variables live in a hash table. The NAME=value array handed to the spawn
+// call (an env_block) is built the first time it is needed after a variable
+// changed and shared by every process started until the next change, so
+// starting a process does not depend on the size of the environment.
+//
+// Names are case-insensitive on Win32, like the names of the process
+// environment there.
+
+typedef struct env_var {
+  struct env_var *next;
+  unsigned hash;
+  int name_len;
+  // NAME=value
+  char entry[];
+} env_var;
+
+// Immutable snapshot of the variables, sorted by name. Jobs waiting in the
+// queue keep a reference to the snapshot taken when they were entered, so the
+// last reference may be released on another thread.
+typedef struct {
+  atomic_int_t refs;
+  int len;
+  // NAME=value\0NAME=value\0...\0, the Win32 environment block
+  char *data;
+  // NULL-terminated, pointing into `data`
+  char *envp[];
+} env_block;
+
+typedef struct {
+  env_var **buckets;
+  int bucket_count;
+  int size;
+  // NULL until requested after a change, holds one reference
+  env_block *block;
+} shell_env;
+
+void env_init(shell_env *env);
+void env_destroy(shell_env *env);
+
+// copies the NAME=value entries of a process environment such as `environ`
+int env_import(shell_env *env, char *const *envp);
+
+// returns NULL if `name` is not set
+const char *env_get(const shell_env *env, const char *name);
+// the same for the first `len` characters of `name`
+const char *env_lookup(const shell_env *env, const char *name, int len);
+int env_set(shell_env *env, const char *name, const char *value);
+// returns 0 if `name` was not set
+int env_unset(shell_env *env, const char *name);
+
+// letters, digits and underscores, not starting with a digit
+int env_valid_name(const char *name, int len);
+// whether `a` and `b` name the same variable
+int env_same_name(const char *a, const char *b);
+
+// returns the snapshot of the current variables, without taking a reference,
+// or NULL on allocation failure
+env_block *env_get_block(shell_env *env);
+env_block *env_block_acquire(env_block *block);
+// `block` may be NULL
+void env_block_release(env_block *block);
@@ -0,0 +1,328 @@
+#include "exec_cache.h"
+#include "redirect.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define PATH_DELIM ";"
+#else
+#define PATH_DELIM ":"
+#endif
+
+#define EXEC_CACHE_INITIAL_BUCKETS 64
+
+int exec_cache_init(exec_cache *cache) {
+  cache->buckets = NULL;
+  cache->bucket_count = 0;
+  cache->size = 0;
+  cache->dirs = NULL;
+  cache->dirs_len = 0;
+  cache->dirs_valid = 0;
+  cache->inotify_fd = -1;
+#ifdef __linux__
+  cache->inotify_fd =
+      redirect_move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+#endif
+  return 1;
+}
+
+static void free_entries(exec_cache *cache) {
+  for (int i = 0; i < cache->bucket_count; ++i) {
+    exec_cache_entry *entry = cache->buckets[i];
+    while (entry) {
+      exec_cache_entry *next = entry->next;
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    cache->buckets[i] = NULL;
+  }
+  cache->size = 0;
+}
+
+static void free_dirs(exec_cache *cache) {
+  for (int i = 0; i < cache->dirs_len; ++i) {
+#ifdef __linux__
+    if (cache->dirs[i].wd >= 0) {
+      inotify_rm_watch(cache->inotify_fd, cache->dirs[i].wd);
+    }
+#endif
+    free(cache->dirs[i].path);
+  }
+  free(cache->dirs);
+  cache->dirs = NULL;
+  cache->dirs_len = 0;
+  cache->dirs_valid = 0;
+}
+
+void exec_cache_destroy(exec_cache *cache) {
+  free_entries(cache);
+  free_dirs(cache);
+  free(cache->buckets);
+#ifdef __linux__
+  if (cache->inotify_fd >= 0) {
+    close(cache->inotify_fd);
+  }
+#endif
+}
+
+void exec_cache_flush(exec_cache *cache) {
+  free_entries(cache);
+  free_dirs(cache);
+}
+
+static void record_mtime(exec_cache_dir *dir) {
+  struct stat s;
+  if (stat(dir->path, &s) != 0) {
+    // a missing directory is a valid state, creating it later changes the
+    // recorded value
+    dir->mtime = (time_t)-1;
+    dir->racy = 0;
+    return;
+  }
+
+  dir->mtime = s.st_mtime;
+  dir->racy = s.st_mtime >= time(NULL);
+}
+
+static int dir_changed(exec_cache_dir *dir) {
+  time_t old_mtime = dir->mtime;
+  int was_racy = dir->racy;
+  record_mtime(dir);
+  return was_racy || dir->mtime != old_mtime;
+}
+
+const exec_cache_dir *exec_cache_dirs(exec_cache *cache, const char *path_env,
+                                      int *dirs_len) {
+  if (cache->dirs_valid) {
+    *dirs_len = cache->dirs_len;
+    return cache->dirs;
+  }
+
+  char *path = printf_to_string("%s", path_env);
+  if (!path) {
+    return NULL;
+  }
+
+  int dirs_cap = 0;
+  char *saveptr;
+  for (char *token = reentrant_strtok(path, PATH_DELIM, &saveptr); token;
+       token = reentrant_strtok(NULL, PATH_DELIM, &saveptr)) {
+    exec_cache_dir dir;
+    dir.path = printf_to_string("%s", token);
+    if (!dir.path) {
+      goto fail;
+    }
+
+    dir.wd = -1;
+#ifdef __linux__
+    if (cache->inotify_fd >= 0) {
+      // a file becoming executable only changes its attributes
+      dir.wd = inotify_add_watch(cache->inotify_fd, dir.path,
+                                 IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                     IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                                     IN_MOVE_SELF | IN_ONLYDIR);
+    }
+#endif
+    if (dir.wd < 0) {
+      record_mtime(&dir);
+    }
+
+    if (!vecpush(&cache->dirs, &cache->dirs_len, &dirs_cap, sizeof dir, &dir,
+                 1)) {
+      free(dir.path);
+      goto fail;
+    }
+  }
+
+  free(path);
+  cache->dirs_valid = 1;
+  *dirs_len = cache->dirs_len;
+  return cache->dirs;
+
+fail:
+  free(path);
+  free_dirs(cache);
+  return NULL;
+}
+
+static void invalidate_from(exec_cache *cache, int first_dir) {
+  for (int i = 0; i < cache->bucket_count; ++i) {
+    exec_cache_entry **link = &cache->buckets[i];
+    while (*link) {
+      exec_cache_entry *entry = *link;
+      if (entry->dir >= first_dir) {
+        *link = entry->next;
+        free(entry->path);
+        free(entry);
+        --cache->size;
+      } else {
+        link = &entry->next;
+      }
+    }
+  }
+}
+
+// returns the index of the first directory changed since the last call, or
+// dirs_len + 1 if nothing changed
+static int first_changed_dir(exec_cache *cache, int last_dir) {
+  int first = cache->dirs_len + 1;
+#ifdef __linux__
+  if (cache->inotify_fd >= 0) {
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(cache->inotify_fd, buffer, sizeof buffer)) > 0) {
+      for (char *ptr = buffer; ptr < buffer + len;) {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+        ptr += sizeof *event + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          first = 0;
+          continue;
+        }
+
+        for (int i = 0; i < cache->dirs_len; ++i) {
+          if (cache->dirs[i].wd != event->wd) {
+            continue;
+          }
+
+          if (event->mask & IN_IGNORED) {
+            // the directory is gone, fall back to mtime checks
+            cache->dirs[i].wd = -1;
+            record_mtime(&cache->dirs[i]);
+          }
+
+          first = i < first ? i : first;
+        }
+      }
+    }
+  }
+#endif
+
+  // unwatched directories are checked by mtime, but only those that the entry
+  // depends on
+  for (int i = 0; i <= last_dir && i < cache->dirs_len && i < first; ++i) {
+    if (cache->dirs[i].wd < 0 && dir_changed(&cache->dirs[i])) {
+      first = i;
+    }
+  }
+
+  return first;
+}
+
+static exec_cache_entry *find_entry(exec_cache *cache, const char *name,
+                                    unsigned hash) {
+  if (cache->bucket_count == 0) {
+    return NULL;
+  }
+
+  for (exec_cache_entry *entry = cache->buckets[hash % cache->bucket_count];
+       entry; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+exec_cache_entry *exec_cache_lookup(exec_cache *cache, const char *path_env,
+                                    const char *name) {
+  int dirs_len;
+  if (!exec_cache_dirs(cache, path_env, &dirs_len)) {
+    return NULL;
+  }
+
+  unsigned hash = hash_string(name);
+  exec_cache_entry *entry = find_entry(cache, name, hash);
+  int first = first_changed_dir(cache, entry ? entry->dir : -1);
+  if (first <= dirs_len) {
+    invalidate_from(cache, first);
+    entry = find_entry(cache, name, hash);
+  }
+
+  if (entry) {
+    ++entry->hits;
+  }
+
+  return entry;
+}
+
+static int grow_buckets(exec_cache *cache) {
+  int new_count = cache->bucket_count ? cache->bucket_count * 2
+                                      : EXEC_CACHE_INITIAL_BUCKETS;
+  exec_cache_entry **new_buckets = calloc(new_count, sizeof *new_buckets);
+  if (!new_buckets) {
+    return 0;
+  }
+
+  for (int i = 0; i < cache->bucket_count; ++i) {
+    exec_cache_entry *entry = cache->buckets[i];
+    while (entry) {
+      exec_cache_entry *next = entry->next;
+      exec_cache_entry **bucket = &new_buckets[entry->hash % new_count];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+
+  free(cache->buckets);
+  cache->buckets = new_buckets;
+  cache->bucket_count = new_count;
+  return 1;
+}
+
+exec_cache_entry *exec_cache_insert(exec_cache *cache, const char *name,
+                                    const char *path, int dir) {
+  if (cache->size >= cache->bucket_count && !grow_buckets(cache)) {
+    return NULL;
+  }
+
+  unsigned hash = hash_string(name);
+  exec_cache_entry *entry = find_entry(cache, name, hash);
+  if (entry) {
+    char *new_path = NULL;
+    if (path && !(new_path = printf_to_string("%s", path))) {
+      return NULL;
+    }
+
+    free(entry->path);
+    entry->path = new_path;
+    entry->dir = dir;
+    return entry;
+  }
+
+  size_t name_len = strlen(name);
+  entry = malloc(sizeof *entry + name_len + 1);
+  if (!entry) {
+    return NULL;
+  }
+
+  entry->path = NULL;
+  if (path && !(entry->path = printf_to_string("%s", path))) {
+    free(entry);
+    return NULL;
+  }
+
+  memcpy(entry->name, name, name_len + 1);
+  entry->hash = hash;
+  entry->dir = dir;
+  entry->hits = 0;
+
+  exec_cache_entry **bucket = &cache->buckets[hash % cache->bucket_count];
+  entry->next = *bucket;
+  *bucket = entry;
+  ++cache->size;
+  return entry;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <time.h>
+
+// Cache of PATH lookups done by find_executable.
+//
+// Each entry maps a command name to the binary it resolved to, or to NULL if
+// the command was not found in any PATH directory (a negative entry). An entry
+// found in the i-th PATH directory only depends on directories 0..i, so a
+// change to directory i invalidates exactly the entries with dir >= i
+// (negative entries use dir == dirs_len).
+//
+// Directory changes are detected with inotify on Linux, and by comparing the
+// directory mtime everywhere else (or when a directory could not be watched).
+
+typedef struct exec_cache_entry {
+  struct exec_cache_entry *next;
+  unsigned hash;
+  int dir;
+  int hits;
+  char *path;
+  char name[];
+} exec_cache_entry;
+
+typedef struct {
+  char *path;
+  time_t mtime;
+  // the mtime was too recent to be trusted (it may change again within the
+  // same second), so the directory is always treated as modified
+  int racy;
+  // inotify watch descriptor, -1 if the directory is not watched
+  int wd;
+} exec_cache_dir;
+
+typedef struct {
+  exec_cache_entry **buckets;
+  int bucket_count;
+  int size;
+  exec_cache_dir *dirs;
+  int dirs_len;
+  // whether `dirs` was built from the current shell PATH
+  int dirs_valid;
+  int inotify_fd;
+} exec_cache;
+
+int exec_cache_init(exec_cache *cache);
+void exec_cache_destroy(exec_cache *cache);
+
+// drop every entry and the PATH directory list, this must be called whenever
+// the shell PATH changes
+void exec_cache_flush(exec_cache *cache);
+
+// returns the PATH directories (split from path_env), or NULL on allocation
+// failure
+const exec_cache_dir *exec_cache_dirs(exec_cache *cache, const char *path_env,
+                                      int *dirs_len);
+
+// returns NULL if there is no valid entry for name
+exec_cache_entry *exec_cache_lookup(exec_cache *cache, const char *path_env,
+                                    const char *name);
+
+// path == NULL inserts a negative entry, the path is copied
+exec_cache_entry *exec_cache_insert(exec_cache *cache, const char *name,
+                                    const char *path, int dir);
@@ -0,0 +1,295 @@
+#include "exec_index.h"
+#include "arena.h"
+#include "process.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define PATH_DELIM ";"
+#else
+#define PATH_DELIM ":"
+#endif
+
+typedef struct {
+  // the children are nodes[first_child..first_child + children_len), sorted
+  // by their character
+  int first_child;
+  int children_len;
+  char c;
+  // a name ends at this node
+  char terminal;
+} trie_node;
+
+struct exec_trie {
+  // nodes[0] is the root, the empty prefix
+  trie_node *nodes;
+  int nodes_len;
+  int nodes_cap;
+};
+
+typedef struct {
+  arena arena;
+  char **names;
+  int names_len;
+  int names_cap;
+} name_list;
+
+static void free_trie(exec_trie *trie) {
+  if (trie) {
+    free(trie->nodes);
+    free(trie);
+  }
+}
+
+static int add_name(void *userdata, const char *name) {
+  name_list *list = userdata;
+  char *copy = arena_printf(&list->arena, "%s", name);
+  return copy && vecpush(&list->names, &list->names_len, &list->names_cap,
+                         sizeof copy, &copy, 1);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// names[lo..hi) are sorted, unique and start with the `depth` characters
+// leading to `node`
+static int build_node(exec_trie *trie, int node, char **names, int lo, int hi,
+                      int depth) {
+  if (lo < hi && names[lo][depth] == '\0') {
+    trie->nodes[node].terminal = 1;
+    ++lo;
+  }
+
+  // the children are added together, so they are contiguous
+  int first_child = trie->nodes_len;
+  for (int i = lo; i < hi; ++i) {
+    if (i == lo || names[i][depth] != names[i - 1][depth]) {
+      trie_node child = {0, 0, names[i][depth], 0};
+      if (!vecpush(&trie->nodes, &trie->nodes_len, &trie->nodes_cap,
+                   sizeof child, &child, 1)) {
+        return 0;
+      }
+    }
+  }
+  trie->nodes[node].first_child = first_child;
+  trie->nodes[node].children_len = trie->nodes_len - first_child;
+
+  for (int i = lo, child = first_child; i < hi; ++child) {
+    int j = i + 1;
+    while (j < hi && names[j][depth] == names[i][depth]) {
+      ++j;
+    }
+    if (!build_node(trie, child, names, i, j, depth + 1)) {
+      return 0;
+    }
+    i = j;
+  }
+  return 1;
+}
+
+// returns NULL on failure, or if the index is being destroyed
+static exec_trie *build_trie(exec_index *index, const char *path_env) {
+  name_list list;
+  arena_init(&list.arena);
+  list.names = NULL;
+  list.names_len = 0;
+  list.names_cap = 0;
+  exec_trie *trie = NULL;
+
+  char *path = printf_to_string("%s", path_env);
+  if (!path) {
+    goto done;
+  }
+
+  char *saveptr;
+  for (char *dir = reentrant_strtok(path, PATH_DELIM, &saveptr); dir;
+       dir = reentrant_strtok(NULL, PATH_DELIM, &saveptr)) {
+    if (atomic_int_load(&index->stop) ||
+        !list_executables(dir, add_name, &list)) {
+      goto done;
+    }
+  }
+
+  // the same name may be in several directories
+  qsort(list.names, list.names_len, sizeof *list.names, compare_names);
+  int unique_len = 0;
+  for (int i = 0; i < list.names_len; ++i) {
+    if (unique_len == 0 ||
+        strcmp(list.names[i], list.names[unique_len - 1]) != 0) {
+      list.names[unique_len++] = list.names[i];
+    }
+  }
+
+  trie = calloc(1, sizeof *trie);
+  trie_node root = {0, 0, '\0', 0};
+  if (!trie || !vecpush(&trie->nodes, &trie->nodes_len, &trie->nodes_cap,
+                        sizeof root, &root, 1) ||
+      !build_node(trie, 0, list.names, 0, unique_len, 0)) {
+    free_trie(trie);
+    trie = NULL;
+  }
+
+done:
+  free(path);
+  free(list.names);
+  arena_free(&list.arena);
+  return trie;
+}
+
+static int build_thread(void *arg) {
+  exec_index *index = arg;
+  mtx_lock(&index->lock);
+  while (index->pending_path && !atomic_int_load(&index->stop)) {
+    char *path = index->pending_path;
+    index->pending_path = NULL;
+    mtx_unlock(&index->lock);
+
+    exec_trie *trie = build_trie(index, path);
+    free(path);
+
+    mtx_lock(&index->lock);
+    // a failed build keeps the previous trie
+    if (trie) {
+      exec_trie *old = index->trie;
+      index->trie = trie;
+      trie = old;
+    }
+    free_trie(trie);
+  }
+
+  index->building = 0;
+  mtx_unlock(&index->lock);
+  return 0;
+}
+
+int exec_index_init(exec_index *index) {
+  if (mtx_init(&index->lock, mtx_plain) != thrd_success) {
+    return 0;
+  }
+  index->trie = NULL;
+  index->pending_path = NULL;
+  index->building = 0;
+  index->has_thread = 0;
+  atomic_int_store(&index->stop, 0);
+  return 1;
+}
+
+void exec_index_destroy(exec_index *index) {
+  mtx_lock(&index->lock);
+  atomic_int_store(&index->stop, 1);
+  free(index->pending_path);
+  index->pending_path = NULL;
+  int has_thread = index->has_thread;
+  mtx_unlock(&index->lock);
+
+  if (has_thread) {
+    thrd_join(index->thread, NULL);
+  }
+  free_trie(index->trie);
+  mtx_destroy(&index->lock);
+}
+
+int exec_index_update(exec_index *index, const char *path_env) {
+  char *path = printf_to_string("%s", path_env);
+  if (!path) {
+    return 0;
+  }
+
+  int ok = 1;
+  mtx_lock(&index->lock);
+  free(index->pending_path);
+  index->pending_path = path;
+  if (!index->building) {
+    // the previous thread is done with the index, only its exit is left
+    if (index->has_thread) {
+      thrd_join(index->thread, NULL);
+    }
+    ok = thrd_create(&index->thread, build_thread, index) == thrd_success;
+    index->has_thread = ok;
+    index->building = ok;
+    if (!ok) {
+      free(index->pending_path);
+      index->pending_path = NULL;
+    }
+  }
+  mtx_unlock(&index->lock);
+  return ok;
+}
+
+typedef struct {
+  const exec_trie *trie;
+  // the name of the visited node, null-terminated
+  char *name;
+  int name_len;
+  int name_cap;
+  exec_index_callback callback;
+  void *userdata;
+} trie_visit;
+
+static int push_char(trie_visit *v, char c) {
+  // keeps room for the terminator
+  char chars[2] = {c, '\0'};
+  if (!vecpush(&v->name, &v->name_len, &v->name_cap, 1, chars, 2)) {
+    return 0;
+  }
+  --v->name_len;
+  return 1;
+}
+
+// calls the callback with every name below `node`, in sorted order
+static int visit(trie_visit *v, int node) {
+  const trie_node *n = &v->trie->nodes[node];
+  if (n->terminal && !v->callback(v->userdata, v->name)) {
+    return 0;
+  }
+
+  for (int i = 0; i < n->children_len; ++i) {
+    const trie_node *child = &v->trie->nodes[n->first_child + i];
+    if (!push_char(v, child->c) || !visit(v, n->first_child + i)) {
+      return 0;
+    }
+    v->name[--v->name_len] = '\0';
+  }
+  return 1;
+}
+
+int exec_index_complete(exec_index *index, const char *prefix,
+                        exec_index_callback callback, void *userdata) {
+  mtx_lock(&index->lock);
+  trie_visit v = {index->trie, NULL, 0, 0, callback, userdata};
+  int ok = 1;
+  if (!v.trie) {
+    goto done;
+  }
+
+  // follows the prefix down the trie
+  int node = 0;
+  for (const char *c = prefix; *c; ++c) {
+    const trie_node *n = &v.trie->nodes[node];
+    int next = -1;
+    for (int i = 0; i < n->children_len && next < 0; ++i) {
+      if (v.trie->nodes[n->first_child + i].c == *c) {
+        next = n->first_child + i;
+      }
+    }
+    if (next < 0) {
+      goto done;
+    }
+    node = next;
+  }
+
+  ok = vecpush(&v.name, &v.name_len, &v.name_cap, 1, prefix,
+               (int)strlen(prefix) + 1);
+  if (ok) {
+    --v.name_len;
+    ok = visit(&v, node);
+  }
+
+done:
+  free(v.name);
+  mtx_unlock(&index->lock);
+  return ok;
+}
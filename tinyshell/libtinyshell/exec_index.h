@@ -0,0 +1,44 @@
+#pragma once
+
+#include "atomics.h"
+
+#include <stddef.h>
+#include <tinycthread.h>
+
+// Names of the executables in the PATH directories, for completing command
+// names.
+//
+// The index is a prefix trie built on a background thread whenever the PATH
+// changes, so completion never reads a directory while the user waits. Until
+// the first build is done, completion simply finds no executables.
+
+typedef struct exec_trie exec_trie;
+
+typedef struct {
+  // protects every field, and the trie while it is read
+  mtx_t lock;
+  exec_trie *trie;
+  // the PATH to build the next trie from, NULL if there is no pending build
+  char *pending_path;
+  // the thread is running, it takes pending_path until there is none
+  int building;
+  int has_thread;
+  thrd_t thread;
+  // read by the thread between two directories, without the lock
+  atomic_int_t stop;
+} exec_index;
+
+int exec_index_init(exec_index *index);
+// waits for the build in progress
+void exec_index_destroy(exec_index *index);
+
+// builds the index of `path_env` in the background, the current trie is used
+// until the new one is complete
+int exec_index_update(exec_index *index, const char *path_env);
+
+// called with each name, in sorted order, returns 0 to stop with an error
+typedef int (*exec_index_callback)(void *userdata, const char *name);
+
+// calls `callback` with every indexed name starting with `prefix`
+int exec_index_complete(exec_index *index, const char *prefix,
+                        exec_index_callback callback, void *userdata);
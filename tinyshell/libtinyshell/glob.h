@@ -0,0 +1,33 @@
+#pragma once
+
+#include "arena.h"
+
+// Filename patterns (*, ?, [...]) in arguments, Unix only: Win32 programs
+// expand their own arguments, so the Win32 parser never produces patterns.
+//
+// A pattern is matched one path component at a time with fnmatch. Every
+// directory is read once per command: the listings are kept in a glob_cache
+// which lives as long as the parsing of the command, so several patterns over
+// the same directory (`*.c *.h`) share one pass over it.
+
+typedef struct glob_dir glob_dir;
+
+typedef struct {
+  // names of the listed directories
+  arena arena;
+  glob_dir *dirs;
+} glob_cache;
+
+void glob_cache_init(glob_cache *cache);
+void glob_cache_destroy(glob_cache *cache);
+
+// called with each match, returns 0 to stop with an error
+typedef int (*glob_callback)(void *userdata, const char *path);
+
+// `pattern` escapes the characters to match literally with a backslash, hidden
+// files only match a pattern component starting with a literal dot
+//
+// the matches are passed to `callback` in sorted order, returns their number or
+// -1 on error (allocation failure or callback failure)
+int glob_expand(glob_cache *cache, const char *pattern, glob_callback callback,
+                void *userdata);
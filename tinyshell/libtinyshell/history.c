@@ -0,0 +1,589 @@
+#include "history.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_MAGIC 0x49485354u
+#define INDEX_VERSION 2
+// prefixes of 1, 2, 4, 8 and 16 bytes
+#define PREFIX_CLASSES 5
+#define MIN_CAP 1024
+#define MAX_CAP (1u << 28)
+// bytes at each end of the indexed part of the history file in its check
+#define CHECK_BYTES 64
+
+// The index file is the header, then records_cap records, then the command
+// table and the prefix table, each one growing on its own. It is only a cache
+// of the history file, in the native byte order.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  // bytes of the history file which are indexed, always whole lines
+  uint64_t log_size;
+  // hash of the first and last bytes of those, so a history file rewritten
+  // or edited since is indexed again even if it did not get smaller
+  uint64_t log_check;
+  uint32_t records_len;
+  uint32_t records_cap;
+  // the tables are open addressing with linear probing (nothing is ever
+  // removed), their capacity is a power of two and they are at most half full
+  uint32_t commands_len;
+  uint32_t commands_cap;
+  uint32_t prefixes_len;
+  uint32_t prefixes_cap;
+} index_header;
+
+typedef struct {
+  // of the line in the history file
+  uint64_t offset;
+  uint32_t hash;
+  // previous record + 1 starting with the same prefix of each class, 0 if none
+  // or if the command is shorter than the prefix
+  uint32_t prev[PREFIX_CLASSES];
+} index_record;
+
+// `record` is the latest record + 1, 0 for an empty slot
+typedef struct {
+  uint32_t hash;
+  uint32_t record;
+} command_slot;
+
+// the class of the prefix is kept in the low bits of `key`, the others are
+// those of the hash of the prefix
+typedef struct {
+  uint32_t key;
+  uint32_t record;
+} prefix_slot;
+
+static index_header *header(history *h) {
+  return (index_header *)h->index.data;
+}
+
+static index_record *records(history *h) {
+  return (index_record *)(h->index.data + sizeof(index_header));
+}
+
+static command_slot *commands(history *h) {
+  return (command_slot *)(records(h) + header(h)->records_cap);
+}
+
+static prefix_slot *prefixes(history *h) {
+  return (prefix_slot *)(commands(h) + header(h)->commands_cap);
+}
+
+static size_t index_size(const index_header *hd) {
+  return sizeof(index_header) +
+         (size_t)hd->records_cap * sizeof(index_record) +
+         (size_t)hd->commands_cap * sizeof(command_slot) +
+         (size_t)hd->prefixes_cap * sizeof(prefix_slot);
+}
+
+// 32-bit FNV-1a, like hash_string, of the first `len` bytes
+static uint32_t hash_bytes(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// the class of the longest indexed prefix not longer than `len`
+static int prefix_class(size_t len) {
+  int k = 0;
+  while (k + 1 < PREFIX_CLASSES && ((size_t)1 << (k + 1)) <= len) {
+    ++k;
+  }
+  return k;
+}
+
+static uint32_t prefix_key(uint32_t hash, int k) {
+  return (hash & ~7u) | (uint32_t)k;
+}
+
+// the command of record i, up to its newline, empty if the index is corrupt
+static const char *record_text(history *h, uint32_t i, size_t *len) {
+  const index_header *hd = header(h);
+  if (i >= hd->records_len || records(h)[i].offset >= hd->log_size) {
+    *len = 0;
+    return "";
+  }
+
+  const char *start = h->log.data + records(h)[i].offset;
+  const char *log_end = h->log.data + hd->log_size;
+  const char *end = memchr(start, '\n', (size_t)(log_end - start));
+  *len = (size_t)((end ? end : log_end) - start);
+  return start;
+}
+
+// the record + 1 before record r - 1 with the same prefix of class k, records
+// only link to older ones so a corrupt index cannot loop
+static uint32_t prev_record(history *h, uint32_t r, int k) {
+  uint32_t prev = records(h)[r - 1].prev[k];
+  return prev < r ? prev : 0;
+}
+
+static int record_starts_with(history *h, uint32_t i, const char *prefix,
+                              size_t len, int whole) {
+  size_t record_len;
+  const char *text = record_text(h, i, &record_len);
+  return (whole ? record_len == len : record_len >= len) &&
+         memcmp(text, prefix, len) == 0;
+}
+
+static char *copy_record(history *h, uint32_t i) {
+  size_t len;
+  const char *text = record_text(h, i, &len);
+  char *copy = malloc(len + 1);
+  if (copy) {
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+// the slot of `command`, or the empty slot where it would be inserted, NULL if
+// the table is full
+static command_slot *find_command(history *h, const char *command, size_t len,
+                                  uint32_t hash) {
+  command_slot *slots = commands(h);
+  uint32_t mask = header(h)->commands_cap - 1;
+  for (uint32_t n = 0, i = hash & mask; n <= mask; ++n, i = (i + 1) & mask) {
+    command_slot *slot = &slots[i];
+    if (slot->record == 0 ||
+        (slot->hash == hash &&
+         record_starts_with(h, slot->record - 1, command, len, 1))) {
+      return slot;
+    }
+  }
+  h->corrupt = 1;
+  return NULL;
+}
+
+// the slot of the prefix of class k, or the empty slot where it would be
+// inserted, NULL if the table is full
+static prefix_slot *find_prefix(history *h, const char *prefix, int k,
+                                uint32_t hash) {
+  prefix_slot *slots = prefixes(h);
+  uint32_t mask = header(h)->prefixes_cap - 1;
+  uint32_t key = prefix_key(hash, k);
+  for (uint32_t n = 0, i = (hash >> 3) & mask; n <= mask;
+       ++n, i = (i + 1) & mask) {
+    prefix_slot *slot = &slots[i];
+    if (slot->record == 0 ||
+        (slot->key == key &&
+         record_starts_with(h, slot->record - 1, prefix, (size_t)1 << k, 0))) {
+      return slot;
+    }
+  }
+  h->corrupt = 1;
+  return NULL;
+}
+
+// whether record i is the latest record of its command
+static int is_latest(history *h, uint32_t i) {
+  command_slot *slots = commands(h);
+  uint32_t mask = header(h)->commands_cap - 1;
+  uint32_t j = records(h)[i].hash & mask;
+  for (uint32_t n = 0; n <= mask; ++n, j = (j + 1) & mask) {
+    if (slots[j].record == 0) {
+      return 0;
+    }
+    if (slots[j].record == i + 1) {
+      return 1;
+    }
+  }
+  h->corrupt = 1;
+  return 0;
+}
+
+// doubles the capacity of what would be full after adding a record, returns
+// whether anything needs to grow
+static int grow_caps(const index_header *hd, index_header *caps) {
+  *caps = *hd;
+  if (hd->records_len == hd->records_cap) {
+    caps->records_cap *= 2;
+  }
+  if ((hd->commands_len + 1) * 2 > hd->commands_cap) {
+    caps->commands_cap *= 2;
+  }
+  if ((hd->prefixes_len + PREFIX_CLASSES) * 2 > hd->prefixes_cap) {
+    caps->prefixes_cap *= 2;
+  }
+  return caps->records_cap != hd->records_cap ||
+         caps->commands_cap != hd->commands_cap ||
+         caps->prefixes_cap != hd->prefixes_cap;
+}
+
+// the line at `offset` is not indexed yet, so it is not compared with itself,
+// returns 0 if a table of the index is corrupt
+static int add_record(history *h, uint64_t offset, const char *command,
+                      size_t len) {
+  index_header *hd = header(h);
+  uint32_t i = hd->records_len;
+  index_record *record = &records(h)[i];
+  record->offset = offset;
+
+  uint32_t prefix_hashes[PREFIX_CLASSES];
+  uint32_t hash = 2166136261u;
+  for (size_t j = 0; j < len; ++j) {
+    hash ^= (unsigned char)command[j];
+    hash *= 16777619u;
+    // j + 1 is a power of two
+    if ((j & (j + 1)) == 0 && j + 1 <= ((size_t)1 << (PREFIX_CLASSES - 1))) {
+      prefix_hashes[prefix_class(j + 1)] = hash;
+    }
+  }
+  record->hash = hash;
+
+  command_slot *slot = find_command(h, command, len, hash);
+  if (!slot) {
+    return 0;
+  }
+  if (slot->record == 0) {
+    slot->hash = hash;
+    ++hd->commands_len;
+  }
+  slot->record = i + 1;
+
+  for (int k = 0; k < PREFIX_CLASSES; ++k) {
+    size_t prefix_len = (size_t)1 << k;
+    record->prev[k] = 0;
+    if (len < prefix_len) {
+      continue;
+    }
+
+    prefix_slot *prefix = find_prefix(h, command, k, prefix_hashes[k]);
+    if (!prefix) {
+      return 0;
+    }
+    if (prefix->record == 0) {
+      prefix->key = prefix_key(prefix_hashes[k], k);
+      ++hd->prefixes_len;
+    }
+    record->prev[k] = prefix->record;
+    prefix->record = i + 1;
+  }
+  ++hd->records_len;
+  return 1;
+}
+
+// empties the index, with the capacities of `caps`, so the history file is
+// indexed again from its start
+static int reset_index(history *h, const index_header *caps) {
+  if (caps->records_cap > MAX_CAP || caps->commands_cap > MAX_CAP ||
+      caps->prefixes_cap > MAX_CAP) {
+    return 0;
+  }
+
+  // the part of the file added by growing it is zero already
+  size_t old_size = h->index.size;
+  size_t size = index_size(caps);
+  if (size != old_size && !mapped_file_resize(&h->index, size)) {
+    return 0;
+  }
+  memset(h->index.data, 0, old_size < size ? old_size : size);
+
+  index_header *hd = header(h);
+  hd->magic = INDEX_MAGIC;
+  hd->version = INDEX_VERSION;
+  hd->records_cap = caps->records_cap;
+  hd->commands_cap = caps->commands_cap;
+  hd->prefixes_cap = caps->prefixes_cap;
+  return 1;
+}
+
+static int valid_cap(uint32_t cap) {
+  return cap >= MIN_CAP && cap <= MAX_CAP && (cap & (cap - 1)) == 0;
+}
+
+// of the first `size` bytes of the history file
+static uint64_t log_check(history *h, uint64_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  size_t head = size < CHECK_BYTES ? (size_t)size : CHECK_BYTES;
+  size_t tail = size < 2 * CHECK_BYTES ? (size_t)size - head : CHECK_BYTES;
+  return (uint64_t)hash_bytes(h->log.data, head) << 32 |
+         hash_bytes(h->log.data + size - tail, tail);
+}
+
+static int index_valid(history *h) {
+  const index_header *hd = header(h);
+  return h->index.size >= sizeof *hd && hd->magic == INDEX_MAGIC &&
+         hd->version == INDEX_VERSION && valid_cap(hd->records_cap) &&
+         valid_cap(hd->commands_cap) && valid_cap(hd->prefixes_cap) &&
+         h->index.size == index_size(hd) &&
+         hd->records_len <= hd->records_cap &&
+         hd->commands_len * 2 <= hd->commands_cap &&
+         hd->prefixes_len * 2 <= hd->prefixes_cap &&
+         hd->log_size <= h->log.size &&
+         hd->log_check == log_check(h, hd->log_size);
+}
+
+// sizes the new index for the whole history file, so it is usually built in
+// one pass (the tables grow if the commands are more varied than expected)
+static int rebuild_index(history *h) {
+  h->corrupt = 0;
+  size_t lines = 0;
+  const char *end = h->log.data + h->log.size;
+  for (const char *p = h->log.data; p && p < end; ++p) {
+    p = memchr(p, '\n', (size_t)(end - p));
+    if (!p) {
+      break;
+    }
+    ++lines;
+  }
+
+  index_header caps;
+  caps.records_cap = MIN_CAP;
+  while (caps.records_cap < lines && caps.records_cap < MAX_CAP) {
+    caps.records_cap *= 2;
+  }
+  caps.commands_cap = caps.records_cap;
+  caps.prefixes_cap = caps.records_cap * 2;
+  return reset_index(h, &caps);
+}
+
+// indexes the complete lines after the indexed part of the history file
+static int index_log(history *h) {
+  while (1) {
+    index_header *hd = header(h);
+    if (hd->log_size == h->log.size) {
+      break;
+    }
+
+    const char *start = h->log.data + hd->log_size;
+    const char *newline =
+        memchr(start, '\n', (size_t)(h->log.size - hd->log_size));
+    // a partial line, from a shell which crashed while writing it
+    if (!newline) {
+      break;
+    }
+
+    size_t len = (size_t)(newline - start);
+    if (len > 0) {
+      index_header caps;
+      if (grow_caps(hd, &caps)) {
+        if (!reset_index(h, &caps)) {
+          return 0;
+        }
+        continue;
+      }
+      if (!add_record(h, hd->log_size, start, len)) {
+        if (!rebuild_index(h)) {
+          return 0;
+        }
+        continue;
+      }
+    }
+    hd->log_size += len + 1;
+  }
+
+  header(h)->log_check = log_check(h, header(h)->log_size);
+  return 1;
+}
+
+// maps both files again if another shell changed them, and brings the index
+// up to date, with the lock held
+static int sync_index(history *h) {
+  if (!mapped_file_refresh(&h->index) || !mapped_file_refresh(&h->log)) {
+    return 0;
+  }
+  if (!index_valid(h) && !rebuild_index(h)) {
+    return 0;
+  }
+  return index_log(h);
+}
+
+static int lock_index(history *h) {
+  if (!mapped_file_lock(&h->index)) {
+    return 0;
+  }
+  if (!sync_index(h)) {
+    mapped_file_unlock(&h->index);
+    return 0;
+  }
+  return 1;
+}
+
+int history_open(history *h, const char *path) {
+  h->corrupt = 0;
+  char *index_path = printf_to_string("%s.idx", path);
+  if (!index_path) {
+    return 0;
+  }
+
+  if (!mapped_file_open(&h->log, path, 0)) {
+    goto fail_log;
+  }
+  if (!mapped_file_open(&h->index, index_path, 1)) {
+    goto fail_index;
+  }
+  if (!lock_index(h)) {
+    goto fail_lock;
+  }
+
+  mapped_file_unlock(&h->index);
+  free(index_path);
+  return 1;
+
+fail_lock:
+  mapped_file_close(&h->index);
+fail_index:
+  mapped_file_close(&h->log);
+fail_log:
+  free(index_path);
+  return 0;
+}
+
+void history_close(history *h) {
+  mapped_file_close(&h->index);
+  mapped_file_close(&h->log);
+}
+
+int history_add(history *h, const char *command, size_t len) {
+  if (!lock_index(h)) {
+    return 0;
+  }
+
+  // running the last command again changes nothing
+  index_header *hd = header(h);
+  uint32_t last = hd->records_len;
+  if (last > 0 && records(h)[last - 1].hash == hash_bytes(command, len) &&
+      record_starts_with(h, last - 1, command, len, 1)) {
+    mapped_file_unlock(&h->index);
+    return 1;
+  }
+
+  int ok = 0;
+  char *line = malloc(len + 2);
+  if (!line) {
+    goto done;
+  }
+
+  // ends the partial line left by a crash, so it is not joined to this one
+  size_t line_len = 0;
+  if (h->log.size > hd->log_size) {
+    line[line_len++] = '\n';
+  }
+  memcpy(line + line_len, command, len);
+  line_len += len;
+  line[line_len++] = '\n';
+  ok = mapped_file_append(&h->log, line, line_len) && index_log(h);
+  free(line);
+
+done:
+  mapped_file_unlock(&h->index);
+  return ok;
+}
+
+char *history_get(history *h, int number) {
+  if (!lock_index(h)) {
+    return NULL;
+  }
+
+  int len = (int)header(h)->records_len;
+  if (number < 0) {
+    number += len + 1;
+  }
+  char *command =
+      number >= 1 && number <= len ? copy_record(h, number - 1) : NULL;
+  mapped_file_unlock(&h->index);
+  return command;
+}
+
+// the latest record + 1 whose prefix of class k starts like `prefix`, 0 if none
+static uint32_t prefix_head(history *h, const char *prefix, int k) {
+  prefix_slot *slot =
+      find_prefix(h, prefix, k, hash_bytes(prefix, (size_t)1 << k));
+  return slot && slot->record <= header(h)->records_len ? slot->record : 0;
+}
+
+// builds the index again after a lookup found it corrupt, with the lock held
+static int repair_index(history *h) {
+  return rebuild_index(h) && index_log(h);
+}
+
+// the latest match is the latest record of its command: a later record of the
+// same command would match too
+static char *find_latest(history *h, const char *prefix, size_t prefix_len) {
+  int k = prefix_class(prefix_len);
+  for (uint32_t r = prefix_head(h, prefix, k); r;
+       r = prev_record(h, r, k)) {
+    if (record_starts_with(h, r - 1, prefix, prefix_len, 0)) {
+      return copy_record(h, r - 1);
+    }
+  }
+  return NULL;
+}
+
+char *history_find(history *h, const char *prefix, size_t prefix_len) {
+  if (prefix_len == 0) {
+    return history_get(h, -1);
+  }
+  if (!lock_index(h)) {
+    return NULL;
+  }
+
+  char *command = find_latest(h, prefix, prefix_len);
+  if (h->corrupt) {
+    free(command);
+    command = repair_index(h) ? find_latest(h, prefix, prefix_len) : NULL;
+  }
+
+  mapped_file_unlock(&h->index);
+  return command;
+}
+
+// the records of the `count` latest matches (all of them if count <= 0), from
+// the latest one
+static int collect_matches(history *h, const char *prefix, size_t prefix_len,
+                           int count, uint32_t **matches, int *matches_len) {
+  int matches_cap = 0;
+  *matches = NULL;
+  *matches_len = 0;
+  int k = prefix_class(prefix_len);
+  uint32_t r = prefix_len == 0 ? header(h)->records_len
+                               : prefix_head(h, prefix, k);
+  while (r && (count <= 0 || *matches_len < count)) {
+    uint32_t i = r - 1;
+    if (record_starts_with(h, i, prefix, prefix_len, 0) && is_latest(h, i) &&
+        !vecpush(matches, matches_len, &matches_cap, sizeof i, &i, 1)) {
+      return 0;
+    }
+    r = prefix_len == 0 ? i : prev_record(h, r, k);
+  }
+  return 1;
+}
+
+int history_list(history *h, const char *prefix, size_t prefix_len, int count,
+                 history_callback callback, void *userdata) {
+  if (!lock_index(h)) {
+    return 0;
+  }
+
+  uint32_t *matches;
+  int matches_len;
+  int ok = collect_matches(h, prefix, prefix_len, count, &matches,
+                           &matches_len);
+  if (h->corrupt) {
+    free(matches);
+    matches = NULL;
+    matches_len = 0;
+    ok = repair_index(h) && collect_matches(h, prefix, prefix_len, count,
+                                            &matches, &matches_len);
+  }
+
+  for (int j = matches_len - 1; j >= 0 && ok; --j) {
+    size_t len;
+    const char *command = record_text(h, matches[j], &len);
+    ok = callback(userdata, (int)matches[j] + 1, command, len);
+  }
+
+  free(matches);
+  mapped_file_unlock(&h->index);
+  return ok;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <stddef.h>
+
+// Command history shared by every shell using the same file, kept across
+// sessions.
+//
+// The history itself is an append-only text file, one command per line. Next
+// to it, `<path>.idx` is an index of the file which is mapped in memory and
+// updated in place, so opening the history never reads the commands:
+// - the offset of every line (record) in the file,
+// - a hash table from each distinct command to its latest record, which makes
+//   the history deduplicated: running a command again moves it to the end,
+//   and the older records of the same command are skipped,
+// - a hash table from the first 1, 2, 4, 8 and 16 bytes of the commands to
+//   the latest record starting with them, every record linking to the previous
+//   one with the same prefixes, so a prefix search only visits the records
+//   sharing at least half of the prefix.
+//
+// The index is rebuilt from the file when it is missing, invalid (including
+// tables found full), full (with twice the capacity) or no longer matches the start and end of the indexed
+// part of the file (which was rewritten or edited), and lines appended by
+// another shell which did not index them are indexed when the history is next
+// used. Every operation
+// holds a lock on the index, so several shells may use the same history.
+
+typedef struct {
+  mapped_file log;
+  mapped_file index;
+  // set when a lookup went through a whole table, which only happens with a
+  // corrupt index: it is rebuilt, and the lookup done again
+  int corrupt;
+} history;
+
+int history_open(history *h, const char *path);
+void history_close(history *h);
+
+// `command` must not contain a newline
+int history_add(history *h, const char *command, size_t len);
+
+// returns a copy of the command of record `number` (counting from 1 like
+// history_list, or from the end if negative, -1 being the last command), or
+// NULL if there is no such record or on allocation failure
+char *history_get(history *h, int number);
+// returns a copy of the latest command starting with `prefix`, or NULL
+char *history_find(history *h, const char *prefix, size_t prefix_len);
+
+// `command` is not null-terminated, returns 0 to stop with an error
+typedef int (*history_callback)(void *userdata, int number,
+                                const char *command, size_t len);
+
+// calls `callback` with the last `count` (every one if count <= 0) distinct
+// commands starting with `prefix`, the oldest first
+int history_list(history *h, const char *prefix, size_t prefix_len, int count,
+                 history_callback callback, void *userdata);
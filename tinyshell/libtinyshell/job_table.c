@@ -0,0 +1,138 @@
+// process.h pulls in tinyshell.h, which needs the complete job table
+#include "tinyshell.h"
+
+#include <stdlib.h>
+
+void job_table_init(job_table *t) {
+  t->chunks_len = 0;
+  t->free_head = -1;
+  t->next_id = 1;
+  t->buckets = NULL;
+  t->bucket_count = 0;
+  t->len = 0;
+  t->first = -1;
+  t->last = -1;
+}
+
+void job_table_destroy(job_table *t) {
+  for (int i = 0; i < t->chunks_len; ++i) {
+    free(t->chunks[i]);
+  }
+  free(t->buckets);
+}
+
+static int add_chunk(job_table *t) {
+  if (t->chunks_len == JOB_TABLE_MAX_CHUNKS) {
+    return 0;
+  }
+
+  bg_process *chunk = malloc(JOB_TABLE_CHUNK_SIZE * sizeof *chunk);
+  if (!chunk) {
+    return 0;
+  }
+
+  // the new slots go to the free-list in increasing order
+  int base = t->chunks_len * JOB_TABLE_CHUNK_SIZE;
+  for (int i = JOB_TABLE_CHUNK_SIZE - 1; i >= 0; --i) {
+    atomic_int_store(&chunk[i].status, BG_PROCESS_EMPTY);
+    chunk[i].next = t->free_head;
+    t->free_head = base + i;
+  }
+  t->chunks[t->chunks_len++] = chunk;
+  return 1;
+}
+
+// ids are consecutive, so `id & (bucket_count - 1)` spreads them evenly
+static int grow_buckets(job_table *t) {
+  int new_count = t->bucket_count ? t->bucket_count * 2 : 64;
+  int *new_buckets = malloc(new_count * sizeof *new_buckets);
+  if (!new_buckets) {
+    return 0;
+  }
+
+  for (int i = 0; i < new_count; ++i) {
+    new_buckets[i] = -1;
+  }
+  for (int slot = t->first; slot >= 0;) {
+    bg_process *job = job_table_get(t, slot);
+    int *bucket = &new_buckets[job->id & (new_count - 1)];
+    job->id_next = *bucket;
+    *bucket = slot;
+    slot = job->live_next;
+  }
+
+  free(t->buckets);
+  t->buckets = new_buckets;
+  t->bucket_count = new_count;
+  return 1;
+}
+
+int job_table_add(job_table *t) {
+  if (t->free_head < 0 && !add_chunk(t)) {
+    return -1;
+  }
+  if (t->len >= t->bucket_count && !grow_buckets(t)) {
+    return -1;
+  }
+
+  int slot = t->free_head;
+  bg_process *job = job_table_get(t, slot);
+  t->free_head = job->next;
+
+  job->id = t->next_id++;
+  job->next = -1;
+  int *bucket = &t->buckets[job->id & (t->bucket_count - 1)];
+  job->id_next = *bucket;
+  *bucket = slot;
+
+  job->live_prev = t->last;
+  job->live_next = -1;
+  if (t->last >= 0) {
+    job_table_get(t, t->last)->live_next = slot;
+  } else {
+    t->first = slot;
+  }
+  t->last = slot;
+  ++t->len;
+  return slot;
+}
+
+void job_table_remove(job_table *t, int slot) {
+  bg_process *job = job_table_get(t, slot);
+  int *link = &t->buckets[job->id & (t->bucket_count - 1)];
+  while (*link != slot) {
+    link = &job_table_get(t, *link)->id_next;
+  }
+  *link = job->id_next;
+
+  if (job->live_prev >= 0) {
+    job_table_get(t, job->live_prev)->live_next = job->live_next;
+  } else {
+    t->first = job->live_next;
+  }
+  if (job->live_next >= 0) {
+    job_table_get(t, job->live_next)->live_prev = job->live_prev;
+  } else {
+    t->last = job->live_prev;
+  }
+
+  atomic_int_store(&job->status, BG_PROCESS_EMPTY);
+  job->next = t->free_head;
+  t->free_head = slot;
+  --t->len;
+}
+
+int job_table_find(const job_table *t, int id) {
+  if (t->bucket_count == 0) {
+    return -1;
+  }
+
+  for (int slot = t->buckets[id & (t->bucket_count - 1)]; slot >= 0;) {
+    const bg_process *job = job_table_get(t, slot);
+    if (job->id == id) {
+      return slot;
+    }
+    slot = job->id_next;
+  }
+  return -1;
+}
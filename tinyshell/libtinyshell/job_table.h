@@ -0,0 +1,106 @@
+#pragma once
+
+#include "arena.h"
+#include "atomics.h"
+#include "env.h"
+#include "parse_cmd.h"
+#include "process.h"
+
+typedef struct {
+  process p;
+  // written by the reaper thread before it sets `exited`
+  process_usage usage;
+  // set by the reaper thread
+  atomic_int_t exited;
+} bg_stage;
+
+// a job waiting for a free slot, with a copy of everything needed to start it
+typedef struct {
+  arena arena;
+  command_parse_result parse_result;
+  const char **binary_paths;
+  // the environment when the job was entered
+  env_block *env;
+  // the descriptors and directory when the job was entered, the job starts
+  // on the reaper thread while the shell may have redirected or moved
+  spawn_context ctx;
+} pending_job;
+
+typedef enum {
+  BG_PROCESS_QUEUED,
+  BG_PROCESS_RUNNING,
+  BG_PROCESS_STOPPED,
+  BG_PROCESS_EMPTY,
+  BG_PROCESS_FINISHED
+} bg_status;
+
+typedef struct {
+  // a bg_status, read without the jobs lock
+  atomic_int_t status;
+  // shown to the user as %id
+  int id;
+  // one process per pipeline stage, NULL while the job is queued
+  bg_stage *stages;
+  int stages_len;
+  // number of stages that did not exit yet
+  atomic_int_t running;
+  char *cmd;
+  // exit code of the last stage
+  int status_code;
+  // monotonic_ns when the job started, and how long it ran once it finished
+  long long start_ns;
+  long long wall_ns;
+  // BG_PROCESS_QUEUED only
+  pending_job *pending;
+  // next slot in the job queue or in the free-list, -1 for the last one
+  int next;
+  // next slot in the same id bucket
+  int id_next;
+  // neighbours in the list of jobs in id order
+  int live_prev;
+  int live_next;
+} bg_process;
+
+// Table of background jobs.
+//
+// Jobs live in fixed-size chunks which are never moved nor freed before the
+// table is destroyed, so a slot (and a pointer to its bg_process) stays valid
+// for as long as the reaper refers to it. Free slots are reused through a
+// free-list, job ids are handed out in increasing order and never reused, and
+// an id -> slot hash keeps `kill %id` constant-time.
+//
+// Only the shell thread adds and removes jobs, so it may walk the table
+// without the jobs lock. The reaper thread only touches the atomic fields of
+// jobs it was given.
+#define JOB_TABLE_CHUNK_SIZE 256
+#define JOB_TABLE_MAX_CHUNKS 4096
+
+typedef struct {
+  // never reallocated, the reaper thread reads it without the jobs lock
+  bg_process *chunks[JOB_TABLE_MAX_CHUNKS];
+  int chunks_len;
+  int free_head;
+  int next_id;
+  // id -> slot, chained through bg_process.id_next
+  int *buckets;
+  int bucket_count;
+  int len;
+  // jobs in id order, linked through live_prev/live_next
+  int first;
+  int last;
+} job_table;
+
+void job_table_init(job_table *t);
+void job_table_destroy(job_table *t);
+
+// returns the slot of a new job with a new id (every other field is left to
+// the caller), or -1 if out of memory or slots
+int job_table_add(job_table *t);
+void job_table_remove(job_table *t, int slot);
+
+// slot of the job with this id, or -1
+int job_table_find(const job_table *t, int id);
+
+inline static bg_process *job_table_get(const job_table *t, int slot) {
+  return &t->chunks[slot / JOB_TABLE_CHUNK_SIZE][slot % JOB_TABLE_CHUNK_SIZE];
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "completion.h"
+
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <termios.h>
+#endif
+
+// Line editing for interactive shells: the cursor moves within the line, and
+// Tab completes the word before the cursor.
+//
+// The terminal is in raw mode only while a line is read, so the processes
+// started by the shell get it as it was. Only implemented on Unix, on Windows
+// line_editor_init fails and the console line input is used instead.
+
+// fills `result` for the word before `cursor`
+typedef int (*line_editor_completer)(void *userdata, const char *line,
+                                     size_t cursor, completion *result);
+
+typedef struct {
+  int fd;
+#ifndef _WIN32
+  // the terminal settings outside of line_editor_read
+  struct termios original;
+#endif
+  // the line being edited, null-terminated
+  char *line;
+  int len;
+  int cap;
+  int cursor;
+  int error;
+} line_editor;
+
+// fails if `fd` is not a terminal
+int line_editor_init(line_editor *editor, int fd);
+void line_editor_destroy(line_editor *editor);
+
+// prints the prompt and returns the line once Enter is pressed, which is valid
+// until the next call, or NULL at the end of the input (Ctrl-D on an empty
+// line) or if a read error occurred, in which case editor->error is set
+char *line_editor_read(line_editor *editor, const char *prompt,
+                       line_editor_completer complete, void *userdata);
@@ -0,0 +1,110 @@
+#include "line_reader.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define LINE_READER_BLOCK_SIZE (64 * 1024)
+
+int line_reader_init(line_reader *reader, int fd) {
+  reader->fd = fd;
+  reader->buffer = malloc(LINE_READER_BLOCK_SIZE);
+  if (!reader->buffer) {
+    return 0;
+  }
+
+  reader->cap = LINE_READER_BLOCK_SIZE;
+  reader->start = reader->end = reader->scanned = 0;
+  reader->eof = reader->error = 0;
+  return 1;
+}
+
+void line_reader_destroy(line_reader *reader) { free(reader->buffer); }
+
+// read another block, one byte at the end of the buffer is always kept free
+// for the null-terminator of the last line
+static int fill(line_reader *reader) {
+  if (reader->start > 0) {
+    size_t len = reader->end - reader->start;
+    memmove(reader->buffer, reader->buffer + reader->start, len);
+    reader->scanned -= reader->start;
+    reader->end = len;
+    reader->start = 0;
+  }
+
+  if (reader->cap - reader->end < LINE_READER_BLOCK_SIZE / 2) {
+    size_t new_cap = reader->cap * 2;
+    char *new_buffer = realloc(reader->buffer, new_cap);
+    if (!new_buffer) {
+      return 0;
+    }
+
+    reader->buffer = new_buffer;
+    reader->cap = new_cap;
+  }
+
+  size_t count = reader->cap - reader->end - 1;
+#ifdef _WIN32
+  if (count > INT_MAX) {
+    count = INT_MAX;
+  }
+#endif
+
+  while (1) {
+    long long n =
+        POSIX_WIN32(read)(reader->fd, reader->buffer + reader->end, count);
+    if (n > 0) {
+      reader->end += (size_t)n;
+      return 1;
+    }
+
+    if (n == 0) {
+      reader->eof = 1;
+      return 1;
+    }
+
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+}
+
+char *line_reader_next(line_reader *reader, size_t *len) {
+  while (1) {
+    char *begin = reader->buffer + reader->start;
+    char *newline = memchr(reader->buffer + reader->scanned, '\n',
+                           reader->end - reader->scanned);
+    if (newline) {
+      *newline = '\0';
+      *len = (size_t)(newline - begin);
+      reader->start = reader->scanned = (size_t)(newline - reader->buffer) + 1;
+      return begin;
+    }
+
+    reader->scanned = reader->end;
+    if (reader->eof) {
+      if (reader->start == reader->end) {
+        return NULL;
+      }
+
+      // last line without a trailing newline
+      reader->buffer[reader->end] = '\0';
+      *len = reader->end - reader->start;
+      reader->start = reader->scanned = reader->end;
+      return begin;
+    }
+
+    if (!fill(reader)) {
+      reader->error = 1;
+      return NULL;
+    }
+  }
+}
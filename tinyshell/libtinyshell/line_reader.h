@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+// Reads lines from a file descriptor in large blocks.
+//
+// Lines are returned as views into the internal buffer (the '\n' is replaced
+// by a null-terminator in place), so nothing is copied unless a line crosses a
+// block boundary. The buffer grows as needed, lines are only limited by the
+// available memory.
+typedef struct {
+  int fd;
+  char *buffer;
+  size_t cap;
+  // unconsumed data is buffer[start..end)
+  size_t start;
+  size_t end;
+  // buffer[start..scanned) is known to have no newline
+  size_t scanned;
+  int eof;
+  int error;
+} line_reader;
+
+int line_reader_init(line_reader *reader, int fd);
+void line_reader_destroy(line_reader *reader);
+
+// returns the next line (without the newline character), which is valid until
+// the next call, or NULL if there are no more lines (or a read error occurred,
+// in which case reader->error is set)
+char *line_reader_next(line_reader *reader, size_t *len);
@@ -0,0 +1,17 @@
+#pragma once
+
+// print the type and permissions, link count, owner, group, size and
+// modification date of every entry
+#define LS_DETAILS 1
+// print entries in directory order as they are read, without holding them
+// (Unix only, Windows lists them in the order FindNextFile returns anyway)
+#define LS_UNSORTED 2
+// also list every subdirectory, read in parallel and printed depth-first in
+// sorted order (sorted even with LS_UNSORTED), followed by the total number of
+// entries and bytes (Unix only)
+#define LS_RECURSIVE 4
+
+// lists the entries of `dir`, sorted by name unless LS_UNSORTED is set
+//
+// returns the exit code of the `ls` builtin
+int exec_ls(const char *dir, int flags);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// A file mapped in memory with MAP_SHARED semantics, so the changes made by
+// other processes to the same file are visible through `data`.
+//
+// The mapping always covers the whole file as of the last mapped_file_refresh
+// (or resize/append), an empty file is not mapped and has a NULL `data`.
+
+typedef struct {
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+  int writable;
+  char *data;
+  size_t size;
+} mapped_file;
+
+// opens `path`, creating it if needed, and maps it read-only or read-write
+int mapped_file_open(mapped_file *file, const char *path, int writable);
+void mapped_file_close(mapped_file *file);
+
+// maps the file again if its size changed since it was last mapped
+int mapped_file_refresh(mapped_file *file);
+// truncates the file or extends it with zeros, then maps it again
+int mapped_file_resize(mapped_file *file, size_t size);
+// writes at the end of the file (atomically with respect to the appends of
+// other processes) and maps it again
+int mapped_file_append(mapped_file *file, const void *data, size_t len);
+
+// exclusive advisory lock shared by every process using the file, blocking
+int mapped_file_lock(mapped_file *file);
+void mapped_file_unlock(mapped_file *file);
@@ -0,0 +1,160 @@
+#include "output.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tinycthread.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static char buffer[OUTPUT_BUFFER_SIZE];
+static size_t buffer_len;
+
+// text of the notices posted by other threads, not printed yet
+static mtx_t notices_lock;
+static char *notices;
+static int notices_len;
+static int notices_cap;
+
+void output_init(void) {
+  buffer_len = 0;
+  mtx_init(&notices_lock, mtx_plain);
+}
+
+void output_destroy(void) {
+  output_print_notices();
+  output_flush();
+  mtx_destroy(&notices_lock);
+  free(notices);
+  notices = NULL;
+  notices_len = notices_cap = 0;
+}
+
+static void write_all(const char *data, size_t len) {
+  while (len > 0) {
+#ifdef _WIN32
+    int n = _write(1, data, len > INT_MAX ? INT_MAX : (unsigned)len);
+#else
+    ssize_t n = write(STDOUT_FILENO, data, len);
+#endif
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // nobody is reading (EPIPE) or stdout is gone, drop the output
+      return;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+}
+
+void output_flush(void) {
+  fflush(stdout);
+  write_all(buffer, buffer_len);
+  buffer_len = 0;
+}
+
+void output_write(const char *data, size_t len) {
+  if (len > OUTPUT_BUFFER_SIZE - buffer_len) {
+    output_flush();
+  }
+  if (len >= OUTPUT_BUFFER_SIZE) {
+    write_all(data, len);
+    return;
+  }
+
+  memcpy(buffer + buffer_len, data, len);
+  buffer_len += len;
+}
+
+int output_puts(const char *s) {
+  size_t len = strlen(s);
+  output_write(s, len);
+  output_write("\n", 1);
+  return (int)len + 1;
+}
+
+static int output_vprintf(const char *fmt, va_list va) {
+  va_list copy;
+  va_copy(copy, va);
+  size_t space = OUTPUT_BUFFER_SIZE - buffer_len;
+  int len = vsnprintf(buffer + buffer_len, space, fmt, copy);
+  va_end(copy);
+  if (len < 0) {
+    return len;
+  }
+
+  if ((size_t)len < space) {
+    buffer_len += len;
+    return len;
+  }
+
+  // did not fit, vsnprintf wrote a truncated copy past buffer_len which is
+  // simply overwritten
+  output_flush();
+  if ((size_t)len < OUTPUT_BUFFER_SIZE) {
+    vsnprintf(buffer, OUTPUT_BUFFER_SIZE, fmt, va);
+    buffer_len = len;
+    return len;
+  }
+
+  char *large = malloc((size_t)len + 1);
+  if (!large) {
+    return -1;
+  }
+  vsnprintf(large, (size_t)len + 1, fmt, va);
+  write_all(large, len);
+  free(large);
+  return len;
+}
+
+int output_printf(const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int len = output_vprintf(fmt, va);
+  va_end(va);
+  return len;
+}
+
+void output_notice(const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int length = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  if (length < 0) {
+    return;
+  }
+
+  char *notice = malloc((size_t)length + 1);
+  if (!notice) {
+    return;
+  }
+  va_start(va, fmt);
+  vsnprintf(notice, (size_t)length + 1, fmt, va);
+  va_end(va);
+
+  mtx_lock(&notices_lock);
+  vecpush(&notices, &notices_len, &notices_cap, 1, notice, length);
+  mtx_unlock(&notices_lock);
+  free(notice);
+}
+
+void output_print_notices(void) {
+  mtx_lock(&notices_lock);
+  if (notices_len > 0) {
+    output_write(notices, notices_len);
+    notices_len = 0;
+  }
+  mtx_unlock(&notices_lock);
+}
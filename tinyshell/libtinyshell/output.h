@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+// Shell output.
+//
+// Everything the shell prints goes through one buffer, written to stdout in
+// whole blocks instead of one write (and one stdio lock) per printf when stdout
+// is a pipe or a file. The buffer is written out when it is full, before a
+// command is read, and whenever the descriptor is handed over: before processes
+// are started and around redirections. So it only ever holds the output of the
+// command being run, and one static buffer serves every command without being
+// allocated for each of them.
+//
+// Only the shell thread writes to the buffer. Other threads post notices, which
+// the shell thread moves to the buffer before the next prompt, so they never
+// land in the middle of a line or in the redirected output of a command. A
+// queued job started by the reaper thread writes to stdout directly, so its
+// output may come before what the current command still has in the buffer.
+
+void output_init(void);
+void output_destroy(void);
+
+int output_printf(const char *fmt, ...);
+// writes `s` and a newline, like puts
+int output_puts(const char *s);
+void output_write(const char *data, size_t len);
+// also flushes stdio's stdout, for whatever was written with printf
+void output_flush(void);
+
+// may be called from any thread
+void output_notice(const char *fmt, ...);
+// moves the notices posted so far to the output
+void output_print_notices(void);
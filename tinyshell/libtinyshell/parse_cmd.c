@@ -1,4 +1,5 @@
 #include "parse_cmd.h"
+#include "glob.h"
 #include "utils.h"
 #include <ctype.h>
 #include <stdio.h>
@@ -8,32 +9,88 @@
 #ifdef _WIN32
 #define ESCAPE_CHAR '^'
 #define IS_QUOTE(c) ((c) == '"')
+// Win32 programs expand their own wildcards
+#define PATTERN_CHARS ""
 #else
 #define ESCAPE_CHAR '\\'
 #define IS_QUOTE(c) ((c) == '"' || (c) == '\'')
+// wildcards, and the escape character of patterns
+#define PATTERN_CHARS "*?[\\"
 #endif
 
+#define IS_PATTERN_CHAR(c) ((c) != '\0' && strchr(PATTERN_CHARS, (c)))
+
 typedef enum {
   PARSE_CODEPOINT_NORMAL,
+  // a character following ESCAPE_CHAR
+  PARSE_CODEPOINT_ESCAPED,
   PARSE_CODEPOINT_QUOTE,
   PARSE_CODEPOINT_SPACE,
   PARSE_CODEPOINT_NULL_TERM,
   PARSE_CODEPOINT_ERROR,
-  PARSE_CODEPOINT_AMPERSAND
+  PARSE_CODEPOINT_AMPERSAND,
+  PARSE_CODEPOINT_PIPE,
+  PARSE_CODEPOINT_REDIRECT,
+  PARSE_CODEPOINT_VARIABLE
 } parse_codepoint_result;
 
+static int is_name_start(char c) {
+  return isalpha((unsigned char)c) || c == '_';
+}
+
+// $NAME, ${NAME} or $? at `*end`, returns PARSE_CODEPOINT_NORMAL without
+// consuming anything if the $ does not start a variable (it is a literal $)
+static parse_codepoint_result parse_variable(const char **end,
+                                             const char **name, int *name_len,
+                                             char **error) {
+  const char *c = *end + 1;
+  int braces = *c == '{';
+  c += braces;
+  const char *start = c;
+  if (*c == '?') {
+    ++c;
+  } else if (is_name_start(*c)) {
+    while (is_name_start(*c) || isdigit((unsigned char)*c))
+      ++c;
+  } else if (!braces) {
+    return PARSE_CODEPOINT_NORMAL;
+  }
+
+  if (braces && (c == start || *c != '}')) {
+    *error = printf_to_string("bad substitution, expected ${NAME}");
+    return PARSE_CODEPOINT_ERROR;
+  }
+
+  *name = start;
+  *name_len = (int)(c - start);
+  *end = c + braces;
+  return PARSE_CODEPOINT_VARIABLE;
+}
+
+// PARSE_CODEPOINT_VARIABLE sets `name` and `name_len` instead of `cp`
 static parse_codepoint_result
-parse_next_codepoint(const char **end, char *quote, char cp[8], char **error) {
+parse_next_codepoint(const char **end, char *quote, char cp[8],
+                     const char **name, int *name_len, char **error) {
   if (**end == '\0') {
     ++*end;
     return PARSE_CODEPOINT_NULL_TERM;
   }
 
-  if (**end == '&') {
+  if (**end == '&' && *quote == '\0') {
     ++*end;
     return PARSE_CODEPOINT_AMPERSAND;
   }
 
+  if (**end == '|' && *quote == '\0') {
+    ++*end;
+    return PARSE_CODEPOINT_PIPE;
+  }
+
+  if ((**end == '<' || **end == '>') && *quote == '\0') {
+    ++*end;
+    return PARSE_CODEPOINT_REDIRECT;
+  }
+
   if (**end == ESCAPE_CHAR) {
     ++*end;
     if (**end == '\0') {
@@ -45,7 +102,7 @@ parse_next_codepoint(const char **end, char *quote, char cp[8], char **error) {
     cp[0] = **end;
     cp[1] = '\0';
     ++*end;
-    return PARSE_CODEPOINT_NORMAL;
+    return PARSE_CODEPOINT_ESCAPED;
   }
 
   if (IS_QUOTE(**end)) {
@@ -60,6 +117,14 @@ parse_next_codepoint(const char **end, char *quote, char cp[8], char **error) {
     }
   }
 
+  if (**end == '$' && *quote != '\'') {
+    parse_codepoint_result result =
+        parse_variable(end, name, name_len, error);
+    if (result != PARSE_CODEPOINT_NORMAL) {
+      return result;
+    }
+  }
+
   cp[0] = **end;
   cp[1] = '\0';
   ++*end;
@@ -70,39 +135,174 @@ parse_next_codepoint(const char **end, char *quote, char cp[8], char **error) {
   return PARSE_CODEPOINT_NORMAL;
 }
 
-parse_arg_result parse_arg(const char **end, char **arg, char **error) {
+// parses [n]<, [n]>, [n]>>, [n]>&m and [n]<&m, returns PARSE_ARG_NORMAL if
+// there is no redirection operator at `*end`
+static parse_arg_result parse_redirection(const char **end, redirection *redir,
+                                          char **error) {
+  const char *c = *end;
+  int fd = -1;
+  if (isdigit((unsigned char)*c)) {
+    const char *digits = c;
+    while (isdigit((unsigned char)*c))
+      ++c;
+
+    if (*c != '<' && *c != '>') {
+      return PARSE_ARG_NORMAL;
+    }
+
+    if (c - digits > 1) {
+      *error = printf_to_string(
+          "only file descriptors 0-%d can be redirected", REDIRECT_MAX_FD);
+      return PARSE_ARG_ERROR;
+    }
+    fd = *digits - '0';
+  } else if (*c != '<' && *c != '>') {
+    return PARSE_ARG_NORMAL;
+  }
+
+  char op = *c++;
+  redir->fd = fd >= 0 ? fd : (op == '<' ? 0 : 1);
+  redir->target_fd = -1;
+  redir->path = NULL;
+  if (*c == '&') {
+    ++c;
+    if (!isdigit((unsigned char)c[0]) || isdigit((unsigned char)c[1])) {
+      *error = printf_to_string("expected a file descriptor (0-%d) after %c&",
+                                REDIRECT_MAX_FD, op);
+      return PARSE_ARG_ERROR;
+    }
+
+    redir->type = REDIRECT_DUP;
+    redir->target_fd = *c++ - '0';
+  } else if (op == '>' && *c == '>') {
+    ++c;
+    redir->type = REDIRECT_APPEND;
+  } else {
+    redir->type = op == '<' ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+  }
+
+  *end = c;
+  return PARSE_ARG_REDIRECT;
+}
+
+// appends the value of a variable to `args`, escaping the pattern characters
+// in it (`*escaped` is then set)
+static int expand_variable(const char *name, int name_len,
+                           const parse_vars *vars, arena *arena,
+                           arena_string *args, int *escaped) {
+  const char *value;
+  char status_code[16];
+  if (*name == '?') {
+    snprintf(status_code, sizeof status_code, "%d",
+             vars ? vars->status_code : 0);
+    value = status_code;
+  } else {
+    value = vars ? vars->lookup(vars->userdata, name, name_len) : NULL;
+    if (!value) {
+      return 1;
+    }
+  }
+
+  for (const char *special; (special = strpbrk(value, PATTERN_CHARS));
+       value = special + 1) {
+    if (!arena_string_append(arena, args, value, special - value) ||
+        !arena_string_append(arena, args, "\\", 1) ||
+        !arena_string_append(arena, args, special, 1)) {
+      return 0;
+    }
+    *escaped = 1;
+  }
+  return arena_string_append(arena, args, value, strlen(value));
+}
+
+// removes the escapes of pattern characters from the null-terminated argument
+// at `start`, which is the last thing in `args`
+static void unescape_arg(arena *arena, arena_string *args, size_t start) {
+  char *from = args->data + start, *to = from;
+  for (; *from; ++from) {
+    if (*from == '\\' && IS_PATTERN_CHAR(from[1])) {
+      ++from;
+    }
+    *to++ = *from;
+  }
+  *to = '\0';
+  arena_string_truncate(arena, args, to + 1 - args->data);
+}
+
+parse_arg_result parse_arg(const char **end, const parse_vars *vars,
+                           arena *arena, arena_string *args,
+                           redirection *redir, int *expanded, char **error) {
   while (isspace(**end) && **end != '\0')
     ++*end;
 
   if (**end == '\0') {
-    *arg = NULL;
     ++*end;
     return PARSE_ARG_EMPTY;
   }
 
+  parse_arg_result redir_result = parse_redirection(end, redir, error);
+  if (redir_result != PARSE_ARG_NORMAL) {
+    return redir_result;
+  }
+
   if (**end == '&') {
-    *arg = NULL;
     ++*end;
     return PARSE_ARG_BACKGROUND;
   }
 
+  if (**end == '|') {
+    ++*end;
+    return PARSE_ARG_PIPE;
+  }
+
   char quote = '\0';
-  *arg = NULL;
-  int arg_cap = 0;
-  int arg_len = 0;
+  size_t arg_start = args->len;
+  // anything but unquoted expansions, which make no argument when empty
+  int literal = 0;
+  // unquoted wildcards were seen, the argument is a pattern
+  int pattern = 0;
+  // pattern characters to match literally were escaped with a backslash
+  int escaped = 0;
   while (**end != '\0') {
     char c[8];
-    parse_codepoint_result typ = parse_next_codepoint(end, &quote, c, error);
+    const char *name;
+    int name_len;
+    parse_codepoint_result typ =
+        parse_next_codepoint(end, &quote, c, &name, &name_len, error);
     switch (typ) {
-    case PARSE_CODEPOINT_NORMAL: {
-      int n = (int)strlen(c); // currently n == 1
-      if (!vecpush(arg, &arg_len, &arg_cap, 1, c, n)) {
+    case PARSE_CODEPOINT_NORMAL:
+    case PARSE_CODEPOINT_ESCAPED: {
+      // in case the argument turns out to be a pattern
+      if (IS_PATTERN_CHAR(c[0])) {
+        if (typ == PARSE_CODEPOINT_NORMAL && quote == '\0') {
+          pattern = 1;
+        } else if (!arena_string_append(arena, args, "\\", 1)) {
+          *error = printf_to_string("unable to allocate memory for arg");
+          goto fail_append_arg;
+        } else {
+          escaped = 1;
+        }
+      }
+
+      size_t n = strlen(c); // currently n == 1
+      if (!arena_string_append(arena, args, c, n)) {
         *error = printf_to_string("unable to allocate memory for arg");
-        goto fail_realloc_arg;
+        goto fail_append_arg;
       }
+      literal = 1;
       break;
     }
     case PARSE_CODEPOINT_QUOTE:
+      literal = 1;
+      break;
+    case PARSE_CODEPOINT_VARIABLE:
+      // the value is appended in place, no copy of the argument is made
+      if (!expand_variable(name, name_len, vars, arena, args, &escaped)) {
+        *error = printf_to_string("unable to allocate memory for arg");
+        goto fail_append_arg;
+      }
+      *expanded = 1;
+      literal |= quote != '\0';
       break;
     case PARSE_CODEPOINT_NULL_TERM:
     case PARSE_CODEPOINT_SPACE:
@@ -110,6 +310,8 @@ parse_arg_result parse_arg(const char **end, char **arg, char **error) {
     case PARSE_CODEPOINT_ERROR:
       goto fail_parse_codepoints;
     case PARSE_CODEPOINT_AMPERSAND:
+    case PARSE_CODEPOINT_PIPE:
+    case PARSE_CODEPOINT_REDIRECT:
       --*end;
       goto outer;
     }
@@ -120,80 +322,289 @@ outer:
     goto fail_unclosed_quotes;
   }
 
-  char nullterm = '\0';
-  if (!vecpush(arg, &arg_len, &arg_cap, 1, &nullterm, 1)) {
+  if (!literal && args->len == arg_start) {
+    return PARSE_ARG_NOTHING;
+  }
+
+  if (!arena_string_append(arena, args, "", 1)) {
     *error = printf_to_string(
         "unable to allocate memory to null-terminate argument string");
-    goto fail_realloc_arg;
+    goto fail_append_arg;
   }
 
+  if (pattern) {
+    *expanded = 1;
+    return PARSE_ARG_PATTERN;
+  }
+  if (escaped) {
+    unescape_arg(arena, args, arg_start);
+  }
   return PARSE_ARG_NORMAL;
 
 fail_unclosed_quotes:
 fail_parse_codepoints:
-fail_realloc_arg:
-  free(*arg);
+fail_append_arg:
+  arena_string_truncate(arena, args, arg_start);
   return PARSE_ARG_ERROR;
 }
 
-int parse_command(const char *command, command_parse_result *result,
-                  char **error) {
-#define ARGV_SCALE_FACTOR 2
+// tags written before each argument in the argument buffer
+#define TAG_ARG 'a'
+#define TAG_PIPE '|'
+// followed by the bytes of a redirection and its null-terminated path
+#define TAG_REDIRECT 'r'
+
+typedef struct {
+  arena *arena;
+  arena_string *args;
+} match_sink;
+
+static int append_match(void *userdata, const char *path) {
+  match_sink *sink = userdata;
+  return arena_string_append(sink->arena, sink->args, (char[]){TAG_ARG}, 1) &&
+         arena_string_append(sink->arena, sink->args, path, strlen(path) + 1);
+}
+
+// replaces the pattern at the end of `args`, after the tag at `tag_pos`, by
+// the matching paths, or by itself without the escapes if nothing matches
+//
+// returns the number of arguments, -1 on error
+static int expand_pattern(const parse_vars *vars, arena *arena,
+                          arena_string *args, size_t tag_pos, char **error) {
+  if (vars && vars->globs) {
+    char *pattern = printf_to_string("%s", args->data + tag_pos + 1);
+    if (!pattern) {
+      *error = printf_to_string("unable to allocate memory for pattern");
+      return -1;
+    }
+
+    arena_string_truncate(arena, args, tag_pos);
+    match_sink sink = {arena, args};
+    int matches = glob_expand(vars->globs, pattern, append_match, &sink);
+    int restored =
+        matches != 0 ||
+        (arena_string_append(arena, args, (char[]){TAG_ARG}, 1) &&
+         arena_string_append(arena, args, pattern, strlen(pattern) + 1));
+    free(pattern);
+    if (matches < 0 || !restored) {
+      *error = printf_to_string("unable to allocate memory for matches");
+      return -1;
+    }
+    if (matches > 0) {
+      return matches;
+    }
+  }
+
+  unescape_arg(arena, args, tag_pos + 1);
+  return 1;
+}
+
+// reads the file name of a redirection into `args`, patterns are not expanded
+static int parse_redirection_path(const char **end, const parse_vars *vars,
+                                  arena *arena, arena_string *args,
+                                  int *expanded, char **error) {
+  redirection unused;
+  size_t start = args->len;
+  switch (parse_arg(end, vars, arena, args, &unused, expanded, error)) {
+  case PARSE_ARG_PATTERN:
+    unescape_arg(arena, args, start);
+    return 1;
+  case PARSE_ARG_NORMAL:
+    return 1;
+  case PARSE_ARG_ERROR:
+    return 0;
+  default:
+    *error = printf_to_string("missing file name after redirection");
+    return 0;
+  }
+}
+
+int parse_command(const char *command, const parse_vars *vars, arena *arena,
+                  command_parse_result *result, char **error) {
   result->argv = NULL;
   result->argc = 0;
   result->foreground = 1;
-  int argv_cap = 0;
+  result->stages = NULL;
+  result->stages_len = 1;
+  result->expanded = 0;
+
+  // the arguments are stored back to back, each one tagged and
+  // null-terminated, with a TAG_PIPE between stages
+  arena_string args = {NULL, 0};
+  int args_len = 0, stage_argc = 0, redirections_len = 0;
   while (1) {
-    char *arg;
-    parse_arg_result arg_result = parse_arg(&command, &arg, error);
+    size_t tag_pos = args.len;
+    if (!arena_string_append(arena, &args, (char[]){TAG_ARG}, 1)) {
+      *error = printf_to_string("unable to allocate memory for arg");
+      return 0;
+    }
+
+    redirection redir;
+    parse_arg_result arg_result = parse_arg(&command, vars, arena, &args,
+                                            &redir, &result->expanded, error);
+    if (arg_result != PARSE_ARG_NORMAL && arg_result != PARSE_ARG_PATTERN) {
+      arena_string_truncate(arena, &args, tag_pos);
+    }
+
     if (!result->foreground && arg_result != PARSE_ARG_EMPTY) {
       *error = printf_to_string(
-          "& (background specifier) should be the last arg in command, as this "
-          "shell does not support composite commands on Unix");
-      goto fail_parse_arg;
+          "& (background specifier) should be the last arg in command");
+      return 0;
     }
     switch (arg_result) {
     case PARSE_ARG_NORMAL:
-      if (!vecpush(&result->argv, &result->argc, &argv_cap, sizeof(char *),
-                   &arg, 1)) {
-        printf_to_string("unable to allocate memory for argv");
-        goto fail_realloc_arg;
+      ++args_len;
+      ++stage_argc;
+      break;
+    case PARSE_ARG_NOTHING:
+      break;
+    case PARSE_ARG_PATTERN: {
+      int matches = expand_pattern(vars, arena, &args, tag_pos, error);
+      if (matches < 0) {
+        return 0;
       }
+      args_len += matches;
+      stage_argc += matches;
       break;
+    }
     case PARSE_ARG_EMPTY:
       goto outer;
     case PARSE_ARG_BACKGROUND:
       result->foreground = 0;
       break;
-    case PARSE_ARG_ERROR:
-      goto fail_parse_arg;
+    case PARSE_ARG_PIPE:
+      if (stage_argc == 0) {
+        *error = printf_to_string("empty command in pipeline");
+        return 0;
+      }
+      if (!arena_string_append(arena, &args, (char[]){TAG_PIPE}, 1)) {
+        *error = printf_to_string("unable to allocate memory for pipeline");
+        return 0;
+      }
+      ++result->stages_len;
+      stage_argc = 0;
       break;
+    case PARSE_ARG_REDIRECT:
+      if (!arena_string_append(arena, &args, (char[]){TAG_REDIRECT}, 1) ||
+          !arena_string_append(arena, &args, (const char *)&redir,
+                               sizeof redir)) {
+        *error = printf_to_string("unable to allocate memory for redirection");
+        return 0;
+      }
+
+      if (redir.type == REDIRECT_DUP) {
+        if (!arena_string_append(arena, &args, "", 1)) {
+          *error =
+              printf_to_string("unable to allocate memory for redirection");
+          return 0;
+        }
+      } else if (!parse_redirection_path(&command, vars, arena, &args,
+                                         &result->expanded, error)) {
+        return 0;
+      }
+      ++redirections_len;
+      break;
+    case PARSE_ARG_ERROR:
+      return 0;
     }
   }
-outer:;
-  char *nullterm = NULL;
-  if (!vecpush(&result->argv, &result->argc, &argv_cap, sizeof(char *),
-               &nullterm, 1)) {
-    printf_to_string(
-        "unable to allocate memory to null-terminate argument array");
-    goto fail_realloc_arg;
+outer:
+  if (stage_argc == 0 && result->stages_len > 1) {
+    *error = printf_to_string("empty command in pipeline");
+    return 0;
   }
-  // the null-terminator does not count
-  --result->argc;
-  return 1;
 
-fail_parse_arg:
-fail_realloc_arg:
-  for (int i = 0; i < result->argc; ++i) {
-    free(result->argv[i]);
+  // every stage gets its own null-terminated slice of a single argv buffer
+  result->stages =
+      arena_alloc(arena, result->stages_len * sizeof *result->stages);
+  char **argv =
+      arena_alloc(arena, (args_len + result->stages_len) * sizeof(char *));
+  redirection *redirections = NULL;
+  if (redirections_len > 0) {
+    redirections = arena_alloc(arena, redirections_len * sizeof *redirections);
   }
-  free(result->argv);
-  return 0;
+  if (!result->stages || !argv || (redirections_len > 0 && !redirections)) {
+    *error = printf_to_string("unable to allocate memory for argv");
+    return 0;
+  }
+
+  char *arg = args.data, *args_end = args.data + args.len;
+  for (int i = 0; i < result->stages_len; ++i) {
+    command_stage *stage = &result->stages[i];
+    stage->argv = argv;
+    stage->argc = 0;
+    stage->redirections = redirections;
+    stage->redirections_len = 0;
+    while (arg < args_end && *arg != TAG_PIPE) {
+      if (*arg == TAG_ARG) {
+        *argv++ = ++arg;
+        ++stage->argc;
+      } else {
+        redirection *redir = &redirections[stage->redirections_len++];
+        memcpy(redir, arg + 1, sizeof *redir);
+        arg += 1 + sizeof *redir;
+        if (redir->type != REDIRECT_DUP) {
+          redir->path = arg;
+        }
+      }
+      arg += strlen(arg) + 1;
+    }
+    *argv++ = NULL;
+    if (redirections) {
+      redirections += stage->redirections_len;
+    }
+    // skip the TAG_PIPE
+    ++arg;
+  }
+
+  result->argc = result->stages[0].argc;
+  result->argv = result->stages[0].argv;
+  return 1;
 }
 
-void command_parse_result_free(command_parse_result *result) {
-  for (int i = 0; i < result->argc; ++i) {
-    free(result->argv[i]);
+int copy_parse_result(const command_parse_result *src, arena *arena,
+                      command_parse_result *dst) {
+  *dst = *src;
+  dst->stages = arena_alloc(arena, src->stages_len * sizeof *dst->stages);
+  if (!dst->stages) {
+    return 0;
+  }
+
+  for (int i = 0; i < src->stages_len; ++i) {
+    const command_stage *from = &src->stages[i];
+    command_stage *to = &dst->stages[i];
+    *to = *from;
+    to->argv = arena_alloc(arena, (from->argc + 1) * sizeof *to->argv);
+    if (!to->argv) {
+      return 0;
+    }
+
+    for (int j = 0; j < from->argc; ++j) {
+      if (!(to->argv[j] = arena_printf(arena, "%s", from->argv[j]))) {
+        return 0;
+      }
+    }
+    to->argv[from->argc] = NULL;
+
+    if (from->redirections_len > 0) {
+      to->redirections = arena_alloc(
+          arena, from->redirections_len * sizeof *to->redirections);
+      if (!to->redirections) {
+        return 0;
+      }
+
+      for (int j = 0; j < from->redirections_len; ++j) {
+        to->redirections[j] = from->redirections[j];
+        if (from->redirections[j].path &&
+            !(to->redirections[j].path =
+                  arena_printf(arena, "%s", from->redirections[j].path))) {
+          return 0;
+        }
+      }
+    }
   }
-  free(result->argv);
+
+  dst->argc = dst->stages[0].argc;
+  dst->argv = dst->stages[0].argv;
+  return 1;
 }
@@ -1,20 +1,91 @@
 #pragma once
 
+#include "arena.h"
+#include "glob.h"
+
+typedef enum {
+  REDIRECT_INPUT,  // [n]<file
+  REDIRECT_OUTPUT, // [n]>file
+  REDIRECT_APPEND, // [n]>>file
+  REDIRECT_DUP,    // [n]>&m, [n]<&m
+} redirection_type;
+
+// only single digit descriptors can be redirected, like in POSIX sh
+#define REDIRECT_MAX_FD 9
+
+typedef struct {
+  redirection_type type;
+  int fd;
+  // REDIRECT_DUP: the descriptor duplicated to `fd`
+  int target_fd;
+  // NULL for REDIRECT_DUP
+  const char *path;
+} redirection;
+
 typedef struct {
+  int argc;
+  char **argv;
+  // applied in order, after the pipes are connected
+  redirection *redirections;
+  int redirections_len;
+} command_stage;
+
+// argv and the arguments are allocated from the arena passed to parse_command
+typedef struct {
+  // the first stage of the pipeline
   int argc;
   char **argv;
   int foreground;
+  // stages of the pipeline (a | b | c), stages_len == 1 for simple commands
+  command_stage *stages;
+  int stages_len;
+  // the command contains $VAR, ${VAR}, $? or a filename pattern, so the
+  // arguments only hold for the variables and files it was parsed with
+  int expanded;
 } command_parse_result;
 
-int parse_command(const char *command, command_parse_result *result,
-                  char **error);
-void command_parse_result_free(command_parse_result *result);
+// Variables for $NAME and ${NAME}, expanded outside of single quotes. The value
+// becomes part of the argument as is: it is never split into several arguments,
+// but an argument made only of unquoted expansions which are all empty is
+// dropped (`cmd $UNSET` runs `cmd` alone).
+typedef struct {
+  // returns the value of the first `len` characters of `name`, or NULL if the
+  // variable is not set
+  const char *(*lookup)(void *userdata, const char *name, int len);
+  void *userdata;
+  // $?
+  int status_code;
+  // unquoted *, ? and [...] are replaced by the matching paths (see glob.h),
+  // or kept as is if nothing matches or `globs` is NULL
+  glob_cache *globs;
+} parse_vars;
+
+// `vars` may be NULL, every variable is then empty
+int parse_command(const char *command, const parse_vars *vars, arena *arena,
+                  command_parse_result *result, char **error);
+
+// deep copy of `src` allocated from `arena`
+int copy_parse_result(const command_parse_result *src, arena *arena,
+                      command_parse_result *dst);
 
 typedef enum {
   PARSE_ARG_NORMAL,
+  // like PARSE_ARG_NORMAL, but with unquoted wildcards: the characters to match
+  // literally are escaped with a backslash (Unix only)
+  PARSE_ARG_PATTERN,
+  // only empty unquoted expansions, nothing is appended to `args`
+  PARSE_ARG_NOTHING,
   PARSE_ARG_EMPTY,
   PARSE_ARG_BACKGROUND,
+  PARSE_ARG_PIPE,
+  PARSE_ARG_REDIRECT,
   PARSE_ARG_ERROR,
 } parse_arg_result;
 
-parse_arg_result parse_arg(const char **end, char **arg, char **error);
+// the argument is appended to `args`, null-terminated
+// for PARSE_ARG_REDIRECT only the operator is consumed and `redir` is filled,
+// except for its path
+// `*expanded` is set if the argument contains a variable or is a pattern
+parse_arg_result parse_arg(const char **end, const parse_vars *vars,
+                           arena *arena, arena_string *args,
+                           redirection *redir, int *expanded, char **error);
@@ -0,0 +1,270 @@
+#include "glob.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct {
+  const char *name;
+  // d_type, DT_UNKNOWN if the file system does not report it
+  unsigned char type;
+} glob_entry;
+
+struct glob_dir {
+  glob_dir *next;
+  // as it appears in the matches: "" for the current directory, otherwise
+  // ending with a slash
+  const char *path;
+  // in directory order, without . and ..
+  glob_entry *entries;
+  int entries_len;
+};
+
+void glob_cache_init(glob_cache *cache) {
+  arena_init(&cache->arena);
+  cache->dirs = NULL;
+}
+
+void glob_cache_destroy(glob_cache *cache) {
+  for (glob_dir *dir = cache->dirs; dir; dir = dir->next) {
+    free(dir->entries);
+  }
+  arena_free(&cache->arena);
+  cache->dirs = NULL;
+}
+
+// returns the listing of `path`, reading the directory if this is the first
+// pattern over it, or NULL on allocation failure
+static glob_dir *list_dir(glob_cache *cache, const char *path) {
+  for (glob_dir *dir = cache->dirs; dir; dir = dir->next) {
+    if (strcmp(dir->path, path) == 0) {
+      return dir;
+    }
+  }
+
+  glob_dir *dir = arena_alloc(&cache->arena, sizeof *dir);
+  char *path_copy = dir ? arena_printf(&cache->arena, "%s", path) : NULL;
+  if (!path_copy) {
+    return NULL;
+  }
+
+  dir->path = path_copy;
+  dir->entries = NULL;
+  dir->entries_len = 0;
+  // a directory which cannot be read has no matches
+  DIR *d = opendir(*path ? path : ".");
+  if (!d) {
+    goto done;
+  }
+
+  int entries_cap = 0;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    const char *name = e->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+
+    size_t size = strlen(name) + 1;
+    char *name_copy = arena_alloc(&cache->arena, size);
+    if (!name_copy) {
+      goto fail;
+    }
+    memcpy(name_copy, name, size);
+
+    glob_entry entry = {name_copy, e->d_type};
+    if (!vecpush(&dir->entries, &dir->entries_len, &entries_cap, sizeof entry,
+                 &entry, 1)) {
+      goto fail;
+    }
+  }
+  closedir(d);
+
+done:
+  dir->next = cache->dirs;
+  cache->dirs = dir;
+  return dir;
+
+fail:
+  closedir(d);
+  free(dir->entries);
+  return NULL;
+}
+
+typedef struct {
+  glob_cache *cache;
+  glob_callback callback;
+  void *userdata;
+  // the components of the pattern, without the slashes
+  char **components;
+  int components_len;
+  // the pattern ends with a slash, so it only matches directories
+  int dirs_only;
+  // the path matched so far, null-terminated
+  char *path;
+  int path_len;
+  int path_cap;
+  int matches;
+} glob_state;
+
+static int has_wildcards(const char *component) {
+  for (const char *c = component; *c; ++c) {
+    if (*c == '\\' && c[1]) {
+      ++c;
+    } else if (*c == '*' || *c == '?' || *c == '[') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int append_path(glob_state *s, const char *str, int len) {
+  // keeps room for the terminator
+  if (!vecpush(&s->path, &s->path_len, &s->path_cap, 1, str, len + 1)) {
+    return 0;
+  }
+  --s->path_len;
+  s->path[s->path_len] = '\0';
+  return 1;
+}
+
+// appends a literal component, without its escapes
+static int append_unescaped(glob_state *s, const char *component) {
+  for (const char *c = component; *c; ++c) {
+    if (*c == '\\' && c[1]) {
+      ++c;
+    }
+    if (!append_path(s, c, 1)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int emit(glob_state *s) {
+  if (s->dirs_only && !append_path(s, "/", 1)) {
+    return 0;
+  }
+  ++s->matches;
+  return s->callback(s->userdata, s->path);
+}
+
+static int is_dir(glob_state *s, const glob_entry *entry) {
+  if (entry->type == DT_DIR) {
+    return 1;
+  }
+  if (entry->type != DT_UNKNOWN && entry->type != DT_LNK) {
+    return 0;
+  }
+
+  // s->path holds the path of the entry
+  struct stat st;
+  return stat(s->path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp((*(glob_entry *const *)a)->name,
+                (*(glob_entry *const *)b)->name);
+}
+
+static int expand(glob_state *s, int i);
+
+// s->path holds the match of components 0..i
+static int expand_next(glob_state *s, int i) {
+  if (i + 1 < s->components_len) {
+    return append_path(s, "/", 1) && expand(s, i + 1);
+  }
+  return emit(s);
+}
+
+// matches the components from i on, after s->path
+static int expand(glob_state *s, int i) {
+  const char *component = s->components[i];
+  int last = i + 1 == s->components_len;
+  int path_len = s->path_len;
+  int ok = 1;
+  if (!has_wildcards(component)) {
+    // no need to read the directory, the file exists or it does not
+    if (!append_unescaped(s, component)) {
+      return 0;
+    }
+
+    struct stat st;
+    int exists = !last || (s->dirs_only ? stat(s->path, &st) == 0 &&
+                                              S_ISDIR(st.st_mode)
+                                        : lstat(s->path, &st) == 0);
+    if (exists) {
+      ok = expand_next(s, i);
+    }
+    goto done;
+  }
+
+  glob_dir *dir = list_dir(s->cache, s->path);
+  if (!dir) {
+    return 0;
+  }
+
+  // only the matches are sorted, not the whole directory
+  glob_entry **matches = NULL;
+  int matches_len = 0, matches_cap = 0;
+  for (int j = 0; j < dir->entries_len; ++j) {
+    glob_entry *entry = &dir->entries[j];
+    if (fnmatch(component, entry->name, FNM_PERIOD) == 0 &&
+        !vecpush(&matches, &matches_len, &matches_cap, sizeof entry, &entry,
+                 1)) {
+      free(matches);
+      return 0;
+    }
+  }
+  qsort(matches, matches_len, sizeof *matches, compare_entries);
+
+  for (int j = 0; j < matches_len && ok; ++j) {
+    s->path_len = path_len;
+    ok = append_path(s, matches[j]->name, (int)strlen(matches[j]->name));
+    if (ok && (!last || s->dirs_only) && !is_dir(s, matches[j])) {
+      continue;
+    }
+    ok = ok && expand_next(s, i);
+  }
+  free(matches);
+
+done:
+  s->path_len = path_len;
+  s->path[path_len] = '\0';
+  return ok;
+}
+
+int glob_expand(glob_cache *cache, const char *pattern, glob_callback callback,
+                void *userdata) {
+  glob_state s = {cache, callback, userdata, NULL, 0, 0, NULL, 0, 0, 0};
+  char *copy = printf_to_string("%s", pattern);
+  if (!copy) {
+    return -1;
+  }
+
+  int components_cap = 0;
+  int ok = *copy == '/' ? append_path(&s, "/", 1) : append_path(&s, "", 0);
+
+  // empty components (a//b) are dropped
+  char *saveptr;
+  for (char *component = reentrant_strtok(copy, "/", &saveptr);
+       component && ok;
+       component = reentrant_strtok(NULL, "/", &saveptr)) {
+    ok = vecpush(&s.components, &s.components_len, &components_cap,
+                 sizeof component, &component, 1);
+  }
+
+  s.dirs_only = pattern[strlen(pattern) - 1] == '/';
+  if (ok && s.components_len > 0) {
+    ok = expand(&s, 0);
+  }
+
+  free(s.components);
+  free(s.path);
+  free(copy);
+  return ok ? s.matches : -1;
+}
@@ -0,0 +1,300 @@
+#include "line_editor.h"
+#include "output.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define CONTROL_KEY(c) ((c) & 0x1f)
+#define BACKSPACE 127
+// beyond this, a second Tab only shows how many candidates there are
+#define MAX_LISTED 256
+
+int line_editor_init(line_editor *editor, int fd) {
+  if (!isatty(fd) || tcgetattr(fd, &editor->original) != 0) {
+    return 0;
+  }
+
+  editor->fd = fd;
+  editor->line = NULL;
+  editor->len = 0;
+  editor->cap = 0;
+  editor->cursor = 0;
+  editor->error = 0;
+  return 1;
+}
+
+void line_editor_destroy(line_editor *editor) { free(editor->line); }
+
+// returns 0 at the end of the input or on error
+static int read_key(line_editor *editor, char *c) {
+  while (1) {
+    ssize_t n = read(editor->fd, c, 1);
+    if (n == 1) {
+      return 1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      editor->error = 1;
+      return 0;
+    }
+  }
+}
+
+static void bell(void) { output_write("\a", 1); }
+
+static void redraw(line_editor *editor, const char *prompt) {
+  output_write("\r", 1);
+  output_write(prompt, strlen(prompt));
+  output_write(editor->line, editor->len);
+  // clears what is left of a longer line
+  output_write("\x1b[K", 3);
+  if (editor->cursor < editor->len) {
+    output_printf("\x1b[%dD", editor->len - editor->cursor);
+  }
+  output_flush();
+}
+
+// keeps room for the terminator
+static int reserve(line_editor *editor, int len) {
+  if (len < editor->cap) {
+    return 1;
+  }
+
+  int cap = max_int(editor->cap * 2, max_int(len + 1, 128));
+  char *line = realloc(editor->line, cap);
+  if (!line) {
+    return 0;
+  }
+  editor->line = line;
+  editor->cap = cap;
+  return 1;
+}
+
+// replaces line[start..end) with `text`, the cursor ends up after it
+static void replace(line_editor *editor, int start, int end, const char *text,
+                    int text_len) {
+  int len = editor->len - (end - start) + text_len;
+  if (!reserve(editor, len)) {
+    bell();
+    return;
+  }
+
+  memmove(editor->line + start + text_len, editor->line + end,
+          editor->len - end);
+  memcpy(editor->line + start, text, text_len);
+  editor->len = len;
+  editor->line[len] = '\0';
+  editor->cursor = start + text_len;
+}
+
+// in columns sorted top to bottom, like ls
+static void list_candidates(line_editor *editor, const completion *c) {
+  int shown = c->candidates_len < MAX_LISTED ? c->candidates_len : MAX_LISTED;
+  int width = 0;
+  for (int i = 0; i < shown; ++i) {
+    width = max_int(width, (int)strlen(c->candidates[i]));
+  }
+  width += 2;
+
+  struct winsize ws;
+  int columns =
+      ioctl(editor->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  int per_row = max_int(columns / width, 1);
+  int rows = (shown + per_row - 1) / per_row;
+
+  output_write("\n", 1);
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < per_row; ++col) {
+      int i = col * rows + row;
+      if (i >= shown) {
+        break;
+      }
+      int last = col == per_row - 1 || i + rows >= shown;
+      output_printf("%-*s", last ? 0 : width, c->candidates[i]);
+    }
+    output_write("\n", 1);
+  }
+  if (shown < c->candidates_len) {
+    output_printf("(%d more)\n", c->candidates_len - shown);
+  }
+}
+
+// a Tab completes as much as all the candidates have in common, if that adds
+// nothing the next one lists them, returns 1 if the line changed
+static int complete_word(line_editor *editor, line_editor_completer complete,
+                         void *userdata, int repeated) {
+  completion c;
+  completion_init(&c);
+  int changed = 0;
+  if (!complete(userdata, editor->line, editor->cursor, &c)) {
+    bell();
+    goto done;
+  }
+
+  int start = (int)c.word_start;
+  if (c.replacement) {
+    int len = (int)strlen(c.replacement);
+    if (len != editor->cursor - start ||
+        memcmp(c.replacement, editor->line + start, len) != 0) {
+      replace(editor, start, editor->cursor, c.replacement, len);
+      changed = 1;
+      goto done;
+    }
+  }
+
+  if (c.candidates_len == 0 || !repeated) {
+    bell();
+  } else {
+    list_candidates(editor, &c);
+  }
+
+done:
+  completion_destroy(&c);
+  return changed;
+}
+
+// the keys sent as ESC [ ... or ESC O ..., returns 0 at the end of the input
+static int escape_sequence(line_editor *editor) {
+  char kind, key;
+  if (!read_key(editor, &kind) || !read_key(editor, &key)) {
+    return 0;
+  }
+
+  if (kind == '[' && key >= '0' && key <= '9') {
+    // ESC [ number ~, with optional modifiers after a ';'
+    char number = key;
+    do {
+      if (!read_key(editor, &key)) {
+        return 0;
+      }
+    } while ((key >= '0' && key <= '9') || key == ';');
+    if (key != '~') {
+      return 1;
+    }
+    if (number == '3' && editor->cursor < editor->len) {
+      replace(editor, editor->cursor, editor->cursor + 1, "", 0);
+    } else if (number == '1' || number == '7') {
+      editor->cursor = 0;
+    } else if (number == '4' || number == '8') {
+      editor->cursor = editor->len;
+    }
+  } else if (kind == '[' || kind == 'O') {
+    if (key == 'C' && editor->cursor < editor->len) {
+      ++editor->cursor;
+    } else if (key == 'D' && editor->cursor > 0) {
+      --editor->cursor;
+    } else if (key == 'H') {
+      editor->cursor = 0;
+    } else if (key == 'F') {
+      editor->cursor = editor->len;
+    }
+  }
+  return 1;
+}
+
+char *line_editor_read(line_editor *editor, const char *prompt,
+                       line_editor_completer complete, void *userdata) {
+  // the settings may have been changed since, with stty for example
+  struct termios raw;
+  if (tcgetattr(editor->fd, &editor->original) != 0) {
+    editor->error = 1;
+    return NULL;
+  }
+  raw = editor->original;
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(IXON | ICRNL);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  // TCSANOW keeps what was typed ahead while the previous command ran
+  if (tcsetattr(editor->fd, TCSANOW, &raw) != 0) {
+    editor->error = 1;
+    return NULL;
+  }
+
+  char *result = NULL;
+  editor->len = 0;
+  editor->cursor = 0;
+  if (!reserve(editor, 0)) {
+    editor->error = 1;
+    goto done;
+  }
+  editor->line[0] = '\0';
+  redraw(editor, prompt);
+
+  int tabs = 0;
+  char c;
+  while (read_key(editor, &c)) {
+    tabs = c == '\t' ? tabs + 1 : 0;
+    if (c == '\r' || c == '\n') {
+      output_write("\n", 1);
+      result = editor->line;
+      break;
+    } else if (c == CONTROL_KEY('D')) {
+      if (editor->len == 0) {
+        output_write("\n", 1);
+        break;
+      }
+      if (editor->cursor < editor->len) {
+        replace(editor, editor->cursor, editor->cursor + 1, "", 0);
+      }
+    } else if (c == CONTROL_KEY('C')) {
+      // the line is dropped, like a command interrupted before it started
+      output_write("^C\n", 3);
+      editor->len = 0;
+      editor->line[0] = '\0';
+      result = editor->line;
+      break;
+    } else if (c == '\t') {
+      if (complete_word(editor, complete, userdata, tabs > 1)) {
+        tabs = 0;
+      }
+    } else if (c == '\x1b') {
+      if (!escape_sequence(editor)) {
+        break;
+      }
+    } else if (c == BACKSPACE || c == CONTROL_KEY('H')) {
+      if (editor->cursor > 0) {
+        replace(editor, editor->cursor - 1, editor->cursor, "", 0);
+      }
+    } else if (c == CONTROL_KEY('A')) {
+      editor->cursor = 0;
+    } else if (c == CONTROL_KEY('E')) {
+      editor->cursor = editor->len;
+    } else if (c == CONTROL_KEY('B')) {
+      editor->cursor -= editor->cursor > 0;
+    } else if (c == CONTROL_KEY('F')) {
+      editor->cursor += editor->cursor < editor->len;
+    } else if (c == CONTROL_KEY('U')) {
+      replace(editor, 0, editor->cursor, "", 0);
+    } else if (c == CONTROL_KEY('K')) {
+      replace(editor, editor->cursor, editor->len, "", 0);
+    } else if (c == CONTROL_KEY('W')) {
+      int start = editor->cursor;
+      while (start > 0 && editor->line[start - 1] == ' ') {
+        --start;
+      }
+      while (start > 0 && editor->line[start - 1] != ' ') {
+        --start;
+      }
+      replace(editor, start, editor->cursor, "", 0);
+    } else if (c == CONTROL_KEY('L')) {
+      output_write("\x1b[H\x1b[2J", 7);
+    } else if ((unsigned char)c >= ' ') {
+      replace(editor, editor->cursor, editor->cursor, &c, 1);
+    } else {
+      continue;
+    }
+    redraw(editor, prompt);
+  }
+
+done:
+  output_flush();
+  tcsetattr(editor->fd, TCSANOW, &editor->original);
+  return result;
+}
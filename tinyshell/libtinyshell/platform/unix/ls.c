@@ -0,0 +1,883 @@
+#ifdef __linux__
+// syscall
+#define _GNU_SOURCE
+#endif
+
+#include "ls.h"
+#include "output.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
+
+#include <tinycthread.h>
+
+// directories smaller than this are stat-ed on the calling thread, below it
+// starting threads costs more than it saves
+#define LS_ENTRIES_PER_THREAD 1024
+#define LS_MAX_THREADS 8
+
+// `ls -R` reads directories on a pool of threads, I/O bound so there may be
+// more of them than processors
+#define LS_MAX_WORKERS 16
+// directories read but not printed yet, beyond this the workers wait for the
+// printer
+#define LS_MAX_READ_AHEAD 256
+
+// user and group names by id, getpwuid/getgrgid may go through NSS (and the
+// network) so every id is looked up once per listing
+#define ID_CACHE_SIZE 256
+
+typedef struct {
+  unsigned id;
+  // NULL for a free slot
+  char *name;
+} id_cache_entry;
+
+typedef struct {
+  id_cache_entry entries[ID_CACHE_SIZE];
+} id_cache;
+
+// entries are read this many bytes at a time
+#define LS_READ_BUFFER_SIZE (256 * 1024)
+
+// called for every entry of a directory, in directory order, `type` is a DT_*
+// constant (DT_UNKNOWN if the file system does not tell), returns 0 to fail the
+// listing with errno set
+typedef int (*dir_entry_callback)(void *data, const char *name, size_t len,
+                                  unsigned char type);
+
+// The names of a directory packed one after the other (with their NUL), so
+// memory grows with the length of the names and not with sizeof(struct
+// dirent). `entries` is filled once every name was read, as the buffer may
+// still move before that.
+typedef struct {
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  char **entries;
+  int entries_len;
+} dir_listing;
+
+// the stat calls of entries [begin, end)
+typedef struct {
+  int dir_fd;
+  char **entries;
+  struct stat *stats;
+  // errno of the failed calls, 0 for the others
+  int *errors;
+  int begin;
+  int end;
+} stat_range;
+
+static char *lookup_name(unsigned id, int group) {
+  const char *name = NULL;
+  if (group) {
+    struct group *g = getgrgid((gid_t)id);
+    name = g ? g->gr_name : NULL;
+  } else {
+    struct passwd *p = getpwuid((uid_t)id);
+    name = p ? p->pw_name : NULL;
+  }
+
+  // ids without a name are shown as numbers
+  return name ? printf_to_string("%s", name) : printf_to_string("%u", id);
+}
+
+// the returned name belongs to the cache, NULL if out of memory
+static const char *id_cache_get(id_cache *cache, unsigned id, int group) {
+  unsigned index = (id * 2654435761u) % ID_CACHE_SIZE;
+  id_cache_entry *entry = NULL;
+  for (int i = 0; i < ID_CACHE_SIZE; ++i) {
+    entry = &cache->entries[(index + i) % ID_CACHE_SIZE];
+    if (!entry->name || entry->id == id) {
+      break;
+    }
+  }
+
+  if (entry->name && entry->id == id) {
+    return entry->name;
+  }
+
+  // once the cache is full, the last slot probed is replaced
+  free(entry->name);
+  entry->id = id;
+  entry->name = lookup_name(id, group);
+  return entry->name;
+}
+
+static void id_cache_destroy(id_cache *cache) {
+  for (int i = 0; i < ID_CACHE_SIZE; ++i) {
+    free(cache->entries[i].name);
+  }
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// getdents64 fills a large buffer per system call, readdir reads 32K at most
+static int read_dir_entries(int dir_fd, dir_entry_callback callback,
+                            void *data) {
+  char *buffer = malloc(LS_READ_BUFFER_SIZE);
+  if (!buffer) {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  while (1) {
+    long n = syscall(SYS_getdents64, dir_fd, buffer, LS_READ_BUFFER_SIZE);
+    if (n <= 0) {
+      free(buffer);
+      return n == 0;
+    }
+
+    for (long offset = 0; offset < n;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + offset);
+      offset += entry->d_reclen;
+      if (!callback(data, entry->d_name, strlen(entry->d_name),
+                    entry->d_type)) {
+        free(buffer);
+        return 0;
+      }
+    }
+  }
+}
+#else
+static int read_dir_entries(int dir_fd, dir_entry_callback callback,
+                            void *data) {
+  // closedir closes the descriptor it was opened from
+  int fd = dup(dir_fd);
+  DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!dir) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+
+  int success;
+  while (1) {
+    // readdir only sets errno on errors
+    errno = 0;
+    struct dirent *entry = readdir(dir);
+    if (!entry) {
+      success = errno == 0;
+      break;
+    }
+
+    if (!callback(data, entry->d_name, strlen(entry->d_name), entry->d_type)) {
+      success = 0;
+      break;
+    }
+  }
+
+  // keep the errno of the failure
+  int error = errno;
+  closedir(dir);
+  errno = error;
+  return success;
+}
+#endif
+
+static int add_name(void *data, const char *name, size_t len,
+                    unsigned char type) {
+  dir_listing *listing = data;
+  if (listing->names_cap - listing->names_len < len + 1) {
+    size_t cap = listing->names_cap ? listing->names_cap * 2 : 4096;
+    while (cap - listing->names_len < len + 1) {
+      cap *= 2;
+    }
+    char *names = realloc(listing->names, cap);
+    if (!names) {
+      errno = ENOMEM;
+      return 0;
+    }
+    listing->names = names;
+    listing->names_cap = cap;
+  }
+
+  memcpy(listing->names + listing->names_len, name, len + 1);
+  listing->names_len += len + 1;
+  ++listing->entries_len;
+  return 1;
+}
+
+static int read_dir(int dir_fd, dir_listing *listing) {
+  if (!read_dir_entries(dir_fd, add_name, listing)) {
+    return 0;
+  }
+
+  listing->entries =
+      malloc((listing->entries_len + 1) * sizeof *listing->entries);
+  if (!listing->entries) {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  char *name = listing->names;
+  for (int i = 0; i < listing->entries_len; ++i) {
+    listing->entries[i] = name;
+    name += strlen(name) + 1;
+  }
+  return 1;
+}
+
+static int stat_range_run(void *data) {
+  stat_range *range = data;
+  for (int i = range->begin; i < range->end; ++i) {
+    range->errors[i] = fstatat(range->dir_fd, range->entries[i],
+                               &range->stats[i], AT_SYMLINK_NOFOLLOW) == 0
+                           ? 0
+                           : errno;
+  }
+  return 0;
+}
+
+// stats every entry, on up to LS_MAX_THREADS threads for large directories
+static void stat_entries(int dir_fd, char **entries, int entries_len,
+                         struct stat *stats, int *errors) {
+  int threads = entries_len / LS_ENTRIES_PER_THREAD;
+  if (threads > processor_count()) {
+    threads = processor_count();
+  }
+  if (threads > LS_MAX_THREADS) {
+    threads = LS_MAX_THREADS;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  stat_range ranges[LS_MAX_THREADS];
+  thrd_t ids[LS_MAX_THREADS];
+  int started[LS_MAX_THREADS];
+  for (int i = 0; i < threads; ++i) {
+    stat_range *range = &ranges[i];
+    range->dir_fd = dir_fd;
+    range->entries = entries;
+    range->stats = stats;
+    range->errors = errors;
+    range->begin = (int)((long long)entries_len * i / threads);
+    range->end = (int)((long long)entries_len * (i + 1) / threads);
+    // the first range is done on this thread, as are the ranges whose thread
+    // could not be started
+    started[i] =
+        i > 0 && thrd_create(&ids[i], stat_range_run, range) == thrd_success;
+  }
+
+  for (int i = 0; i < threads; ++i) {
+    if (!started[i]) {
+      stat_range_run(&ranges[i]);
+    }
+  }
+  for (int i = 0; i < threads; ++i) {
+    if (started[i]) {
+      thrd_join(ids[i], NULL);
+    }
+  }
+}
+
+static void format_mode(mode_t mode, char *buffer) {
+  buffer[0] = S_ISDIR(mode)    ? 'd'
+              : S_ISLNK(mode)  ? 'l'
+              : S_ISCHR(mode)  ? 'c'
+              : S_ISBLK(mode)  ? 'b'
+              : S_ISFIFO(mode) ? 'p'
+              : S_ISSOCK(mode) ? 's'
+                               : '-';
+  const char rwx[] = "rwxrwxrwx";
+  for (int i = 0; i < 9; ++i) {
+    buffer[i + 1] = mode & (0400 >> i) ? rwx[i] : '-';
+  }
+  buffer[10] = '\0';
+}
+
+static void print_details(const char *name, const struct stat *s,
+                          id_cache *users, id_cache *groups) {
+  char mode[11];
+  format_mode(s->st_mode, mode);
+  const char *user = id_cache_get(users, (unsigned)s->st_uid, 0);
+  const char *group = id_cache_get(groups, (unsigned)s->st_gid, 1);
+
+  char date[32] = "";
+  struct tm time_info;
+  if (localtime_r(&s->st_mtime, &time_info)) {
+    strftime(date, sizeof date, "%m-%d-%Y", &time_info);
+  }
+
+  output_printf("%s %ld %s %s %5lld %s %s\n", mode, (long)s->st_nlink,
+                user ? user : "?", group ? group : "?", (long long)s->st_size,
+                date, name);
+}
+
+// entries printed as they are read, for LS_UNSORTED
+typedef struct {
+  int dir_fd;
+  int details;
+  id_cache *users;
+  id_cache *groups;
+} ls_stream;
+
+static int print_entry(void *data, const char *name, size_t len,
+                       unsigned char type) {
+  ls_stream *stream = data;
+  if (!stream->details) {
+    output_puts(name);
+    return 1;
+  }
+
+  struct stat s;
+  if (fstatat(stream->dir_fd, name, &s, AT_SYMLINK_NOFOLLOW) != 0) {
+    output_printf("cannot access '%s': %s\n", name, strerror(errno));
+    return 1;
+  }
+  print_details(name, &s, stream->users, stream->groups);
+  return 1;
+}
+
+static int print_sorted(int dir_fd, const char *dir, int details,
+                        id_cache *users, id_cache *groups) {
+  int status_code = 1;
+  dir_listing listing = {NULL, 0, 0, NULL, 0};
+  if (!read_dir(dir_fd, &listing)) {
+    output_printf("unable to read directory '%s': %s\n", dir, strerror(errno));
+    goto done;
+  }
+
+  qsort(listing.entries, listing.entries_len, sizeof *listing.entries,
+        compare_names);
+
+  output_printf("total %d\n", listing.entries_len);
+  if (!details) {
+    for (int i = 0; i < listing.entries_len; ++i) {
+      output_puts(listing.entries[i]);
+    }
+    status_code = 0;
+    goto done;
+  }
+
+  // entries are stat-ed relative to the directory, without building paths
+  struct stat *stats = malloc((listing.entries_len + 1) * sizeof *stats);
+  int *errors = malloc((listing.entries_len + 1) * sizeof *errors);
+  if (!stats || !errors) {
+    output_puts("unable to allocate memory for directory entries");
+    free(stats);
+    free(errors);
+    goto done;
+  }
+  stat_entries(dir_fd, listing.entries, listing.entries_len, stats, errors);
+
+  for (int i = 0; i < listing.entries_len; ++i) {
+    if (errors[i] != 0) {
+      output_printf("cannot access '%s': %s\n", listing.entries[i],
+                    strerror(errors[i]));
+      continue;
+    }
+    print_details(listing.entries[i], &stats[i], users, groups);
+  }
+  status_code = 0;
+  free(stats);
+  free(errors);
+
+done:
+  free(listing.names);
+  free(listing.entries);
+  return status_code;
+}
+
+// `ls -R`
+//
+// Workers read directories in parallel: each one pops from the bottom of its
+// own deque, where it pushes the subdirectories it finds, and steals from the
+// top of the others when it runs out. The calling thread prints the tree
+// depth-first in sorted order, waiting for each directory to be read, and
+// frees it once printed. At most LS_MAX_READ_AHEAD directories are read ahead
+// of it, idle workers wait on a condition variable. The printer reads a
+// directory itself when no worker took it yet, so it never waits on a worker
+// held back by the limit.
+typedef struct ls_node {
+  char *path;
+  // errno of opening or reading the directory, 0 on success
+  int error;
+  dir_listing listing;
+  struct stat *stats;
+  int *errors;
+  // subdirectories, in sorted order
+  struct ls_node **children;
+  int children_len;
+  // some subdirectories were left out for lack of memory
+  int truncated;
+  // the fields below are under the walk lock (`queued` is set before the node
+  // is pushed, while no other thread sees it)
+  // in a deque, which may outlive the reading and the printing of the node,
+  // the worker which takes it out then frees it if it was printed
+  int queued;
+  int printed;
+  // by the thread which reads the directory
+  int claimed;
+  // once the reading thread does not touch the node anymore
+  int done;
+} ls_node;
+
+typedef struct {
+  mtx_t lock;
+  ls_node **nodes;
+  // nodes[head..len) are queued, stolen from head, popped from len
+  int head;
+  int len;
+  int cap;
+} ls_deque;
+
+typedef struct ls_walk ls_walk;
+
+typedef struct {
+  ls_walk *walk;
+  int index;
+  int started;
+  thrd_t thread;
+} ls_worker;
+
+struct ls_walk {
+  ls_deque deques[LS_MAX_WORKERS];
+  ls_worker workers[LS_MAX_WORKERS];
+  int workers_len;
+  mtx_t lock;
+  // nodes in the deques no worker is about to take out yet, and those plus
+  // the nodes workers took out and did not finish with
+  int queued;
+  int pending;
+  // directories claimed and not printed yet
+  int read_ahead;
+  // signaled when a node is done, for the printer
+  cnd_t done_cond;
+  // signaled when there is work, room to read ahead, or nothing left to do
+  cnd_t work_cond;
+};
+
+typedef struct {
+  long long directories;
+  long long entries;
+  long long bytes;
+} ls_totals;
+
+static int deque_push(ls_deque *deque, ls_node *node) {
+  mtx_lock(&deque->lock);
+  int pushed = vecpush(&deque->nodes, &deque->len, &deque->cap,
+                       sizeof *deque->nodes, &node, 1);
+  mtx_unlock(&deque->lock);
+  return pushed;
+}
+
+static ls_node *deque_take(ls_deque *deque, int steal) {
+  ls_node *node = NULL;
+  mtx_lock(&deque->lock);
+  if (deque->head < deque->len) {
+    node = steal ? deque->nodes[deque->head++] : deque->nodes[--deque->len];
+  }
+  if (deque->head == deque->len) {
+    deque->head = deque->len = 0;
+  }
+  mtx_unlock(&deque->lock);
+  return node;
+}
+
+static int is_dot_or_dot_dot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static ls_node *new_node(const char *parent, const char *name) {
+  ls_node *node = calloc(1, sizeof *node);
+  if (!node) {
+    return NULL;
+  }
+
+  size_t len = strlen(parent);
+  node->path = name == NULL ? printf_to_string("%s", parent)
+               : len > 0 && parent[len - 1] == '/'
+                   ? printf_to_string("%s%s", parent, name)
+                   : printf_to_string("%s/%s", parent, name);
+  if (!node->path) {
+    free(node);
+    return NULL;
+  }
+  return node;
+}
+
+static void free_node(ls_node *node) {
+  free(node->path);
+  free(node->listing.names);
+  free(node->listing.entries);
+  free(node->stats);
+  free(node->errors);
+  free(node->children);
+  free(node);
+}
+
+// with the walk lock held, returns 0 if another thread reads the directory
+static int claim_locked(ls_walk *walk, ls_node *node) {
+  if (node->claimed) {
+    return 0;
+  }
+  node->claimed = 1;
+  ++walk->read_ahead;
+  return 1;
+}
+
+static int claim(ls_walk *walk, ls_node *node) {
+  mtx_lock(&walk->lock);
+  int claimed = claim_locked(walk, node);
+  mtx_unlock(&walk->lock);
+  return claimed;
+}
+
+// for a node taken out of a deque, frees it if it was printed already
+static int claim_taken(ls_walk *walk, ls_node *node) {
+  mtx_lock(&walk->lock);
+  node->queued = 0;
+  int claimed = claim_locked(walk, node);
+  int printed = node->printed;
+  mtx_unlock(&walk->lock);
+  if (printed) {
+    free_node(node);
+  }
+  return claimed;
+}
+
+// lists the directory and queues its subdirectories on the worker's deque
+static void walk_directory(ls_walk *walk, int worker, ls_node *node) {
+  int dir_fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    node->error = errno;
+    goto done;
+  }
+
+  dir_listing *listing = &node->listing;
+  int read = read_dir(dir_fd, listing);
+  int n = listing->entries_len;
+  if (read) {
+    node->stats = malloc((n + 1) * sizeof *node->stats);
+    node->errors = malloc((n + 1) * sizeof *node->errors);
+  }
+  if (!read || !node->stats || !node->errors) {
+    node->error = read ? ENOMEM : errno;
+    close(dir_fd);
+    goto done;
+  }
+
+  qsort(listing->entries, n, sizeof *listing->entries, compare_names);
+  stat_range range = {dir_fd, listing->entries, node->stats, node->errors,
+                      0, n};
+  stat_range_run(&range);
+  close(dir_fd);
+
+  int subdirs = 0;
+  for (int i = 0; i < n; ++i) {
+    subdirs += node->errors[i] == 0 && S_ISDIR(node->stats[i].st_mode) &&
+               !is_dot_or_dot_dot(listing->entries[i]);
+  }
+  if (subdirs == 0) {
+    goto done;
+  }
+
+  node->children = malloc(subdirs * sizeof *node->children);
+  if (!node->children) {
+    node->truncated = 1;
+    goto done;
+  }
+
+  // symlinks to directories are not followed (fstatat does not follow them),
+  // so the walk cannot loop
+  for (int i = 0; i < n; ++i) {
+    if (node->errors[i] != 0 || !S_ISDIR(node->stats[i].st_mode) ||
+        is_dot_or_dot_dot(listing->entries[i])) {
+      continue;
+    }
+
+    ls_node *child = new_node(node->path, listing->entries[i]);
+    if (!child) {
+      node->truncated = 1;
+      continue;
+    }
+    node->children[node->children_len++] = child;
+  }
+
+  // pushed in reverse, so the first subdirectory is the first one popped and
+  // the workers stay close to the printing order
+  int pushed = 0;
+  for (int i = node->children_len - 1; i >= 0; --i) {
+    ls_node *child = node->children[i];
+    child->queued = 1;
+    if (deque_push(&walk->deques[worker], child)) {
+      ++pushed;
+      continue;
+    }
+    child->queued = 0;
+    if (claim(walk, child)) {
+      // read it right away instead
+      walk_directory(walk, worker, child);
+    }
+  }
+  if (pushed > 0) {
+    mtx_lock(&walk->lock);
+    walk->queued += pushed;
+    walk->pending += pushed;
+    cnd_broadcast(&walk->work_cond);
+    mtx_unlock(&walk->lock);
+  }
+
+done:
+  mtx_lock(&walk->lock);
+  node->done = 1;
+  cnd_broadcast(&walk->done_cond);
+  mtx_unlock(&walk->lock);
+}
+
+static ls_node *find_work(ls_walk *walk, int worker) {
+  ls_node *node = deque_take(&walk->deques[worker], 0);
+  for (int i = 1; !node && i < walk->workers_len; ++i) {
+    node = deque_take(&walk->deques[(worker + i) % walk->workers_len], 1);
+  }
+  return node;
+}
+
+static int ls_worker_run(void *data) {
+  ls_worker *worker = data;
+  ls_walk *walk = worker->walk;
+  mtx_lock(&walk->lock);
+  while (1) {
+    // another worker is still reading and may queue more directories
+    while (walk->pending > 0 &&
+           (walk->queued == 0 || walk->read_ahead >= LS_MAX_READ_AHEAD)) {
+      cnd_wait(&walk->work_cond, &walk->lock);
+    }
+    if (walk->pending == 0) {
+      break;
+    }
+
+    // every node counted in `queued` is in a deque, so one is found
+    --walk->queued;
+    mtx_unlock(&walk->lock);
+    ls_node *node = find_work(walk, worker->index);
+    if (node && claim_taken(walk, node)) {
+      walk_directory(walk, worker->index, node);
+    }
+    mtx_lock(&walk->lock);
+    // the children were counted before, so this cannot hit zero early
+    if (--walk->pending == 0) {
+      cnd_broadcast(&walk->work_cond);
+    }
+  }
+  mtx_unlock(&walk->lock);
+  return 0;
+}
+
+static void print_node(ls_walk *walk, ls_node *node, int details,
+                       id_cache *users, id_cache *groups, ls_totals *totals,
+                       int *status_code) {
+  if (claim(walk, node)) {
+    walk_directory(walk, 0, node);
+  }
+  mtx_lock(&walk->lock);
+  while (!node->done) {
+    cnd_wait(&walk->done_cond, &walk->lock);
+  }
+  mtx_unlock(&walk->lock);
+
+  if (totals->directories++ > 0) {
+    output_puts("");
+  }
+  output_printf("%s:\n", node->path);
+  if (node->error != 0) {
+    output_printf("cannot open directory '%s': %s\n", node->path,
+                  strerror(node->error));
+    *status_code = 1;
+  } else {
+    const dir_listing *listing = &node->listing;
+    output_printf("total %d\n", listing->entries_len);
+    for (int i = 0; i < listing->entries_len; ++i) {
+      const char *name = listing->entries[i];
+      if (node->errors[i] != 0) {
+        output_printf("cannot access '%s': %s\n", name,
+                      strerror(node->errors[i]));
+        continue;
+      }
+
+      const struct stat *s = &node->stats[i];
+      if (!is_dot_or_dot_dot(name)) {
+        ++totals->entries;
+        if (!S_ISDIR(s->st_mode)) {
+          totals->bytes += s->st_size;
+        }
+      }
+      if (details) {
+        print_details(name, s, users, groups);
+      } else {
+        output_puts(name);
+      }
+    }
+  }
+  if (node->truncated) {
+    output_puts("unable to allocate memory for subdirectories");
+    *status_code = 1;
+  }
+
+  // the listing is not needed anymore while the subdirectories are printed
+  free(node->listing.names);
+  free(node->listing.entries);
+  free(node->stats);
+  free(node->errors);
+  node->listing.names = NULL;
+  node->listing.entries = NULL;
+  node->stats = NULL;
+  node->errors = NULL;
+  mtx_lock(&walk->lock);
+  --walk->read_ahead;
+  cnd_broadcast(&walk->work_cond);
+  mtx_unlock(&walk->lock);
+
+  for (int i = 0; i < node->children_len; ++i) {
+    print_node(walk, node->children[i], details, users, groups, totals,
+               status_code);
+  }
+  mtx_lock(&walk->lock);
+  int queued = node->queued;
+  node->printed = 1;
+  mtx_unlock(&walk->lock);
+  if (!queued) {
+    free_node(node);
+  }
+}
+
+static int print_recursive(const char *dir, int details, id_cache *users,
+                           id_cache *groups) {
+  ls_walk *walk = calloc(1, sizeof *walk);
+  ls_node *root = new_node(dir, NULL);
+  if (!walk || !root) {
+    output_puts("unable to allocate memory for directory walk");
+    free(walk);
+    if (root) {
+      free_node(root);
+    }
+    return 1;
+  }
+
+  int workers = processor_count() * 2;
+  if (workers > LS_MAX_WORKERS) {
+    workers = LS_MAX_WORKERS;
+  }
+  walk->workers_len = workers;
+  for (int i = 0; i < workers; ++i) {
+    mtx_init(&walk->deques[i].lock, mtx_plain);
+  }
+  mtx_init(&walk->lock, mtx_plain);
+  cnd_init(&walk->done_cond);
+  cnd_init(&walk->work_cond);
+  // the printer reads the root itself, if no worker took it yet
+  root->queued = deque_push(&walk->deques[0], root);
+  walk->queued = walk->pending = root->queued;
+
+  // the deques of workers which could not be started are stolen from, and
+  // without any worker the printer reads every directory itself
+  for (int i = 0; i < workers; ++i) {
+    ls_worker *worker = &walk->workers[i];
+    worker->walk = walk;
+    worker->index = i;
+    worker->started = thrd_create(&worker->thread, ls_worker_run, worker) ==
+                      thrd_success;
+  }
+
+  ls_totals totals = {0, 0, 0};
+  int status_code = 0;
+  print_node(walk, root, details, users, groups, &totals, &status_code);
+  output_printf("\n%lld directories, %lld entries, %lld bytes in files\n",
+                totals.directories, totals.entries, totals.bytes);
+
+  for (int i = 0; i < workers; ++i) {
+    if (walk->workers[i].started) {
+      thrd_join(walk->workers[i].thread, NULL);
+    }
+  }
+  for (int i = 0; i < workers; ++i) {
+    // nodes printed before any worker took them out
+    ls_deque *deque = &walk->deques[i];
+    for (int j = deque->head; j < deque->len; ++j) {
+      free_node(deque->nodes[j]);
+    }
+    mtx_destroy(&deque->lock);
+    free(walk->deques[i].nodes);
+  }
+  mtx_destroy(&walk->lock);
+  cnd_destroy(&walk->done_cond);
+  cnd_destroy(&walk->work_cond);
+  free(walk);
+  return status_code;
+}
+
+int exec_ls(const char *dir, int flags) {
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    output_printf("cannot open directory '%s'\n", dir);
+    return 1;
+  }
+
+  int status_code = 1;
+  id_cache *users = calloc(1, sizeof *users);
+  id_cache *groups = calloc(1, sizeof *groups);
+  if (!users || !groups) {
+    output_puts("unable to allocate memory for user names");
+    goto done;
+  }
+
+  int details = (flags & LS_DETAILS) != 0;
+  if (flags & LS_RECURSIVE) {
+    status_code = print_recursive(dir, details, users, groups);
+  } else if (flags & LS_UNSORTED) {
+    // nothing is kept, so memory does not grow with the directory
+    ls_stream stream = {dir_fd, details, users, groups};
+    status_code = 0;
+    if (!read_dir_entries(dir_fd, print_entry, &stream)) {
+      output_printf("unable to read directory '%s': %s\n", dir,
+                    strerror(errno));
+      status_code = 1;
+    }
+  } else {
+    status_code = print_sorted(dir_fd, dir, details, users, groups);
+  }
+
+done:
+  if (users) {
+    id_cache_destroy(users);
+  }
+  if (groups) {
+    id_cache_destroy(groups);
+  }
+  free(users);
+  free(groups);
+  close(dir_fd);
+  return status_code;
+}
@@ -0,0 +1,98 @@
+#include "mapped_file.h"
+#include "redirect.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void unmap(mapped_file *file) {
+  if (file->data) {
+    munmap(file->data, file->size);
+    file->data = NULL;
+  }
+  file->size = 0;
+}
+
+static int map(mapped_file *file, size_t size) {
+  unmap(file);
+  if (size == 0) {
+    return 1;
+  }
+
+  int prot = file->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *data = mmap(NULL, size, prot, MAP_SHARED, file->fd, 0);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+
+  file->data = data;
+  file->size = size;
+  return 1;
+}
+
+int mapped_file_open(mapped_file *file, const char *path, int writable) {
+  file->writable = writable;
+  file->data = NULL;
+  file->size = 0;
+  // the file is only written by appending, or through the mapping
+  int flags = writable ? O_RDWR : O_RDWR | O_APPEND;
+  file->fd =
+      redirect_move_fd_high(open(path, flags | O_CREAT | O_CLOEXEC, 0600));
+  if (file->fd < 0) {
+    return 0;
+  }
+
+  if (!mapped_file_refresh(file)) {
+    close(file->fd);
+    return 0;
+  }
+  return 1;
+}
+
+void mapped_file_close(mapped_file *file) {
+  unmap(file);
+  close(file->fd);
+}
+
+int mapped_file_refresh(mapped_file *file) {
+  struct stat st;
+  if (fstat(file->fd, &st) != 0) {
+    return 0;
+  }
+  return (size_t)st.st_size == file->size || map(file, (size_t)st.st_size);
+}
+
+int mapped_file_resize(mapped_file *file, size_t size) {
+  unmap(file);
+  return ftruncate(file->fd, (off_t)size) == 0 && map(file, size);
+}
+
+int mapped_file_append(mapped_file *file, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t written = write(file->fd, p, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    p += written;
+    len -= (size_t)written;
+  }
+  return mapped_file_refresh(file);
+}
+
+int mapped_file_lock(mapped_file *file) {
+  while (flock(file->fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void mapped_file_unlock(mapped_file *file) { flock(file->fd, LOCK_UN); }
@@ -1,39 +1,410 @@
+#ifdef __linux__
+// pipe2, F_SETPIPE_SZ, clone, posix_spawn_file_actions_addchdir_np
+#define _GNU_SOURCE
+#endif
+
 #include "process.h"
 #include "parse_cmd.h"
+#include "redirect.h"
 #include "tinyshell.h"
 #include "utils.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-int process_create(process *p, char *binary_path, const tinyshell *shell,
-                   const char *command, command_parse_result *parse_result,
-                   char **error) {
-  posix_spawn_file_actions_t fa;
-  posix_spawn_file_actions_init(&fa);
-  posix_spawn_file_actions_adddup2(&fa, fileno(stdin), 0);
-  posix_spawn_file_actions_adddup2(&fa, fileno(stdout), 1);
-  posix_spawn_file_actions_adddup2(&fa, fileno(stderr), 2);
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_ADDCHDIR
+#endif
+
+// both ends are close-on-exec, the ends used by a stage are dup2-ed to its
+// standard streams
+static int create_pipe(int fds[2], int pipe_size) {
+#ifdef __linux__
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return 0;
+  }
+#else
+  if (pipe(fds) != 0) {
+    return 0;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+#ifdef F_SETPIPE_SZ
+  if (pipe_size > 0) {
+    // best effort, the pipe still works with the default size
+    fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+  }
+#endif
+  return 1;
+}
+
+enum {
+  SPAWN_POSIX_SPAWN,
+  SPAWN_VFORK,
+#ifdef __linux__
+  SPAWN_CLONE,
+#endif
+};
 
-  int error_code =
-      posix_spawn(p, binary_path, &fa, NULL, parse_result->argv, NULL);
+const char *const spawn_backends[] = {
+    "posix_spawn",
+    "vfork",
+#ifdef __linux__
+    "clone",
+#endif
+};
+const int spawn_backends_len = sizeof spawn_backends / sizeof spawn_backends[0];
+
+// the file descriptor setup of a child, shared by every backend
+typedef struct {
+  enum { SPAWN_ACTION_DUP2, SPAWN_ACTION_OPEN, SPAWN_ACTION_CLOSE } type;
+  int fd;
+  // SPAWN_ACTION_DUP2
+  int src_fd;
+  // SPAWN_ACTION_OPEN
+  const char *path;
+  int flags;
+} spawn_action;
+
+// everything is prepared before the child starts: a vfork-ed child shares the
+// memory of the shell, so it must not allocate
+typedef struct {
+  const char *path;
+  char *const *argv;
+  char *const *envp;
+  // NULL to stay in the directory of the shell
+  const char *cwd;
+  const spawn_action *actions;
+  int actions_len;
+  // signal mask of the shell, restored in the child before exec
+  sigset_t mask;
+  // set by the child when it could not exec
+  volatile int error;
+} spawn_request;
+
+static int spawn_posix_spawn(pid_t *pid, spawn_request *req) {
+  posix_spawn_file_actions_t fa;
+  int error_code = posix_spawn_file_actions_init(&fa);
   if (error_code != 0) {
-    *error = printf_to_string("%s", strerror(error_code));
-  } else {
-    free(binary_path);
-    command_parse_result_free(parse_result);
+    return error_code;
   }
 
+#ifdef HAVE_SPAWN_ADDCHDIR
+  // first, so relative redirections are opened in the new directory
+  if (req->cwd) {
+    error_code = posix_spawn_file_actions_addchdir_np(&fa, req->cwd);
+  }
+#endif
+  for (int i = 0; i < req->actions_len && error_code == 0; ++i) {
+    const spawn_action *a = &req->actions[i];
+    error_code =
+        a->type == SPAWN_ACTION_DUP2
+            ? posix_spawn_file_actions_adddup2(&fa, a->src_fd, a->fd)
+        : a->type == SPAWN_ACTION_CLOSE
+            ? posix_spawn_file_actions_addclose(&fa, a->fd)
+            : posix_spawn_file_actions_addopen(&fa, a->fd, a->path, a->flags,
+                                               0666);
+  }
+
+  if (error_code == 0) {
+    error_code = posix_spawn(pid, req->path, &fa, NULL, req->argv, req->envp);
+  }
   posix_spawn_file_actions_destroy(&fa);
-  return error_code == 0;
+  return error_code;
+}
+
+// runs in the child of vfork/clone until exec, only async-signal-safe calls
+static int spawn_child(void *data) {
+  spawn_request *req = data;
+  // the handlers of the shell must not run in the child
+  for (int sig = 1; sig < NSIG; ++sig) {
+    struct sigaction sa;
+    if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_DFL &&
+        sa.sa_handler != SIG_IGN) {
+      sa.sa_handler = SIG_DFL;
+      sa.sa_flags = 0;
+      sigaction(sig, &sa, NULL);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &req->mask, NULL);
+
+  if (req->cwd && chdir(req->cwd) != 0) {
+    goto fail;
+  }
+  for (int i = 0; i < req->actions_len; ++i) {
+    const spawn_action *a = &req->actions[i];
+    if (a->type == SPAWN_ACTION_DUP2) {
+      // dup2 onto itself keeps FD_CLOEXEC, posix_spawn clears it
+      int ok = a->src_fd == a->fd ? fcntl(a->fd, F_SETFD, 0) == 0
+                                  : dup2(a->src_fd, a->fd) >= 0;
+      if (!ok) {
+        goto fail;
+      }
+    } else if (a->type == SPAWN_ACTION_CLOSE) {
+      close(a->fd);
+    } else {
+      int fd = open(a->path, a->flags, 0666);
+      if (fd < 0) {
+        goto fail;
+      }
+      if (fd != a->fd) {
+        int ok = dup2(fd, a->fd) >= 0;
+        close(fd);
+        if (!ok) {
+          goto fail;
+        }
+      }
+    }
+  }
+
+  execve(req->path, req->argv, req->envp);
+fail:
+  req->error = errno;
+  _exit(127);
+}
+
+static int spawn_vfork(pid_t *pid, spawn_request *req) {
+  *pid = vfork();
+  if (*pid == 0) {
+    spawn_child(req);
+  }
+  return *pid < 0 ? errno : 0;
+}
+
+#ifdef __linux__
+#define SPAWN_CLONE_STACK_SIZE (64 * 1024)
+
+// like vfork, but the child runs on a small stack of its own instead of the
+// stack of the shell
+static int spawn_clone(pid_t *pid, spawn_request *req) {
+  char *stack = malloc(SPAWN_CLONE_STACK_SIZE);
+  if (!stack) {
+    return ENOMEM;
+  }
+
+  // the stack grows down on the architectures we support
+  *pid = clone(spawn_child, stack + SPAWN_CLONE_STACK_SIZE,
+               CLONE_VM | CLONE_VFORK | SIGCHLD, req);
+  int error_code = *pid < 0 ? errno : 0;
+  free(stack);
+  return error_code;
+}
+#endif
+
+static int spawn(pid_t *pid, int backend, spawn_request *req) {
+#ifndef HAVE_SPAWN_ADDCHDIR
+  // posix_spawn cannot change the directory of the child here
+  if (req->cwd) {
+    backend = SPAWN_VFORK;
+  }
+#endif
+  if (backend == SPAWN_POSIX_SPAWN) {
+    return spawn_posix_spawn(pid, req);
+  }
+
+  // the child borrows the memory of the shell until it execs, no handler may
+  // run in it before the signal dispositions are reset
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &req->mask);
+  req->error = 0;
+  int error_code;
+#ifdef __linux__
+  if (backend == SPAWN_CLONE) {
+    error_code = spawn_clone(pid, req);
+  } else
+#endif
+  {
+    error_code = spawn_vfork(pid, req);
+  }
+  pthread_sigmask(SIG_SETMASK, &req->mask, NULL);
+
+  if (error_code == 0 && req->error != 0) {
+    // the child exited without exec-ing
+    waitpid(*pid, NULL, 0);
+    error_code = req->error;
+  }
+  return error_code;
+}
+
+static int redirects_fd(const command_stage *stage, int fd) {
+  for (int i = 0; i < stage->redirections_len; ++i) {
+    if (stage->redirections[i].fd == fd) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// stdin/stdout come from the pipes of the pipeline, then the redirections of
+// the stage are applied, so `a 2>&1 | b` sends the errors of a to b
+static spawn_action *stage_actions(const command_stage *stage,
+                                   const spawn_context *ctx, int in_fd,
+                                   int out_fd, int *len) {
+  spawn_action *actions = malloc(
+      (3 + REDIRECT_MAX_FD + stage->redirections_len) * sizeof *actions);
+  if (!actions) {
+    return NULL;
+  }
+
+  int std_fds[] = {in_fd, out_fd, ctx->std_fds[2]};
+  int n = 0;
+  for (int i = 0; i < 3; ++i) {
+    actions[n++] = (spawn_action){SPAWN_ACTION_DUP2, i, std_fds[i], NULL, 0};
+  }
+
+  // the redirections of a builtin or script the shell runs meanwhile, only the
+  // open ones are closed as posix_spawn may fail on the others
+  for (int fd = 3; ctx->close_redirectable && fd <= REDIRECT_MAX_FD; ++fd) {
+    if (!redirects_fd(stage, fd) && fcntl(fd, F_GETFD) != -1) {
+      actions[n++] = (spawn_action){SPAWN_ACTION_CLOSE, fd, -1, NULL, 0};
+    }
+  }
+
+  for (int i = 0; i < stage->redirections_len; ++i) {
+    const redirection *r = &stage->redirections[i];
+    actions[n++] =
+        r->type == REDIRECT_DUP
+            ? (spawn_action){SPAWN_ACTION_DUP2, r->fd, r->target_fd, NULL, 0}
+            : (spawn_action){SPAWN_ACTION_OPEN, r->fd, -1, r->path,
+                             redirect_open_flags(r->type)};
+  }
+
+  *len = n;
+  return actions;
+}
+
+void spawn_context_current(spawn_context *ctx, const tinyshell *shell) {
+  ctx->std_fds[0] = fileno(stdin);
+  ctx->std_fds[1] = fileno(stdout);
+  ctx->std_fds[2] = fileno(stderr);
+  ctx->cwd = NULL;
+  ctx->close_redirectable = 0;
+  ctx->backend = shell->spawn_backend;
+  ctx->pipe_size = shell->pipe_size;
+}
+
+int spawn_context_save(spawn_context *ctx, const tinyshell *shell,
+                       arena *arena) {
+  spawn_context_current(ctx, shell);
+  char *cwd = get_current_directory();
+  ctx->cwd = cwd ? arena_printf(arena, "%s", cwd) : NULL;
+  free(cwd);
+  if (!ctx->cwd) {
+    return 0;
+  }
+
+  // above the redirectable range, so a later redirection of the shell does
+  // not replace them
+  int std_fds[3];
+  for (int i = 0; i < 3; ++i) {
+    std_fds[i] = fcntl(ctx->std_fds[i], F_DUPFD_CLOEXEC, REDIRECT_MAX_FD + 1);
+    if (std_fds[i] < 0) {
+      while (i-- > 0) {
+        close(std_fds[i]);
+      }
+      return 0;
+    }
+  }
+  memcpy(ctx->std_fds, std_fds, sizeof std_fds);
+  ctx->close_redirectable = 1;
+  return 1;
+}
+
+void spawn_context_release(spawn_context *ctx) {
+  for (int i = 0; i < 3; ++i) {
+    close(ctx->std_fds[i]);
+  }
+}
+
+int process_create(process *p, const char *const *binary_paths,
+                   const spawn_context *ctx, const env_block *env,
+                   const char *command, command_parse_result *parse_result,
+                   char **error) {
+  int stages_len = parse_result->stages_len;
+  int backend = ctx->backend;
+  if (backend < 0 || backend >= spawn_backends_len) {
+    backend = SPAWN_POSIX_SPAWN;
+  }
+
+  // read end of the pipe feeding the current stage
+  int prev_read = -1;
+  int spawned = 0;
+  for (; spawned < stages_len; ++spawned) {
+    int fds[2] = {-1, -1};
+    if (spawned + 1 < stages_len && !create_pipe(fds, ctx->pipe_size)) {
+      *error = printf_to_string("unable to create pipe: %s", strerror(errno));
+      break;
+    }
+
+    const command_stage *stage = &parse_result->stages[spawned];
+    spawn_request req;
+    req.path = binary_paths[spawned];
+    req.argv = stage->argv;
+    req.envp = env->envp;
+    req.cwd = ctx->cwd;
+    spawn_action *actions = stage_actions(
+        stage, ctx, prev_read >= 0 ? prev_read : ctx->std_fds[0],
+        fds[1] >= 0 ? fds[1] : ctx->std_fds[1], &req.actions_len);
+    req.actions = actions;
+
+    int error_code =
+        actions ? spawn(&p[spawned], backend, &req) : ENOMEM;
+    free(actions);
+
+    if (prev_read >= 0) {
+      close(prev_read);
+    }
+    if (fds[1] >= 0) {
+      close(fds[1]);
+    }
+    prev_read = fds[0];
+
+    if (error_code != 0) {
+      // failing to open a redirection is reported the same way
+      *error = printf_to_string(stage->redirections_len > 0
+                                    ? "unable to start %s or open its "
+                                      "redirections: %s"
+                                    : "unable to start %s: %s",
+                                stage->argv[0], strerror(error_code));
+      break;
+    }
+  }
+
+  if (prev_read >= 0) {
+    close(prev_read);
+  }
+
+  if (spawned == stages_len) {
+    return 1;
+  }
+
+  // do not leave half of a pipeline behind
+  for (int i = 0; i < spawned; ++i) {
+    process_kill(&p[i]);
+    process_wait_for(&p[i], NULL, NULL);
+  }
+  return 0;
 }
 
 static int is_regular_file(const char *path) {
@@ -45,59 +416,123 @@ static int check_executable(const char *path) {
   return is_regular_file(path) && access(path, X_OK) == 0;
 }
 
-static char *find_executable_no_slash(const char *arg0,
-                                      const tinyshell *shell) {
+static const char *find_executable_no_slash(const char *arg0,
+                                            tinyshell *shell, arena *arena) {
+  exec_cache *cache = &shell->exec_cache;
+  const char *path_env = tinyshell_get_path_env(shell);
+  exec_cache_entry *entry = exec_cache_lookup(cache, path_env, arg0);
+  if (entry) {
+    return entry->path ? arena_printf(arena, "%s", entry->path) : NULL;
+  }
+
   // search in path directories
-  char *path = printf_to_string("%s", tinyshell_get_path_env(shell));
-  if (path == NULL) {
+  int dirs_len;
+  const exec_cache_dir *dirs = exec_cache_dirs(cache, path_env, &dirs_len);
+  if (dirs == NULL) {
     return NULL;
   }
 
-  char *binary_path = NULL, *saveptr;
-  for (char *token = reentrant_strtok(path, ":", &saveptr); token;
-       token = reentrant_strtok(NULL, ":", &saveptr)) {
-    binary_path = printf_to_string("%s/%s", token, arg0);
+  for (int i = 0; i < dirs_len; ++i) {
+    stats_count(&shell->stats, STATS_PATH_PROBES, 1);
+    arena_mark mark = arena_save(arena);
+    char *binary_path = arena_printf(arena, "%s/%s", dirs[i].path, arg0);
     if (binary_path != NULL && check_executable(binary_path)) {
-      break;
+      exec_cache_insert(cache, arg0, binary_path, i);
+      return binary_path;
     }
 
-    free(binary_path);
-    binary_path = NULL;
+    arena_rewind(arena, mark);
   }
 
-  free(path);
-  return binary_path;
+  exec_cache_insert(cache, arg0, NULL, dirs_len);
+  return NULL;
 }
 
-static char *find_executable_slash(const char *arg0, const tinyshell *shell) {
-  if (!check_executable(arg0)) {
-    return NULL;
+const char *find_executable(const char *arg0, tinyshell *shell,
+                            arena *arena) {
+  stats_count(&shell->stats, STATS_PATH_LOOKUPS, 1);
+  if (strchr(arg0, '/') == NULL) {
+    return find_executable_no_slash(arg0, shell, arena);
   }
 
-  return printf_to_string("%s", arg0);
+  return check_executable(arg0) ? arg0 : NULL;
 }
 
-char *find_executable(const char *arg0, const tinyshell *shell) {
-  if (strchr(arg0, '/') == NULL) {
-    return find_executable_no_slash(arg0, shell);
-  } else {
-    return find_executable_slash(arg0, shell);
+int list_executables(const char *dir,
+                     int (*callback)(void *userdata, const char *name),
+                     void *userdata) {
+  // called from the completion thread, while the shell may be redirecting
+  // low descriptors
+  int fd = redirect_move_fd_high(
+      open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!d) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  char *path = NULL;
+  int path_len = 0, path_cap = 0;
+  int ok = 1;
+  size_t dir_len = strlen(dir);
+  struct dirent *e;
+  while (ok && (e = readdir(d))) {
+    if (e->d_type == DT_DIR || e->d_name[0] == '.') {
+      continue;
+    }
+
+    // dir/name, null-terminated
+    path_len = 0;
+    size_t name_len = strlen(e->d_name);
+    ok = vecpush(&path, &path_len, &path_cap, 1, dir, (int)dir_len) &&
+         vecpush(&path, &path_len, &path_cap, 1, "/", 1) &&
+         vecpush(&path, &path_len, &path_cap, 1, e->d_name,
+                 (int)name_len + 1);
+    if (ok && check_executable(path)) {
+      ok = callback(userdata, e->d_name);
+    }
   }
+
+  free(path);
+  closedir(d);
+  return ok;
 }
 
 void process_free(process *p) {}
 
+void process_usage_from_rusage(const struct rusage *ru, process_usage *usage) {
+  usage->user_us = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+  usage->sys_us = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+#ifdef __APPLE__
+  // bytes there
+  usage->max_rss_kb = ru->ru_maxrss / 1024;
+#else
+  usage->max_rss_kb = ru->ru_maxrss;
+#endif
+  usage->voluntary_switches = ru->ru_nvcsw;
+  usage->involuntary_switches = ru->ru_nivcsw;
+}
+
 // blocking
-int process_wait_for(process *p, int *status_code) {
+int process_wait_for(process *p, int *status_code, process_usage *usage) {
   int wstatus;
-  if (waitpid(*p, &wstatus, 0) == -1) {
-    perror("waitpid");
+  struct rusage ru;
+  pid_t ret;
+  while ((ret = wait4(*p, &wstatus, 0, &ru)) == -1 && errno == EINTR)
+    ;
+  if (ret == -1) {
+    perror("wait4");
     return 0;
   }
 
   if (status_code) {
     *status_code = WEXITSTATUS(wstatus);
   }
+  if (usage) {
+    process_usage_from_rusage(&ru, usage);
+  }
   return 1;
 }
 
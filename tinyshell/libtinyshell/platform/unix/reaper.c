@@ -0,0 +1,339 @@
+#include "output.h"
+#include "process.h"
+#include "redirect.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+// same number on every architecture
+#define SYS_pidfd_open 434
+#endif
+#else
+#include <sys/event.h>
+#endif
+
+// how often the processes which could not be registered with epoll/kqueue are
+// checked with waitpid
+#define POLL_INTERVAL_MS 50
+// a failing epoll_wait/kevent is retried after a delay growing up to this
+#define MAX_BACKOFF_MS 1000
+
+struct reaper_watch {
+  pid_t pid;
+  int pidfd;
+  int job;
+  int stage;
+  // not registered with epoll/kqueue, the process is checked with waitpid
+  int polled;
+  // every watch is in r->watches, so they can all be polled if the poll
+  // descriptor fails
+  reaper_watch *prev;
+  reaper_watch *next;
+};
+
+// mutex lock/unlock failure basically never happen
+static void lock(reaper *r) {
+  if (mtx_lock(&r->lock) != thrd_success) {
+    exit(1);
+  }
+}
+
+static void unlock(reaper *r) {
+  if (mtx_unlock(&r->lock) != thrd_success) {
+    exit(1);
+  }
+}
+
+static void wake(reaper *r) {
+  char c = 0;
+  while (write(r->wake_pipe[1], &c, 1) == -1 && errno == EINTR)
+    ;
+}
+
+// with the lock held
+static void link_watch(reaper *r, reaper_watch *w) {
+  w->prev = NULL;
+  w->next = r->watches;
+  if (r->watches) {
+    r->watches->prev = w;
+  }
+  r->watches = w;
+  ++r->watched;
+  r->polled += w->polled;
+}
+
+// with the lock held
+static void unlink_watch(reaper *r, reaper_watch *w) {
+  if (w->prev) {
+    w->prev->next = w->next;
+  } else {
+    r->watches = w->next;
+  }
+  if (w->next) {
+    w->next->prev = w->prev;
+  }
+  --r->watched;
+  r->polled -= w->polled;
+}
+
+// returns 0 if the process is still running and `options` has WNOHANG
+static int reap(reaper *r, reaper_watch *w, int options) {
+  int wstatus, status_code = -1;
+  struct rusage ru;
+  process_usage usage = {0};
+  pid_t ret;
+  while ((ret = wait4(w->pid, &wstatus, options, &ru)) == -1 && errno == EINTR)
+    ;
+  if (ret == 0) {
+    return 0;
+  }
+  if (ret == -1) {
+    output_notice("reaper: unable to wait for process %d: %s\n", (int)w->pid,
+                  strerror(errno));
+  } else {
+    status_code = WEXITSTATUS(wstatus);
+    process_usage_from_rusage(&ru, &usage);
+  }
+
+  // the process is gone, so is its event, with the lock held so an event
+  // coming during reaper_watch_process waits for the watch to be set up
+  lock(r);
+  if (w->pidfd >= 0) {
+#ifdef __linux__
+    epoll_ctl(r->poll_fd, EPOLL_CTL_DEL, w->pidfd, NULL);
+#endif
+    close(w->pidfd);
+  }
+#ifndef __linux__
+  if (!w->polled) {
+    struct kevent event;
+    EV_SET(&event, w->pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+    kevent(r->poll_fd, &event, 1, NULL, 0, NULL);
+  }
+#endif
+  unlink_watch(r, w);
+  unlock(r);
+
+  r->callback(r->userdata, w->job, w->stage, status_code, &usage);
+  free(w);
+  return 1;
+}
+
+// checks the polled processes, or all of them when the poll descriptor fails
+static void poll_watches(reaper *r, int all) {
+  lock(r);
+  reaper_watch *w = r->watches;
+  while (w) {
+    reaper_watch *next = w->next;
+    if (all || w->polled) {
+      // the watch is only freed by this thread
+      unlock(r);
+      reap(r, w, WNOHANG);
+      lock(r);
+    }
+    w = next;
+  }
+  unlock(r);
+}
+
+static int reaper_thread(void *data) {
+  reaper *r = data;
+  int backoff_ms = 0;
+  while (1) {
+    lock(r);
+    int done = r->stopping && r->watched == 0;
+    int polled = r->polled;
+    unlock(r);
+    if (done) {
+      return 0;
+    }
+
+    int timeout_ms = polled > 0 ? POLL_INTERVAL_MS : -1;
+#ifdef __linux__
+    struct epoll_event events[64];
+    int n = epoll_wait(r->poll_fd, events, 64, timeout_ms);
+#else
+    struct kevent events[64];
+    struct timespec timeout = {timeout_ms / 1000,
+                               (timeout_ms % 1000) * 1000000L};
+    int n = kevent(r->poll_fd, NULL, 0, events, 64,
+                   timeout_ms >= 0 ? &timeout : NULL);
+#endif
+    if (n == -1 && errno != EINTR) {
+      // the processes are still reaped, only later
+      if (backoff_ms == 0) {
+        output_notice("reaper: %s\n", strerror(errno));
+      }
+      backoff_ms = backoff_ms == 0 ? 10 : backoff_ms * 2;
+      if (backoff_ms > MAX_BACKOFF_MS) {
+        backoff_ms = MAX_BACKOFF_MS;
+      }
+      // the call fails at once on an invalid descriptor
+      nanosleep(&(struct timespec){backoff_ms / 1000,
+                                   (backoff_ms % 1000) * 1000000L},
+                NULL);
+      poll_watches(r, 1);
+      continue;
+    }
+    backoff_ms = 0;
+    if (n == -1) {
+      continue;
+    }
+    if (polled > 0) {
+      poll_watches(r, 0);
+    }
+
+    for (int i = 0; i < n; ++i) {
+#ifdef __linux__
+      reaper_watch *w = events[i].data.ptr;
+#else
+      reaper_watch *w = events[i].udata;
+#endif
+      if (w == NULL) {
+        char buffer[64];
+        while (read(r->wake_pipe[0], buffer, sizeof buffer) > 0)
+          ;
+        continue;
+      }
+
+      reap(r, w, 0);
+    }
+  }
+}
+
+int reaper_init(reaper *r, reaper_callback callback, void *userdata) {
+  r->callback = callback;
+  r->userdata = userdata;
+  r->watched = 0;
+  r->polled = 0;
+  r->watches = NULL;
+  r->stopping = 0;
+
+  if (mtx_init(&r->lock, mtx_plain) != thrd_success) {
+    return 0;
+  }
+
+  if (pipe(r->wake_pipe) != 0) {
+    goto fail_pipe;
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    fcntl(r->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    r->wake_pipe[i] = redirect_move_fd_high(r->wake_pipe[i]);
+  }
+  fcntl(r->wake_pipe[0], F_SETFL, O_NONBLOCK);
+
+#ifdef __linux__
+  r->poll_fd = redirect_move_fd_high(epoll_create1(EPOLL_CLOEXEC));
+  if (r->poll_fd == -1) {
+    goto fail_poll;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(r->poll_fd, EPOLL_CTL_ADD, r->wake_pipe[0], &event) != 0) {
+    goto fail_register_wake;
+  }
+#else
+  r->poll_fd = redirect_move_fd_high(kqueue());
+  if (r->poll_fd == -1) {
+    goto fail_poll;
+  }
+  fcntl(r->poll_fd, F_SETFD, FD_CLOEXEC);
+
+  struct kevent event;
+  EV_SET(&event, r->wake_pipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+  if (kevent(r->poll_fd, &event, 1, NULL, 0, NULL) != 0) {
+    goto fail_register_wake;
+  }
+#endif
+
+  if (thrd_create(&r->thread, reaper_thread, r) != thrd_success) {
+    goto fail_thread;
+  }
+
+  return 1;
+
+fail_thread:
+fail_register_wake:
+  close(r->poll_fd);
+fail_poll:
+  close(r->wake_pipe[0]);
+  close(r->wake_pipe[1]);
+fail_pipe:
+  mtx_destroy(&r->lock);
+  return 0;
+}
+
+int reaper_watch_process(reaper *r, const process *p, int job, int stage) {
+  reaper_watch *w = malloc(sizeof *w);
+  if (!w) {
+    return 0;
+  }
+
+  w->pid = *p;
+  w->job = job;
+  w->stage = stage;
+  w->pidfd = -1;
+  w->polled = 0;
+
+  // everything is set up with the lock held: the reaper thread may poll every
+  // watch as soon as it is linked, and handles an early event only once it
+  // gets the lock, so `w` is not touched after unlocking
+  lock(r);
+  // without pidfd_open (before Linux 5.3) or when out of descriptors, the
+  // process is polled instead
+#ifdef __linux__
+  w->pidfd = redirect_move_fd_high((int)syscall(SYS_pidfd_open, w->pid, 0));
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = w;
+  if (w->pidfd != -1 &&
+      epoll_ctl(r->poll_fd, EPOLL_CTL_ADD, w->pidfd, &event) != 0) {
+    close(w->pidfd);
+    w->pidfd = -1;
+  }
+  w->polled = w->pidfd == -1;
+#else
+  struct kevent event;
+  EV_SET(&event, w->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, w);
+  // including ESRCH, the process already exited
+  w->polled = kevent(r->poll_fd, &event, 1, NULL, 0, NULL) != 0;
+#endif
+  int polled = w->polled;
+  link_watch(r, w);
+  unlock(r);
+
+  if (polled) {
+    // starts polling
+    wake(r);
+  }
+  return 1;
+}
+
+void reaper_destroy(reaper *r) {
+  lock(r);
+  r->stopping = 1;
+  unlock(r);
+  wake(r);
+
+  thrd_join(r->thread, NULL);
+  close(r->poll_fd);
+  close(r->wake_pipe[0]);
+  close(r->wake_pipe[1]);
+  mtx_destroy(&r->lock);
+}
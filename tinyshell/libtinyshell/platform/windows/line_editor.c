@@ -0,0 +1,13 @@
+#include "line_editor.h"
+
+// the console already edits the line, see line_editor.h
+
+int line_editor_init(line_editor *editor, int fd) { return 0; }
+
+void line_editor_destroy(line_editor *editor) {}
+
+char *line_editor_read(line_editor *editor, const char *prompt,
+                       line_editor_completer complete, void *userdata) {
+  editor->error = 1;
+  return NULL;
+}
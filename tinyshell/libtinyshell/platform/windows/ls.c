@@ -0,0 +1,77 @@
+#include "ls.h"
+#include "output.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fileapi.h>
+#include <handleapi.h>
+#include <timezoneapi.h>
+#include <winnt.h>
+
+int exec_ls(const char *dir, int flags) {
+  if (flags & LS_RECURSIVE) {
+    output_puts("recursive listings are not supported on Win32");
+    return 1;
+  }
+
+  int show_details = (flags & LS_DETAILS) != 0;
+  if(show_details) {
+    output_printf("\nDirectory of %s\n\n", dir);
+  }
+
+  char *pattern = printf_to_string("%s\\*", dir);
+  if (!pattern) {
+    return 1;
+  }
+
+  WIN32_FIND_DATA file_data;
+  HANDLE find = FindFirstFile(pattern, &file_data);
+  if (find == INVALID_HANDLE_VALUE) {
+    free(pattern);
+    return 1;
+  }
+
+  do {
+    if(!show_details) {
+      output_puts(file_data.cFileName);
+      continue;
+    }
+
+    SYSTEMTIME last_access_time;
+    if (!FileTimeToSystemTime(&file_data.ftLastAccessTime, &last_access_time)) {
+      output_puts("error converting last access time");
+      free(pattern);
+      return 1;
+    }
+
+    int hour = last_access_time.wHour;
+    if (hour == 0) {
+      hour = 12;
+    } else if (hour > 12) {
+      hour -= 12;
+    }
+
+    ULARGE_INTEGER ul;
+    ul.HighPart = file_data.nFileSizeHigh;
+    ul.LowPart = file_data.nFileSizeLow;
+
+    if (file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      output_printf("%02d/%02d/%04d  %02d:%02d %cM   <DIR>        %s\n",
+                    last_access_time.wMonth, last_access_time.wDay,
+                    last_access_time.wYear, hour, last_access_time.wMinute,
+                    last_access_time.wHour < 12 ? 'A' : 'P',
+                    file_data.cFileName);
+    } else {
+      output_printf("%02d/%02d/%04d  %02d:%02d %cM        %7lld %s\n",
+                    last_access_time.wMonth, last_access_time.wDay,
+                    last_access_time.wYear, hour, last_access_time.wMinute,
+                    last_access_time.wHour < 12 ? 'A' : 'P', ul.QuadPart,
+                    file_data.cFileName);
+    }
+  } while (FindNextFile(find, &file_data));
+  free(pattern);
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include "mapped_file.h"
+
+static void unmap(mapped_file *file) {
+  if (file->data) {
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    file->data = NULL;
+    file->mapping = NULL;
+  }
+  file->size = 0;
+}
+
+// a file of size 0 cannot be mapped on Win32
+static int map(mapped_file *file, size_t size) {
+  unmap(file);
+  if (size == 0) {
+    return 1;
+  }
+
+  ULARGE_INTEGER max_size;
+  max_size.QuadPart = size;
+  DWORD protect = file->writable ? PAGE_READWRITE : PAGE_READONLY;
+  file->mapping = CreateFileMapping(file->file, NULL, protect,
+                                    max_size.HighPart, max_size.LowPart, NULL);
+  if (!file->mapping) {
+    return 0;
+  }
+
+  DWORD access = file->writable ? FILE_MAP_WRITE : FILE_MAP_READ;
+  file->data = MapViewOfFile(file->mapping, access, 0, 0, size);
+  if (!file->data) {
+    CloseHandle(file->mapping);
+    file->mapping = NULL;
+    return 0;
+  }
+
+  file->size = size;
+  return 1;
+}
+
+int mapped_file_open(mapped_file *file, const char *path, int writable) {
+  file->writable = writable;
+  file->mapping = NULL;
+  file->data = NULL;
+  file->size = 0;
+  file->file = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                          OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file->file == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+
+  if (!mapped_file_refresh(file)) {
+    CloseHandle(file->file);
+    return 0;
+  }
+  return 1;
+}
+
+void mapped_file_close(mapped_file *file) {
+  unmap(file);
+  CloseHandle(file->file);
+}
+
+int mapped_file_refresh(mapped_file *file) {
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file->file, &size)) {
+    return 0;
+  }
+  return (size_t)size.QuadPart == file->size || map(file, size.QuadPart);
+}
+
+// a mapped file cannot be truncated, so it is unmapped first
+int mapped_file_resize(mapped_file *file, size_t size) {
+  unmap(file);
+  LARGE_INTEGER end;
+  end.QuadPart = size;
+  return SetFilePointerEx(file->file, end, NULL, FILE_BEGIN) &&
+         SetEndOfFile(file->file) && map(file, size);
+}
+
+int mapped_file_append(mapped_file *file, const void *data, size_t len) {
+  // an offset of all ones writes at the end of the file, atomically
+  OVERLAPPED overlapped = {0};
+  overlapped.Offset = 0xffffffff;
+  overlapped.OffsetHigh = 0xffffffff;
+  DWORD written;
+  if (!WriteFile(file->file, data, (DWORD)len, &written, &overlapped) ||
+      written != len) {
+    return 0;
+  }
+  return mapped_file_refresh(file);
+}
+
+int mapped_file_lock(mapped_file *file) {
+  OVERLAPPED overlapped = {0};
+  return LockFileEx(file->file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD,
+                    &overlapped);
+}
+
+void mapped_file_unlock(mapped_file *file) {
+  OVERLAPPED overlapped = {0};
+  UnlockFileEx(file->file, 0, MAXDWORD, MAXDWORD, &overlapped);
+}
@@ -1,9 +1,13 @@
 #include "../../process.h"
 #include "tinyshell.h"
 #include <parse_cmd.h>
+#include <psapi.h>
 #include <string.h>
 #include <utils.h>
 
+const char *const spawn_backends[] = {"CreateProcess"};
+const int spawn_backends_len = sizeof spawn_backends / sizeof spawn_backends[0];
+
 static int file_exists(const char *path) {
   DWORD a = GetFileAttributesA(path);
   if (a == INVALID_FILE_ATTRIBUTES) {
@@ -13,28 +17,72 @@ static int file_exists(const char *path) {
   }
 };
 
-char *search_directory_for_executable(const char *arg0, const char *directory) {
+static char *search_directory_for_executable(const char *arg0,
+                                             const char *directory,
+                                             arena *arena) {
   char *extensions[] = {"", ".cmd", ".exe", ".bat", ".com"};
   for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+    arena_mark mark = arena_save(arena);
     char *file_path;
     if (directory) {
-      file_path = printf_to_string("%s\\%s%s", directory, arg0, extensions[i]);
+      file_path =
+          arena_printf(arena, "%s\\%s%s", directory, arg0, extensions[i]);
     } else {
-      file_path = printf_to_string("%s%s", arg0, extensions[i]);
+      file_path = arena_printf(arena, "%s%s", arg0, extensions[i]);
     }
 
-    if (file_exists(file_path)) {
+    if (file_path && file_exists(file_path)) {
       return file_path;
     }
 
-    free(file_path);
+    arena_rewind(arena, mark);
   }
 
   return NULL;
 }
 
-char *find_executable(const char *arg0, const tinyshell *shell) {
-  char *executable = search_directory_for_executable(arg0, NULL);
+int list_executables(const char *dir,
+                     int (*callback)(void *userdata, const char *name),
+                     void *userdata) {
+  char *pattern = printf_to_string("%s\\*", dir);
+  if (!pattern) {
+    return 0;
+  }
+
+  WIN32_FIND_DATA file_data;
+  HANDLE find = FindFirstFile(pattern, &file_data);
+  free(pattern);
+  if (find == INVALID_HANDLE_VALUE) {
+    return 1;
+  }
+
+  // files without one of the extensions tried by find_executable are left out,
+  // there would be every DLL otherwise
+  const char *extensions[] = {".cmd", ".exe", ".bat", ".com"};
+  int ok = 1;
+  do {
+    char *dot = strrchr(file_data.cFileName, '.');
+    if ((file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !dot) {
+      continue;
+    }
+
+    for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+      if (_stricmp(dot, extensions[i]) == 0) {
+        *dot = '\0';
+        ok = callback(userdata, file_data.cFileName);
+        break;
+      }
+    }
+  } while (ok && FindNextFile(find, &file_data));
+
+  FindClose(find);
+  return ok;
+}
+
+const char *find_executable(const char *arg0, tinyshell *shell,
+                            arena *arena) {
+  stats_count(&shell->stats, STATS_PATH_LOOKUPS, 1);
+  char *executable = search_directory_for_executable(arg0, NULL, arena);
   if (executable) {
     return executable;
   }
@@ -43,27 +91,71 @@ char *find_executable(const char *arg0, const tinyshell *shell) {
     return NULL;
   }
 
-  char *path = printf_to_string("%s", tinyshell_get_path_env(shell));
-  if (!path) {
+  exec_cache *cache = &shell->exec_cache;
+  const char *path_env = tinyshell_get_path_env(shell);
+  exec_cache_entry *entry = exec_cache_lookup(cache, path_env, arg0);
+  if (entry) {
+    return entry->path ? arena_printf(arena, "%s", entry->path) : NULL;
+  }
+
+  int dirs_len;
+  const exec_cache_dir *dirs = exec_cache_dirs(cache, path_env, &dirs_len);
+  if (!dirs) {
     return NULL;
   }
 
-  char *saveptr;
-  for (char *dir = reentrant_strtok(path, ";", &saveptr); dir;
-       dir = reentrant_strtok(NULL, ";", &saveptr)) {
-    executable = search_directory_for_executable(arg0, dir);
+  for (int i = 0; i < dirs_len; ++i) {
+    stats_count(&shell->stats, STATS_PATH_PROBES, 1);
+    executable = search_directory_for_executable(arg0, dirs[i].path, arena);
     if (executable) {
+      exec_cache_insert(cache, arg0, executable, i);
       return executable;
     }
   }
 
+  exec_cache_insert(cache, arg0, NULL, dirs_len);
   return NULL;
 }
 
-int process_create(process *p, char *binary_path, const tinyshell *shell,
+void spawn_context_current(spawn_context *ctx, const tinyshell *shell) {
+  // the processes inherit the console of the shell
+  ctx->std_fds[0] = ctx->std_fds[1] = ctx->std_fds[2] = -1;
+  ctx->cwd = NULL;
+  ctx->close_redirectable = 0;
+  ctx->backend = shell->spawn_backend;
+  ctx->pipe_size = shell->pipe_size;
+}
+
+int spawn_context_save(spawn_context *ctx, const tinyshell *shell,
+                       arena *arena) {
+  spawn_context_current(ctx, shell);
+  char *cwd = get_current_directory();
+  ctx->cwd = cwd ? arena_printf(arena, "%s", cwd) : NULL;
+  free(cwd);
+  return ctx->cwd != NULL;
+}
+
+void spawn_context_release(spawn_context *ctx) {}
+
+int process_create(process *p, const char *const *binary_paths,
+                   const spawn_context *ctx, const env_block *env,
                    const char *command, command_parse_result *parse_result,
                    char **error) {
-  char *application_path = binary_path;
+  if (parse_result->stages_len > 1) {
+    *error = printf_to_string("pipelines are not supported on Win32");
+    return 0;
+  }
+
+  // the command line is passed verbatim, the redirection operators would end up
+  // in the arguments of the child
+  if (parse_result->stages[0].redirections_len > 0) {
+    *error = printf_to_string(
+        "redirections are only supported for builtins and scripts on Win32");
+    return 0;
+  }
+
+  const char *binary_path = binary_paths[0];
+  const char *application_path = binary_path;
   char *command_copy = printf_to_string("%s", command);
   if (!command_copy) {
     return 0;
@@ -81,14 +173,12 @@ int process_create(process *p, char *binary_path, const tinyshell *shell,
   if (string_ends_with(binary_path, ".bat")) {
     char *bat_command =
         printf_to_string("C:\\Windows\\System32\\cmd.exe /c %s", command_copy);
-    application_path = printf_to_string("C:\\Windows\\System32\\cmd.exe");
+    application_path = "C:\\Windows\\System32\\cmd.exe";
 
-    if (!bat_command || !application_path) {
+    if (!bat_command) {
       free(command_copy);
-      free(application_path);
-      free(bat_command);
       *error = printf_to_string("out of memory");
-      return 1;
+      return 0;
     }
 
     free(command_copy);
@@ -106,20 +196,10 @@ int process_create(process *p, char *binary_path, const tinyshell *shell,
     *end-- = '\0';
   }
 
-  if (CreateProcess(application_path, command_copy, NULL, NULL, FALSE, 0, NULL,
-                    NULL, &info, p)) {
-    if (application_path != binary_path) {
-      free(binary_path);
-    }
-    command_parse_result_free(parse_result);
-    return 1;
-  }
-
-  if (application_path != binary_path) {
-    free(application_path);
-  }
+  BOOL success = CreateProcess(application_path, command_copy, NULL, NULL,
+                               FALSE, 0, env->data, ctx->cwd, &info, p);
   free(command_copy);
-  return 0;
+  return success;
 }
 
 void process_free(process *p) {
@@ -127,13 +207,39 @@ void process_free(process *p) {
   CloseHandle(p->hThread);
 }
 
+// FILETIME counts 100ns intervals
+static long long filetime_us(const FILETIME *t) {
+  ULARGE_INTEGER value;
+  value.LowPart = t->dwLowDateTime;
+  value.HighPart = t->dwHighDateTime;
+  return (long long)(value.QuadPart / 10);
+}
+
+// Windows does not count context switches per process
+void process_read_usage(HANDLE handle, process_usage *usage) {
+  memset(usage, 0, sizeof *usage);
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(handle, &creation, &exit, &kernel, &user)) {
+    usage->user_us = filetime_us(&user);
+    usage->sys_us = filetime_us(&kernel);
+  }
+
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(handle, &counters, sizeof counters)) {
+    usage->max_rss_kb = (long long)(counters.PeakWorkingSetSize / 1024);
+  }
+}
+
 // blocking
-int process_wait_for(process *p, int *status_code) {
+int process_wait_for(process *p, int *status_code, process_usage *usage) {
   DWORD result = WaitForSingleObject(p->hProcess, INFINITE);
   if (result == WAIT_OBJECT_0) {
     if (status_code) {
       *status_code = 0;
     }
+    if (usage) {
+      process_read_usage(p->hProcess, usage);
+    }
     return 1;
   } else {
     return 0;
@@ -0,0 +1,173 @@
+#include "output.h"
+#include "process.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct reaper_watch {
+  HANDLE handle;
+  int job;
+  int stage;
+};
+
+// the wake event takes one of the MAXIMUM_WAIT_OBJECTS slots
+#define WAIT_CHUNK (MAXIMUM_WAIT_OBJECTS - 1)
+// when there are more processes than a single wait can handle, the chunks are
+// polled in turn
+#define WAIT_ROTATE_MS 50
+// a failing wait is retried after a delay growing up to this
+#define MAX_BACKOFF_MS 1000
+
+// mutex lock/unlock failure basically never happen
+static void lock(reaper *r) {
+  if (mtx_lock(&r->lock) != thrd_success) {
+    exit(1);
+  }
+}
+
+static void unlock(reaper *r) {
+  if (mtx_unlock(&r->lock) != thrd_success) {
+    exit(1);
+  }
+}
+
+static int reaper_thread(void *data) {
+  reaper *r = data;
+  int offset = 0;
+  DWORD backoff_ms = 0;
+  while (1) {
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    int jobs[MAXIMUM_WAIT_OBJECTS];
+    int stages[MAXIMUM_WAIT_OBJECTS];
+    handles[0] = r->wake_event;
+
+    lock(r);
+    if (r->stopping && r->watched == 0) {
+      unlock(r);
+      return 0;
+    }
+
+    if (offset >= r->watched) {
+      offset = 0;
+    }
+    int count = r->watched - offset;
+    if (count > WAIT_CHUNK) {
+      count = WAIT_CHUNK;
+    }
+    for (int i = 0; i < count; ++i) {
+      handles[i + 1] = r->watches[offset + i].handle;
+      jobs[i + 1] = r->watches[offset + i].job;
+      stages[i + 1] = r->watches[offset + i].stage;
+    }
+    DWORD timeout = r->watched > WAIT_CHUNK ? WAIT_ROTATE_MS : INFINITE;
+    unlock(r);
+
+    DWORD result = WaitForMultipleObjects(count + 1, handles, FALSE, timeout);
+    if (result == WAIT_TIMEOUT) {
+      offset += WAIT_CHUNK;
+      continue;
+    }
+
+    if (result < WAIT_OBJECT_0 || result > WAIT_OBJECT_0 + count) {
+      // the call fails at once, so it is retried after a growing delay
+      if (backoff_ms == 0) {
+        output_notice("reaper: WaitForMultipleObjects failed\n");
+      }
+      backoff_ms = backoff_ms == 0 ? 10 : backoff_ms * 2;
+      if (backoff_ms > MAX_BACKOFF_MS) {
+        backoff_ms = MAX_BACKOFF_MS;
+      }
+      Sleep(backoff_ms);
+      continue;
+    }
+    backoff_ms = 0;
+
+    int index = (int)(result - WAIT_OBJECT_0);
+    if (index == 0) {
+      continue;
+    }
+
+    DWORD exit_code;
+    int status_code = -1;
+    if (GetExitCodeProcess(handles[index], &exit_code)) {
+      status_code = (int)exit_code;
+    }
+    process_usage usage;
+    process_read_usage(handles[index], &usage);
+
+    lock(r);
+    for (int i = 0; i < r->watched; ++i) {
+      if (r->watches[i].handle == handles[index]) {
+        r->watches[i] = r->watches[--r->watched];
+        break;
+      }
+    }
+    unlock(r);
+
+    r->callback(r->userdata, jobs[index], stages[index], status_code, &usage);
+  }
+}
+
+int reaper_init(reaper *r, reaper_callback callback, void *userdata) {
+  r->callback = callback;
+  r->userdata = userdata;
+  r->watched = 0;
+  r->stopping = 0;
+  r->watches = NULL;
+  r->watches_cap = 0;
+
+  if (mtx_init(&r->lock, mtx_plain) != thrd_success) {
+    return 0;
+  }
+
+  r->wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!r->wake_event) {
+    mtx_destroy(&r->lock);
+    return 0;
+  }
+
+  if (thrd_create(&r->thread, reaper_thread, r) != thrd_success) {
+    CloseHandle(r->wake_event);
+    mtx_destroy(&r->lock);
+    return 0;
+  }
+
+  return 1;
+}
+
+int reaper_watch_process(reaper *r, const process *p, int job, int stage) {
+  lock(r);
+  if (r->watched == r->watches_cap) {
+    int new_cap = r->watches_cap * 2 + 1;
+    reaper_watch *new_watches =
+        realloc(r->watches, new_cap * sizeof *new_watches);
+    if (!new_watches) {
+      unlock(r);
+      return 0;
+    }
+
+    r->watches = new_watches;
+    r->watches_cap = new_cap;
+  }
+
+  r->watches[r->watched].handle = p->hProcess;
+  r->watches[r->watched].job = job;
+  r->watches[r->watched].stage = stage;
+  ++r->watched;
+  unlock(r);
+
+  SetEvent(r->wake_event);
+  return 1;
+}
+
+void reaper_destroy(reaper *r) {
+  lock(r);
+  r->stopping = 1;
+  unlock(r);
+  SetEvent(r->wake_event);
+
+  thrd_join(r->thread, NULL);
+  CloseHandle(r->wake_event);
+  free(r->watches);
+  mtx_destroy(&r->lock);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "arena.h"
+#include "env.h"
 #include "parse_cmd.h"
 #ifdef _WIN32
 #include <windows.h>
@@ -9,22 +11,83 @@ typedef PROCESS_INFORMATION process;
 typedef pid_t process;
 #endif
 
-#include "tinyshell.h"
 #include <stdbool.h>
+#include <tinycthread.h>
 
 typedef struct tinyshell tinyshell;
 
+// the state of the shell processes are started in
+typedef struct {
+  // stdin of the first stage, stdout of the last one and stderr of all of
+  // them (unused on Win32)
+  int std_fds[3];
+  // NULL for the current directory of the shell
+  const char *cwd;
+  // whether the descriptors 3-REDIRECT_MAX_FD of the shell are closed in the
+  // processes, when they belong to whatever the shell runs later and not to
+  // the state this was saved from (unused on Win32)
+  int close_redirectable;
+  // index in spawn_backends
+  int backend;
+  int pipe_size;
+} spawn_context;
+
+// the state of the shell right now, only valid on the shell thread while it
+// does not change its descriptors or directory
+void spawn_context_current(spawn_context *ctx, const tinyshell *shell);
+// a copy of the current state that stays valid when the shell moves on, for
+// jobs started later from another thread: the standard descriptors are
+// duplicated and cwd is allocated from `arena`
+int spawn_context_save(spawn_context *ctx, const tinyshell *shell, arena *arena);
+void spawn_context_release(spawn_context *ctx);
+
 // Win32 API passes arguments by the command line string,
 // while POSIX API requires the arguments array
-int process_create(process *p, char *binary_path, const tinyshell *shell,
+//
+// one process is created per pipeline stage, in p[0..stages_len), stage i runs
+// binary_paths[i] with its stdout connected to the stdin of stage i + 1, and
+// the variables of `env` as its environment
+int process_create(process *p, const char *const *binary_paths,
+                   const spawn_context *ctx, const env_block *env,
                    const char *command, command_parse_result *parse_result,
                    char **error);
 void process_free(process *p);
 
-char *find_executable(const char *arg0, const tinyshell *shell);
+// the ways process_create can start processes on this platform, the one used
+// is ctx->backend, which is shell->spawn_backend (see the `spawn` builtin)
+extern const char *const spawn_backends[];
+extern const int spawn_backends_len;
 
-// blocking
-int process_wait_for(process *p, int *status_code);
+// the returned path is allocated from `arena` (or is arg0 itself)
+const char *find_executable(const char *arg0, tinyshell *shell, arena *arena);
+
+// calls `callback` with the name of every file in `dir` which find_executable
+// would run (on Win32 without its extension), returns 0 if `callback` failed,
+// a directory which cannot be read has no executables
+int list_executables(const char *dir,
+                     int (*callback)(void *userdata, const char *name),
+                     void *userdata);
+
+// resources used by an exited process, the fields the platform does not report
+// are zero
+typedef struct {
+  long long user_us;
+  long long sys_us;
+  long long max_rss_kb;
+  long long voluntary_switches;
+  long long involuntary_switches;
+} process_usage;
+
+#ifdef _WIN32
+// `handle` is a process which exited
+void process_read_usage(HANDLE handle, process_usage *usage);
+#else
+struct rusage;
+void process_usage_from_rusage(const struct rusage *ru, process_usage *usage);
+#endif
+
+// blocking, `usage` may be NULL
+int process_wait_for(process *p, int *status_code, process_usage *usage);
 
 // non-blocking
 int process_try_wait_for(process *p, int *status_code, int *done);
@@ -33,3 +96,50 @@ int process_kill(process *p);
 int process_suspend(process *p);
 int process_resume(process *p);
 
+// Waits for the completion of every background process on a single thread,
+// so the number of threads stays constant no matter how many jobs are running.
+//
+// Unix: pidfd + epoll on Linux, EVFILT_PROC kqueue events on BSD/macOS, and
+// waitpid polling for the processes which cannot be registered
+// Win32: WaitForMultipleObjects on the process handles
+
+// called on the reaper thread when the process of `stage` in `job` exits
+typedef void (*reaper_callback)(void *userdata, int job, int stage,
+                                int status_code, const process_usage *usage);
+
+typedef struct reaper_watch reaper_watch;
+
+typedef struct {
+  thrd_t thread;
+  mtx_t lock;
+  reaper_callback callback;
+  void *userdata;
+  // number of processes being waited for
+  int watched;
+  // set by reaper_destroy, the thread exits once `watched` drops to zero
+  int stopping;
+#ifdef _WIN32
+  HANDLE wake_event;
+  reaper_watch *watches;
+  int watches_cap;
+#else
+  // every watched process, and how many of them are polled with waitpid
+  // because they could not be registered with epoll/kqueue
+  reaper_watch *watches;
+  int polled;
+  // epoll or kqueue descriptor
+  int poll_fd;
+  // written to wake the reaper thread up
+  int wake_pipe[2];
+#endif
+} reaper;
+
+int reaper_init(reaper *r, reaper_callback callback, void *userdata);
+
+// the callback may be invoked before this function returns
+int reaper_watch_process(reaper *r, const process *p, int job, int stage);
+
+// wait for every watched process to exit, then stop the reaper thread
+void reaper_destroy(reaper *r);
+
+#include "tinyshell.h"
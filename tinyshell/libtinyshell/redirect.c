@@ -0,0 +1,163 @@
+#include "redirect.h"
+#include "output.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#define REDIRECT_FILE_MODE (_S_IREAD | _S_IWRITE)
+#define REDIRECT_OPEN_NOINHERIT _O_NOINHERIT
+#else
+#include <unistd.h>
+#define REDIRECT_FILE_MODE 0666
+#define REDIRECT_OPEN_NOINHERIT O_CLOEXEC
+#endif
+
+int redirect_open_flags(redirection_type type) {
+  switch (type) {
+  case REDIRECT_INPUT:
+    return POSIX_WIN32(O_RDONLY);
+  case REDIRECT_OUTPUT:
+    return POSIX_WIN32(O_WRONLY) | POSIX_WIN32(O_CREAT) | POSIX_WIN32(O_TRUNC);
+  case REDIRECT_APPEND:
+    return POSIX_WIN32(O_WRONLY) | POSIX_WIN32(O_CREAT) |
+           POSIX_WIN32(O_APPEND);
+  case REDIRECT_DUP:
+    break;
+  }
+  return 0;
+}
+
+// the copy must not be clobbered by a later redirection, which only touch
+// descriptors up to REDIRECT_MAX_FD
+static int save_fd(int fd) {
+#ifdef _WIN32
+  return _dup(fd);
+#else
+  return fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_MAX_FD + 1);
+#endif
+}
+
+int redirect_move_fd_high(int fd) {
+#ifdef _WIN32
+  return fd;
+#else
+  if (fd < 0 || fd > REDIRECT_MAX_FD) {
+    return fd;
+  }
+  int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_MAX_FD + 1);
+  if (high < 0) {
+    return fd;
+  }
+  close(fd);
+  return high;
+#endif
+}
+
+static int redirect_one(const redirection *r, char **error) {
+  if (r->type == REDIRECT_DUP) {
+    if (POSIX_WIN32(dup2)(r->target_fd, r->fd) < 0) {
+      *error = printf_to_string("unable to redirect %d to %d: %s", r->fd,
+                                r->target_fd, strerror(errno));
+      return 0;
+    }
+    return 1;
+  }
+
+  // the temporary descriptor must not leak into a queued job the reaper thread
+  // starts meanwhile, only its dup2 copy is inherited
+  int fd = POSIX_WIN32(open)(
+      r->path, redirect_open_flags(r->type) | REDIRECT_OPEN_NOINHERIT,
+      REDIRECT_FILE_MODE);
+  if (fd < 0) {
+    *error = printf_to_string("unable to open %s: %s", r->path,
+                              strerror(errno));
+    return 0;
+  }
+
+#ifndef _WIN32
+  if (fd == r->fd) {
+    fcntl(fd, F_SETFD, 0);
+  }
+#endif
+  int success = fd == r->fd || POSIX_WIN32(dup2)(fd, r->fd) >= 0;
+  if (!success) {
+    *error = printf_to_string("unable to redirect %d to %s: %s", r->fd,
+                              r->path, strerror(errno));
+  }
+  if (fd != r->fd) {
+    POSIX_WIN32(close)(fd);
+  }
+  return success;
+}
+
+int redirect_apply(const redirection *redirections, int len, int *saved,
+                   char **error) {
+  // output buffered before the redirection belongs to the old descriptor
+  output_flush();
+  fflush(stderr);
+  for (int i = 0; i < len; ++i) {
+    // -1 if the descriptor was closed
+    saved[i] = save_fd(redirections[i].fd);
+    if (!redirect_one(&redirections[i], error)) {
+      if (saved[i] >= 0) {
+        POSIX_WIN32(close)(saved[i]);
+      }
+      redirect_restore(redirections, i, saved);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void redirect_restore(const redirection *redirections, int len,
+                      const int *saved) {
+  output_flush();
+  fflush(stderr);
+  // in reverse order, a descriptor may have been redirected more than once
+  for (int i = len - 1; i >= 0; --i) {
+    if (saved[i] >= 0) {
+      POSIX_WIN32(dup2)(saved[i], redirections[i].fd);
+      POSIX_WIN32(close)(saved[i]);
+    } else {
+      POSIX_WIN32(close)(redirections[i].fd);
+    }
+  }
+}
+
+int redirect_stage_apply(const command_stage *stage, arena *arena,
+                         int **saved) {
+  *saved = NULL;
+  if (stage->redirections_len == 0) {
+    return 1;
+  }
+
+  *saved = arena_alloc(arena, stage->redirections_len * sizeof **saved);
+  if (!*saved) {
+    output_printf("unable to allocate memory for redirections\n");
+    return 0;
+  }
+
+  char *error = NULL;
+  if (!redirect_apply(stage->redirections, stage->redirections_len, *saved,
+                      &error)) {
+    output_printf("%s\n", error ? error : "unable to redirect");
+    free(error);
+    *saved = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+void redirect_stage_restore(const command_stage *stage, const int *saved) {
+  if (saved) {
+    redirect_restore(stage->redirections, stage->redirections_len, saved);
+  }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "parse_cmd.h"
+
+// Applies the redirections of a command to the shell's own file descriptors,
+// for commands running inside the shell process (builtins and scripts).
+// Child processes get theirs from the spawn file actions instead.
+
+// Descriptors the shell keeps open must not be in the range redirections
+// replace (0-REDIRECT_MAX_FD), or a builtin or script with a redirection would
+// close them. This moves `fd` above it and closes `fd`, returning the new
+// descriptor, or `fd` itself if it cannot be moved (on Windows, or when out of
+// descriptors). The new descriptor is close-on-exec.
+int redirect_move_fd_high(int fd);
+
+// flags passed to open() for the file of a redirection
+int redirect_open_flags(redirection_type type);
+
+// `saved` must have room for `len` descriptors, they are needed to undo the
+// redirections with redirect_restore. Nothing is redirected on failure.
+int redirect_apply(const redirection *redirections, int len, int *saved,
+                   char **error);
+void redirect_restore(const redirection *redirections, int len,
+                      const int *saved);
+
+// redirect_apply for the redirections of `stage`, printing the error.
+// `*saved` is allocated from `arena` (NULL if the stage has no redirections)
+// and passed to redirect_stage_restore.
+int redirect_stage_apply(const command_stage *stage, arena *arena,
+                         int **saved);
+void redirect_stage_restore(const command_stage *stage, const int *saved);
@@ -0,0 +1,330 @@
+#include "script_cache.h"
+#include "line_reader.h"
+#include "output.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define OPEN_FLAGS (_O_RDONLY | _O_BINARY)
+#else
+#include <unistd.h>
+#define OPEN_FLAGS (O_RDONLY | O_CLOEXEC)
+#endif
+
+#define SCRIPT_CACHE_INITIAL_BUCKETS 16
+
+typedef struct {
+  time_t mtime;
+  long mtime_nsec;
+  long long size;
+  unsigned long long inode;
+} file_id;
+
+static file_id get_file_id(const struct stat *s) {
+  file_id id;
+  id.mtime = s->st_mtime;
+#if defined(__APPLE__)
+  id.mtime_nsec = s->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  id.mtime_nsec = 0;
+#else
+  id.mtime_nsec = s->st_mtim.tv_nsec;
+#endif
+  id.size = (long long)s->st_size;
+  id.inode = (unsigned long long)s->st_ino;
+  return id;
+}
+
+static int entry_matches(const script_cache_entry *entry,
+                         const struct stat *s) {
+  file_id id = get_file_id(s);
+  return !entry->racy && id.mtime == entry->mtime &&
+         id.mtime_nsec == entry->mtime_nsec && id.size == entry->size &&
+         id.inode == entry->inode;
+}
+
+static char *canonical_path(const char *path) {
+#ifdef _WIN32
+  return _fullpath(NULL, path, 0);
+#else
+  return realpath(path, NULL);
+#endif
+}
+
+int script_cache_init(script_cache *cache, size_t memory_cap) {
+  cache->buckets = NULL;
+  cache->bucket_count = 0;
+  cache->len = 0;
+  cache->lru_head = NULL;
+  cache->lru_tail = NULL;
+  cache->memory = 0;
+  cache->memory_cap = memory_cap;
+  return 1;
+}
+
+static void free_entry(script_cache_entry *entry) {
+  arena_free(&entry->arena);
+  free(entry->commands);
+  free(entry->path);
+  free(entry);
+}
+
+void script_cache_destroy(script_cache *cache) {
+  script_cache_entry *entry = cache->lru_head;
+  while (entry) {
+    script_cache_entry *next = entry->lru_next;
+    free_entry(entry);
+    entry = next;
+  }
+  free(cache->buckets);
+}
+
+static void unlink_entry(script_cache *cache, script_cache_entry *entry) {
+  script_cache_entry **link =
+      &cache->buckets[entry->hash % cache->bucket_count];
+  while (*link != entry) {
+    link = &(*link)->hash_next;
+  }
+  *link = entry->hash_next;
+
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+
+  cache->memory -= entry->memory;
+  --cache->len;
+}
+
+static void remove_entry(script_cache *cache, script_cache_entry *entry) {
+  unlink_entry(cache, entry);
+  if (entry->refs > 0) {
+    entry->detached = 1;
+  } else {
+    free_entry(entry);
+  }
+}
+
+static void push_front(script_cache *cache, script_cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->lru_prev = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+}
+
+static int insert_entry(script_cache *cache, script_cache_entry *entry) {
+  if (cache->len >= cache->bucket_count) {
+    int new_count = cache->bucket_count ? cache->bucket_count * 2
+                                        : SCRIPT_CACHE_INITIAL_BUCKETS;
+    script_cache_entry **new_buckets = calloc(new_count, sizeof *new_buckets);
+    if (!new_buckets) {
+      return 0;
+    }
+
+    for (script_cache_entry *e = cache->lru_head; e; e = e->lru_next) {
+      e->hash_next = new_buckets[e->hash % new_count];
+      new_buckets[e->hash % new_count] = e;
+    }
+
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->bucket_count = new_count;
+  }
+
+  script_cache_entry **bucket =
+      &cache->buckets[entry->hash % cache->bucket_count];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  push_front(cache, entry);
+  cache->memory += entry->memory;
+  ++cache->len;
+
+  // evict the least recently used scripts, `entry` itself is in use
+  while (cache->memory > cache->memory_cap && cache->lru_tail != entry) {
+    remove_entry(cache, cache->lru_tail);
+  }
+
+  return 1;
+}
+
+static script_cache_entry *find_entry(script_cache *cache, const char *path,
+                                      unsigned hash) {
+  if (cache->bucket_count == 0) {
+    return NULL;
+  }
+
+  for (script_cache_entry *entry = cache->buckets[hash % cache->bucket_count];
+       entry; entry = entry->hash_next) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static size_t entry_memory(const script_cache_entry *entry) {
+  return sizeof *entry + entry->arena.capacity +
+         entry->commands_cap * sizeof *entry->commands;
+}
+
+static int add_line(script_cache_entry *entry, const char *line, size_t len) {
+  script_command command;
+  char *line_copy = arena_alloc(&entry->arena, len + 1);
+  if (!line_copy) {
+    return 0;
+  }
+  memcpy(line_copy, line, len);
+  line_copy[len] = '\0';
+  command.line = line_copy;
+
+  char *error = NULL;
+  command.invalid = !parse_command(line_copy, NULL, &entry->arena,
+                                   &command.parse_result, &error);
+  free(error);
+  if (!command.invalid && command.parse_result.argc == 0 &&
+      !command.parse_result.expanded) {
+    return 1;
+  }
+
+  return vecpush(&entry->commands, &entry->commands_len, &entry->commands_cap,
+                 sizeof command, &command, 1);
+}
+
+// parse the whole script, or give up as soon as it would not fit in the cache
+static script_cache_result load_entry(script_cache *cache,
+                                      script_cache_entry *entry,
+                                      const char *path) {
+  int fd = POSIX_WIN32(open)(path, OPEN_FLAGS);
+  if (fd < 0) {
+    output_printf("unable to open script file: %s\n", path);
+    return SCRIPT_CACHE_ERROR;
+  }
+
+  script_cache_result result = SCRIPT_CACHE_OK;
+  struct stat s;
+  line_reader reader;
+  if (fstat(fd, &s) != 0) {
+    output_printf("unable to determine filesize of script file: %s\n", path);
+    result = SCRIPT_CACHE_ERROR;
+    goto fail_stat;
+  }
+
+  file_id id = get_file_id(&s);
+  entry->mtime = id.mtime;
+  entry->mtime_nsec = id.mtime_nsec;
+  entry->size = id.size;
+  entry->inode = id.inode;
+  entry->racy = id.mtime >= time(NULL);
+  if (id.size < 0 || (unsigned long long)id.size > cache->memory_cap) {
+    result = SCRIPT_CACHE_UNCACHED;
+    goto fail_stat;
+  }
+
+  if (!line_reader_init(&reader, fd)) {
+    result = SCRIPT_CACHE_UNCACHED;
+    goto fail_stat;
+  }
+
+  char *line;
+  size_t len;
+  while ((line = line_reader_next(&reader, &len))) {
+    if (!add_line(entry, line, len) ||
+        entry_memory(entry) > cache->memory_cap) {
+      result = SCRIPT_CACHE_UNCACHED;
+      break;
+    }
+  }
+
+  if (reader.error) {
+    output_printf("unable to read script file: %s\n", path);
+    result = SCRIPT_CACHE_ERROR;
+  }
+
+  entry->memory = entry_memory(entry);
+  line_reader_destroy(&reader);
+fail_stat:
+  POSIX_WIN32(close)(fd);
+  return result;
+}
+
+script_cache_result script_cache_acquire(script_cache *cache, const char *path,
+                                         script_cache_entry **entry_ret) {
+  char *canonical = canonical_path(path);
+  if (!canonical) {
+    output_printf("unable to open script file: %s\n", path);
+    return SCRIPT_CACHE_ERROR;
+  }
+
+  unsigned hash = hash_string(canonical);
+  script_cache_entry *entry = find_entry(cache, canonical, hash);
+  if (entry) {
+    struct stat s;
+    if (stat(canonical, &s) == 0 && entry_matches(entry, &s)) {
+      free(canonical);
+      if (cache->lru_head != entry) {
+        // move to the front of the LRU list
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next) {
+          entry->lru_next->lru_prev = entry->lru_prev;
+        } else {
+          cache->lru_tail = entry->lru_prev;
+        }
+        push_front(cache, entry);
+      }
+
+      ++entry->refs;
+      *entry_ret = entry;
+      return SCRIPT_CACHE_OK;
+    }
+
+    remove_entry(cache, entry);
+  }
+
+  entry = calloc(1, sizeof *entry);
+  if (!entry) {
+    free(canonical);
+    return SCRIPT_CACHE_UNCACHED;
+  }
+
+  entry->path = canonical;
+  entry->hash = hash;
+  arena_init(&entry->arena);
+  script_cache_result result = load_entry(cache, entry, canonical);
+  if (result != SCRIPT_CACHE_OK) {
+    free_entry(entry);
+    return result;
+  }
+
+  entry->refs = 1;
+  if (!insert_entry(cache, entry)) {
+    // still usable, just not cached
+    entry->detached = 1;
+  }
+
+  *entry_ret = entry;
+  return SCRIPT_CACHE_OK;
+}
+
+void script_cache_release(script_cache *cache, script_cache_entry *entry) {
+  if (--entry->refs == 0 && entry->detached) {
+    free_entry(entry);
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "arena.h"
+#include "parse_cmd.h"
+
+#include <stddef.h>
+#include <time.h>
+
+// Cache of parsed scripts, so running the same script again skips both the
+// file I/O and the parsing.
+//
+// Entries are keyed by the canonical path of the script and are reloaded when
+// its mtime, size or inode changes. The least recently used entries are evicted
+// once the cache holds more than `memory_cap` bytes. Entries in use (a script
+// may run itself) are never freed from under their users.
+
+typedef struct {
+  // the original line, needed for job strings and Win32 command lines
+  const char *line;
+  // parsed without variables, lines which expand some are parsed again when run
+  command_parse_result parse_result;
+  // the line failed to parse, it is parsed again when run to report the error
+  int invalid;
+} script_command;
+
+typedef struct script_cache_entry {
+  struct script_cache_entry *hash_next;
+  struct script_cache_entry *lru_prev;
+  struct script_cache_entry *lru_next;
+  unsigned hash;
+  char *path;
+  time_t mtime;
+  long mtime_nsec;
+  long long size;
+  unsigned long long inode;
+  // modified in the same second it was loaded, so always reloaded
+  int racy;
+  arena arena;
+  script_command *commands;
+  int commands_len;
+  int commands_cap;
+  size_t memory;
+  int refs;
+  // replaced or evicted while in use, freed by the last release
+  int detached;
+} script_cache_entry;
+
+typedef struct {
+  script_cache_entry **buckets;
+  int bucket_count;
+  int len;
+  // most recently used first
+  script_cache_entry *lru_head;
+  script_cache_entry *lru_tail;
+  size_t memory;
+  size_t memory_cap;
+} script_cache;
+
+typedef enum {
+  SCRIPT_CACHE_OK,
+  // the script is too large (or memory ran out), run it without caching it
+  SCRIPT_CACHE_UNCACHED,
+  // the script could not be read, an error was printed
+  SCRIPT_CACHE_ERROR,
+} script_cache_result;
+
+#define SCRIPT_CACHE_DEFAULT_CAP (16 * 1024 * 1024)
+
+int script_cache_init(script_cache *cache, size_t memory_cap);
+void script_cache_destroy(script_cache *cache);
+
+// on SCRIPT_CACHE_OK, *entry is valid until script_cache_release is called
+script_cache_result script_cache_acquire(script_cache *cache, const char *path,
+                                         script_cache_entry **entry);
+void script_cache_release(script_cache *cache, script_cache_entry *entry);
@@ -0,0 +1,88 @@
+#include "stats.h"
+
+#include <string.h>
+
+const char *const stats_step_names[STATS_STEPS_LEN] = {
+    "read command",    "parse",          "builtin",
+    "find executable", "process create", "process wait",
+};
+
+const char *const stats_counter_names[STATS_COUNTERS_LEN] = {
+    "processes spawned",
+    "PATH lookups",
+    "PATH directories searched",
+};
+
+static int highest_bit(unsigned long long value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - __builtin_clzll(value);
+#else
+  int bit = 0;
+  while (value >>= 1) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+// values below STATS_SUB_BUCKETS get a bucket each, the others are indexed by
+// their highest bit and the STATS_SUB_BUCKET_BITS bits below it
+static int bucket_index(unsigned long long value) {
+  if (value < STATS_SUB_BUCKETS) {
+    return (int)value;
+  }
+
+  int bit = highest_bit(value);
+  int shift = bit - STATS_SUB_BUCKET_BITS;
+  return ((shift + 1) << STATS_SUB_BUCKET_BITS) |
+         (int)((value >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+static long long bucket_upper_bound(int index) {
+  if (index < STATS_SUB_BUCKETS) {
+    return index;
+  }
+
+  int shift = (index >> STATS_SUB_BUCKET_BITS) - 1;
+  long long mantissa = STATS_SUB_BUCKETS + (index & (STATS_SUB_BUCKETS - 1));
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void stats_reset(shell_stats *stats) { memset(stats, 0, sizeof *stats); }
+
+void stats_record(shell_stats *stats, stats_step step, long long elapsed_ns) {
+  if (elapsed_ns < 0) {
+    elapsed_ns = 0;
+  }
+
+  stats_histogram *histogram = &stats->steps[step];
+  ++histogram->buckets[bucket_index((unsigned long long)elapsed_ns)];
+  ++histogram->count;
+  if (elapsed_ns > histogram->max_ns) {
+    histogram->max_ns = elapsed_ns;
+  }
+}
+
+long long stats_percentile(const stats_histogram *histogram,
+                           double percentile) {
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  // rank of the value, 1-based
+  long long rank = (long long)(percentile / 100.0 * histogram->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  long long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      long long bound = bucket_upper_bound(i);
+      return bound < histogram->max_ns ? bound : histogram->max_ns;
+    }
+  }
+
+  return histogram->max_ns;
+}
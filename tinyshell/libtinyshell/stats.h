@@ -0,0 +1,58 @@
+#pragma once
+
+// Latency of the steps the shell goes through to run a command, and counters of
+// the work they do, shown by the `stats` builtin.
+//
+// Latencies are kept in log-linear histograms: every power of two is split in
+// STATS_SUB_BUCKETS buckets, so recording is a couple of shifts and the
+// percentiles are within 25% of the exact value, whatever the range.
+typedef enum {
+  STATS_READ_COMMAND,
+  STATS_PARSE,
+  STATS_BUILTIN,
+  STATS_FIND_EXECUTABLE,
+  STATS_SPAWN,
+  STATS_WAIT,
+  STATS_STEPS_LEN
+} stats_step;
+
+typedef enum {
+  STATS_SPAWNS,
+  // calls to find_executable
+  STATS_PATH_LOOKUPS,
+  // PATH directories searched by lookups the exec cache could not answer
+  STATS_PATH_PROBES,
+  STATS_COUNTERS_LEN
+} stats_counter;
+
+#define STATS_SUB_BUCKET_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+typedef struct {
+  long long count;
+  long long max_ns;
+  long long buckets[STATS_BUCKETS];
+} stats_histogram;
+
+// only touched by the shell thread
+typedef struct {
+  stats_histogram steps[STATS_STEPS_LEN];
+  long long counters[STATS_COUNTERS_LEN];
+} shell_stats;
+
+extern const char *const stats_step_names[STATS_STEPS_LEN];
+extern const char *const stats_counter_names[STATS_COUNTERS_LEN];
+
+void stats_reset(shell_stats *stats);
+void stats_record(shell_stats *stats, stats_step step, long long elapsed_ns);
+
+inline static void stats_count(shell_stats *stats, stats_counter counter,
+                               long long n) {
+  stats->counters[counter] += n;
+}
+
+// the largest value of the bucket holding the `percentile`-th value (0-100),
+// capped at the maximum recorded, 0 if nothing was recorded
+long long stats_percentile(const stats_histogram *histogram,
+                           double percentile);
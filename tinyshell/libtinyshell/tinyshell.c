@@ -1,48 +1,51 @@
 #include "tinyshell.h"
+#include "completion.h"
+#include "output.h"
 #include "parse_cmd.h"
 #include <builtin.h>
 #include <errno.h>
 #include <process.h>
+#include <redirect.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <utils.h>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <fcntl.h>
 #include <io.h>
+#define environ _environ
 #else
+#include <fcntl.h>
 #include <unistd.h>
+extern char **environ;
 #endif
 
-static char *get_command(tinyshell *shell) {
-  char *command = NULL;
-  int len = 0;
-  int cap = 0;
-  int ch;
+static int complete_command(void *userdata, const char *line, size_t cursor,
+                            completion *result) {
+  return complete_line(userdata, line, cursor, result);
+}
 
-  do {
-    ch = fgetc(shell->input);
-    if (ch == '\n') {
-      ch = '\0';
-    }
-    if (ch == EOF) {
-      ch = '\0';
-      shell->exit = 1;
+static const char *get_command(tinyshell *shell, const char *prompt) {
+  size_t len;
+  long long start = monotonic_ns();
+  const char *command =
+      shell->has_editor
+          ? line_editor_read(&shell->editor, prompt, complete_command, shell)
+          : line_reader_next(&shell->reader, &len);
+  stats_record(&shell->stats, STATS_READ_COMMAND, monotonic_ns() - start);
+  if (!command) {
+    if (shell->has_editor ? shell->editor.error : shell->reader.error) {
+      output_printf("unable to read command\n");
     }
 
-    char c = (char)ch;
-    if (!vecpush(&command, &len, &cap, 1, &c, 1)) {
-      goto fail_vecpush;
-    }
-  } while (ch != '\0');
+    shell->exit = 1;
+    return "";
+  }
 
   return command;
-
-fail_vecpush:
-  free(command);
-
-  return NULL;
 }
 
 char *get_current_directory() {
@@ -76,7 +79,9 @@ static tinyshell *current_shell;
 static void sigint_handler(int s) {
   signal(SIGINT, sigint_handler);
   if (current_shell->has_fg) {
-    process_kill(&current_shell->fg);
+    for (int i = 0; i < current_shell->fg_len; ++i) {
+      process_kill(&current_shell->fg[i]);
+    }
   }
 }
 
@@ -95,145 +100,530 @@ void tinyshell_unlock_bg_procs(tinyshell *shell) {
   }
 }
 
+static void free_pending_job(pending_job *pending) {
+  if (pending) {
+    spawn_context_release(&pending->ctx);
+    env_block_release(pending->env);
+    arena_free(&pending->arena);
+    free(pending);
+  }
+}
+
+// with the jobs lock held, the slot goes back to the free-list
+static void release_job(tinyshell *shell, int slot) {
+  bg_process *bg = job_table_get(&shell->jobs, slot);
+  for (int i = 0; i < bg->stages_len; ++i) {
+    process_free(&bg->stages[i].p);
+  }
+  free(bg->stages);
+  free(bg->cmd);
+  free_pending_job(bg->pending);
+  bg->pending = NULL;
+  job_table_remove(&shell->jobs, slot);
+}
+
 static void update_jobs(tinyshell *shell) {
+  if (!atomic_int_exchange(&shell->has_finished, 0)) {
+    return;
+  }
+
   tinyshell_lock_bg_procs(shell);
-  for (int i = 0; i < shell->bg_cap; ++i) {
-    if (shell->bg[i].status == BG_PROCESS_FINISHED) {
-      // join the background process thread
-      thrd_join(shell->bg[i].thread, NULL);
-      shell->bg[i].status = BG_PROCESS_EMPTY;
+  for (int i = 0; i < shell->finished_len; ++i) {
+    int slot = shell->finished[i];
+    bg_process *bg = job_table_get(&shell->jobs, slot);
+    output_printf("job %%%d exited with error code %d", bg->id,
+                  bg->status_code);
+    // jobs which never started have nothing to report
+    if (bg->stages_len > 0) {
+      process_usage usage;
+      tinyshell_job_usage(bg, &usage);
+      output_printf(" (");
+      tinyshell_print_usage(&usage, bg->wall_ns);
+      output_printf(")");
     }
+    output_puts("");
+    release_job(shell, slot);
   }
+  shell->finished_len = 0;
   tinyshell_unlock_bg_procs(shell);
 }
 
-static int find_bg_job_index(tinyshell *shell, int *index) {
-  update_jobs(shell);
+// with the jobs lock held, the exit is reported by update_jobs
+static void finish_job(tinyshell *shell, int slot) {
+  bg_process *bg = job_table_get(&shell->jobs, slot);
+  atomic_int_store(&bg->status, BG_PROCESS_FINISHED);
+  // run_job made room for it
+  shell->finished[shell->finished_len++] = slot;
+  atomic_int_store(&shell->has_finished, 1);
+}
+
+// called on the reaper thread, the job finishes once every stage exited
+static void bg_process_exited(void *data, int slot, int stage,
+                              int status_code, const process_usage *usage) {
+  tinyshell *shell = data;
+  // the job is not released before this function ran for every stage
+  bg_process *bg = job_table_get(&shell->jobs, slot);
+  if (stage == bg->stages_len - 1) {
+    bg->status_code = status_code;
+  }
+  bg->stages[stage].usage = *usage;
+  atomic_int_store(&bg->stages[stage].exited, 1);
+  if (atomic_int_fetch_add(&bg->running, -1) != 1) {
+    return;
+  }
+
+  bg->wall_ns = monotonic_ns() - bg->start_ns;
+
   tinyshell_lock_bg_procs(shell);
-  for (int i = 0; i < shell->bg_cap; ++i) {
-    if (shell->bg[i].status == BG_PROCESS_EMPTY) {
-      if (index) {
-        *index = i;
-      }
+  --shell->running_jobs;
+  finish_job(shell, slot);
+  tinyshell_unlock_bg_procs(shell);
 
-      tinyshell_unlock_bg_procs(shell);
-      return 1;
+  tinyshell_start_queued_jobs(shell);
+}
+
+// with the jobs lock held, the caller watches the stages once the lock is
+// released
+static int spawn_job(tinyshell *shell, bg_process *bg,
+                     const spawn_context *ctx, const char *const *binary_paths,
+                     const env_block *env, command_parse_result *parse_result,
+                     long long *spawn_ns, char **error) {
+  int stages_len = parse_result->stages_len;
+  bg_stage *stages = calloc(stages_len, sizeof *stages);
+  process *procs = malloc(stages_len * sizeof *procs);
+  if (!stages || !procs) {
+    *error = printf_to_string("unable to allocate memory for job");
+    goto fail;
+  }
+
+  long long start = monotonic_ns();
+  if (!process_create(procs, binary_paths, ctx, env, bg->cmd, parse_result,
+                      error)) {
+    goto fail;
+  }
+  if (spawn_ns) {
+    *spawn_ns = monotonic_ns() - start;
+  }
+
+  for (int i = 0; i < stages_len; ++i) {
+    stages[i].p = procs[i];
+  }
+  free(procs);
+  bg->stages = stages;
+  bg->stages_len = stages_len;
+  bg->status_code = 0;
+  bg->start_ns = start;
+  bg->wall_ns = 0;
+  atomic_int_store(&bg->running, stages_len);
+  // publishes the stages to the readers of the status
+  atomic_int_store(&bg->status, BG_PROCESS_RUNNING);
+  ++shell->running_jobs;
+  return 1;
+
+fail:
+  free(stages);
+  free(procs);
+  return 0;
+}
+
+// `stages` is not freed before every stage exited, so it can be used without
+// the jobs lock
+static void watch_job(tinyshell *shell, int slot, int id, bg_stage *stages,
+                      int stages_len) {
+  for (int i = 0; i < stages_len; ++i) {
+    if (!reaper_watch_process(&shell->reaper, &stages[i].p, slot, i)) {
+      output_notice("unable to wait for job %%%d\n", id);
+      // the job would never finish, and would hold its place in max_jobs
+      process_usage usage = {0};
+      bg_process_exited(shell, slot, i, -1, &usage);
     }
   }
+}
 
-  // reallocation needed
-  int new_cap = shell->bg_cap * 2 + 1;
-  bg_process *new_bg = realloc(shell->bg, new_cap * sizeof *new_bg);
-  if (!new_bg) {
-    tinyshell_unlock_bg_procs(shell);
+// with the jobs lock held
+static int queue_job(tinyshell *shell, int slot,
+                     const char *const *binary_paths, env_block *env,
+                     const command_parse_result *parse_result) {
+  pending_job *pending = malloc(sizeof *pending);
+  if (!pending) {
     return 0;
   }
 
-  if (index) {
-    *index = shell->bg_cap;
+  // the job outlives the command arena
+  arena_init(&pending->arena);
+  if (!spawn_context_save(&pending->ctx, shell, &pending->arena)) {
+    arena_free(&pending->arena);
+    free(pending);
+    return 0;
   }
-
-  for (int i = shell->bg_cap; i < new_cap; ++i) {
-    // mark empty slots as finished processes
-    new_bg[i].status = BG_PROCESS_EMPTY;
+  pending->env = env_block_acquire(env);
+  int stages_len = parse_result->stages_len;
+  pending->binary_paths = arena_alloc(
+      &pending->arena, stages_len * sizeof *pending->binary_paths);
+  if (!pending->binary_paths ||
+      !copy_parse_result(parse_result, &pending->arena,
+                         &pending->parse_result)) {
+    free_pending_job(pending);
+    return 0;
   }
 
-  shell->bg_cap = new_cap;
-  shell->bg = new_bg;
-  tinyshell_unlock_bg_procs(shell);
+  for (int i = 0; i < stages_len; ++i) {
+    pending->binary_paths[i] =
+        arena_printf(&pending->arena, "%s", binary_paths[i]);
+    if (!pending->binary_paths[i]) {
+      free_pending_job(pending);
+      return 0;
+    }
+  }
 
+  bg_process *bg = job_table_get(&shell->jobs, slot);
+  bg->pending = pending;
+  atomic_int_store(&bg->status, BG_PROCESS_QUEUED);
+  bg->next = -1;
+  if (shell->queue_tail >= 0) {
+    job_table_get(&shell->jobs, shell->queue_tail)->next = slot;
+  } else {
+    shell->queue_head = slot;
+  }
+  shell->queue_tail = slot;
   return 1;
 }
 
-static int bg_process_thread(void *data) {
-  int index = (int)(size_t)data;
+void tinyshell_cancel_queued_job(tinyshell *shell, int slot) {
+  int prev = -1;
+  for (int i = shell->queue_head; i >= 0;
+       prev = i, i = job_table_get(&shell->jobs, i)->next) {
+    if (i != slot) {
+      continue;
+    }
 
-  tinyshell_lock_bg_procs(current_shell);
-  process p = current_shell->bg[index].p;
-  tinyshell_unlock_bg_procs(current_shell);
+    int next = job_table_get(&shell->jobs, i)->next;
+    if (prev >= 0) {
+      job_table_get(&shell->jobs, prev)->next = next;
+    } else {
+      shell->queue_head = next;
+    }
+    if (shell->queue_tail == slot) {
+      shell->queue_tail = prev;
+    }
+    release_job(shell, slot);
+    return;
+  }
+}
 
-  int status_code;
-  if (!process_wait_for(&p, &status_code)) {
-    status_code = -1;
+void tinyshell_start_queued_jobs(tinyshell *shell) {
+  while (1) {
+    tinyshell_lock_bg_procs(shell);
+    if (shell->queue_head < 0 ||
+        (shell->max_jobs > 0 && shell->running_jobs >= shell->max_jobs)) {
+      tinyshell_unlock_bg_procs(shell);
+      return;
+    }
+
+    int slot = shell->queue_head;
+    bg_process *bg = job_table_get(&shell->jobs, slot);
+    shell->queue_head = bg->next;
+    if (shell->queue_head < 0) {
+      shell->queue_tail = -1;
+    }
+
+    pending_job *pending = bg->pending;
+    bg->pending = NULL;
+    char *error = NULL;
+    int id = bg->id;
+    int started =
+        spawn_job(shell, bg, &pending->ctx, pending->binary_paths,
+                  pending->env, &pending->parse_result, NULL, &error);
+    if (!started) {
+      output_notice("unable to start job %%%d: %s\n", id,
+                    error ? error : "unable to spawn process");
+      free(error);
+      bg->status_code = 127;
+      finish_job(shell, slot);
+    }
+    bg_stage *stages = bg->stages;
+    int stages_len = bg->stages_len;
+    tinyshell_unlock_bg_procs(shell);
+
+    free_pending_job(pending);
+    if (started) {
+      watch_job(shell, slot, id, stages, stages_len);
+    }
   }
+}
 
-  printf("job %%%d exited with error code %d\n", index + 1, status_code);
+// starts a background job, or queues it if max_jobs jobs are already running
+static void run_job(tinyshell *shell, const char *command,
+                    const char *const *binary_paths,
+                    command_parse_result *parse_result) {
+  update_jobs(shell);
+  env_block *env = env_get_block(&shell->env);
+  if (!env) {
+    output_printf("unable to allocate memory for the environment\n");
+    return;
+  }
 
-  tinyshell_lock_bg_procs(current_shell);
-  bg_process *bg = &current_shell->bg[index];
-  process_free(&bg->p);
-  free(bg->cmd);
-  bg->status = BG_PROCESS_FINISHED;
-  tinyshell_unlock_bg_procs(current_shell);
+  char *cmd = printf_to_string("%s", command);
+  tinyshell_lock_bg_procs(shell);
+  int slot = cmd ? job_table_add(&shell->jobs) : -1;
+  if (slot < 0) {
+    tinyshell_unlock_bg_procs(shell);
+    output_printf("unable to allocate a job for background process\n");
+    free(cmd);
+    return;
+  }
+
+  bg_process *bg = job_table_get(&shell->jobs, slot);
+  bg->cmd = cmd;
+  bg->stages = NULL;
+  bg->stages_len = 0;
+  bg->pending = NULL;
+  int id = bg->id;
+  if (shell->finished_cap < shell->jobs.len) {
+    int new_cap = shell->jobs.len * 2;
+    int *new_finished =
+        realloc(shell->finished, new_cap * sizeof *new_finished);
+    if (!new_finished) {
+      output_printf("unable to allocate memory for job\n");
+      release_job(shell, slot);
+      tinyshell_unlock_bg_procs(shell);
+      return;
+    }
+    shell->finished = new_finished;
+    shell->finished_cap = new_cap;
+  }
+
+  if (shell->max_jobs > 0 && shell->running_jobs >= shell->max_jobs) {
+    if (queue_job(shell, slot, binary_paths, env, parse_result)) {
+      output_printf("job %%%d queued: %s\n", id, command);
+    } else {
+      output_printf("unable to allocate memory for queued job\n");
+      release_job(shell, slot);
+    }
+    tinyshell_unlock_bg_procs(shell);
+    return;
+  }
 
-  return status_code;
+  char *error = NULL;
+  long long spawn_ns;
+  spawn_context ctx;
+  spawn_context_current(&ctx, shell);
+  if (!spawn_job(shell, bg, &ctx, binary_paths, env, parse_result, &spawn_ns,
+                 &error)) {
+    output_printf("%s\n", error ? error : "unable to spawn process");
+    free(error);
+    release_job(shell, slot);
+    tinyshell_unlock_bg_procs(shell);
+    return;
+  }
+
+  output_printf("job %%%d started: %s\n", id, command);
+  bg_stage *stages = bg->stages;
+  int stages_len = bg->stages_len;
+  tinyshell_unlock_bg_procs(shell);
+
+  tinyshell_record_spawn(shell, ctx.backend, spawn_ns, stages_len);
+  watch_job(shell, slot, id, stages, stages_len);
+}
+
+// The history is kept in $TINYSHELL_HISTORY (an empty value disables it), or
+// in ~/.tinyshell_history for interactive shells. A history which cannot be
+// opened is not an error, the shell just runs without it.
+static void open_history(tinyshell *shell) {
+  const char *path = env_get(&shell->env, "TINYSHELL_HISTORY");
+  char *default_path = NULL;
+  if (!path) {
+#ifdef _WIN32
+    const char *home = env_get(&shell->env, "USERPROFILE");
+#else
+    const char *home = env_get(&shell->env, "HOME");
+#endif
+    if (!home || !POSIX_WIN32(isatty)(POSIX_WIN32(fileno)(shell->input))) {
+      return;
+    }
+    default_path = printf_to_string("%s/.tinyshell_history", home);
+    path = default_path;
+  }
+
+  if (path && *path) {
+    shell->has_history = history_open(&shell->history, path);
+    if (!shell->has_history) {
+      output_printf("unable to open history file %s\n", path);
+    }
+  }
+  free(default_path);
 }
 
 // Ham nay de tao ra tinyshell moi
-int tinyshell_new(tinyshell *shell, FILE *input) {
+static int init_shell(tinyshell *shell, FILE *input, int batch) {
   current_shell = shell;
   signal(SIGINT, sigint_handler);
+  output_init();
   shell->has_fg = 0;
+  shell->last_status = 0;
+  shell->batch = batch;
+  shell->has_history = 0;
+  shell->has_editor = 0;
+  shell->fg = NULL;
+  shell->fg_len = 0;
+  shell->fg_usage = NULL;
   shell->exit = false;
-  shell->bg = NULL;
+  job_table_init(&shell->jobs);
   if (mtx_init(&shell->bg_lock, mtx_plain) != thrd_success) {
-    printf("unable to initialize jobs lock\n");
+    output_printf("unable to initialize jobs lock\n");
+    return 0;
+  }
+  shell->finished = NULL;
+  shell->finished_len = 0;
+  shell->finished_cap = 0;
+  atomic_int_store(&shell->has_finished, 0);
+  shell->max_jobs = processor_count();
+  shell->running_jobs = 0;
+  shell->queue_head = -1;
+  shell->queue_tail = -1;
+  if (!reaper_init(&shell->reaper, bg_process_exited, shell)) {
+    output_printf("unable to start jobs reaper\n");
+    mtx_destroy(&shell->bg_lock);
+    return 0;
+  }
+  env_init(&shell->env);
+  shell->pipe_size = 0;
+  shell->spawn_backend = 0;
+  memset(shell->spawn_stats, 0, sizeof shell->spawn_stats);
+  stats_reset(&shell->stats);
+  arena_init(&shell->arena);
+  shell->builtins = NULL;
+  shell->builtins_bucket_count = 0;
+  shell->builtins_len = 0;
+  script_cache_init(&shell->scripts, SCRIPT_CACHE_DEFAULT_CAP);
+  if (!exec_cache_init(&shell->exec_cache)) {
+    output_printf("unable to initialize executable cache\n");
+    reaper_destroy(&shell->reaper);
+    mtx_destroy(&shell->bg_lock);
     return 0;
   }
-  shell->bg_cap = 0;
-  shell->path = NULL;
   shell->input = input;
+  if (!line_reader_init(&shell->reader, POSIX_WIN32(fileno)(input))) {
+    output_printf("unable to allocate input buffer\n");
+    exec_cache_destroy(&shell->exec_cache);
+    reaper_destroy(&shell->reaper);
+    mtx_destroy(&shell->bg_lock);
+    return 0;
+  }
+  // processes started by the shell inherit the environment of the shell
+  if (!env_import(&shell->env, environ)) {
+    output_printf("unable to copy the environment\n");
+    env_destroy(&shell->env);
+    line_reader_destroy(&shell->reader);
+    exec_cache_destroy(&shell->exec_cache);
+    reaper_destroy(&shell->reaper);
+    mtx_destroy(&shell->bg_lock);
+    return 0;
+  }
+  if (batch) {
+    return 1;
+  }
+  open_history(shell);
+
+  // only interactive shells complete, so scripts never pay for the index
+  shell->has_editor =
+      line_editor_init(&shell->editor, POSIX_WIN32(fileno)(input));
+  if (shell->has_editor && !exec_index_init(&shell->exec_index)) {
+    output_printf("unable to initialize completion index\n");
+    line_editor_destroy(&shell->editor);
+    shell->has_editor = 0;
+  }
+  if (shell->has_editor &&
+      !exec_index_update(&shell->exec_index, tinyshell_get_path_env(shell))) {
+    output_printf("unable to build completion index\n");
+  }
   return 1;
 }
 
-static void process_command(tinyshell *shell, const char *command,
-                            int *status_code_ret);
+int tinyshell_new(tinyshell *shell, FILE *input) {
+  return init_shell(shell, input, 0);
+}
 
-static char *read_file(const char *path) {
-  FILE *f = NULL;
-  char *buffer = NULL;
+int tinyshell_new_batch(tinyshell *shell, FILE *input) {
+  return init_shell(shell, input, 1);
+}
 
-  f = fopen(path, "rb");
-  if (!f) {
-    printf("unable to open script file: %s\n", path);
-    return NULL;
+static void process_command(tinyshell *shell, const char *command,
+                            int *status_code_ret);
+static void run_command(tinyshell *shell, const char *command,
+                        command_parse_result *parse_result,
+                        int *status_code_ret);
+
+// run the script while reading it in blocks, so memory use does not depend on
+// the size of the script
+static int stream_script(tinyshell *shell, const char *path,
+                         int *status_code) {
+#ifdef _WIN32
+  int fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+  // the commands of the script may redirect any low descriptor
+  fd = redirect_move_fd_high(fd);
+  if (fd < 0) {
+    output_printf("unable to open script file: %s\n", path);
+    return 0;
   }
 
-  fseek(f, 0, SEEK_END);
-  int filesize = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
-  if (ferror(f) || filesize < 0) {
-    printf("unable to determine filesize of script file: %s\n", path);
-    goto fail;
+  line_reader reader;
+  if (!line_reader_init(&reader, fd)) {
+    output_printf("unable to allocate buffer for script file: %s\n", path);
+    POSIX_WIN32(close)(fd);
+    return 0;
   }
 
-  buffer = malloc(filesize + 1);
-  if (!buffer) {
-    printf("unable to allocate buffer for script file: %s\n", path);
-    goto fail;
+  char *line;
+  size_t len;
+  while (!shell->exit) {
+    long long start = monotonic_ns();
+    line = line_reader_next(&reader, &len);
+    stats_record(&shell->stats, STATS_READ_COMMAND, monotonic_ns() - start);
+    if (!line) {
+      break;
+    }
+    process_command(shell, line, status_code);
   }
 
-  if (fread(buffer, 1, filesize, f) != filesize || ferror(f)) {
-    printf("unable to read script file: %s\n", path);
-    goto fail;
+  if (reader.error) {
+    output_printf("unable to read script file: %s\n", path);
   }
 
-  fclose(f);
-
-  buffer[filesize] = '\0';
-  return buffer;
+  line_reader_destroy(&reader);
+  POSIX_WIN32(close)(fd);
+  return 1;
+}
 
-fail:
-  free(buffer);
-  if (f) {
-    fclose(f);
+static int run_script(tinyshell *shell, const char *path, int *status_code) {
+  script_cache_entry *entry;
+  switch (script_cache_acquire(&shell->scripts, path, &entry)) {
+  case SCRIPT_CACHE_OK:
+    for (int i = 0; i < entry->commands_len && !shell->exit; ++i) {
+      script_command *cmd = &entry->commands[i];
+      if (cmd->invalid || cmd->parse_result.expanded) {
+        process_command(shell, cmd->line, status_code);
+      } else {
+        run_command(shell, cmd->line, &cmd->parse_result, status_code);
+      }
+    }
+    script_cache_release(&shell->scripts, entry);
+    return 1;
+  case SCRIPT_CACHE_UNCACHED:
+    break;
+  case SCRIPT_CACHE_ERROR:
+    return 0;
   }
-  return NULL;
+
+  return stream_script(shell, path, status_code);
 }
 
-static int try_run_script(tinyshell *shell, const char *path,
+static int try_run_script(tinyshell *shell, const command_stage *stage,
                           int *status_code) {
+  const char *path = stage->argv[0];
 #ifdef _WIN32
   const char extension[] = ".tbat";
 #else
@@ -247,156 +637,450 @@ static int try_run_script(tinyshell *shell, const char *path,
     return 0;
   }
 
-  char *script_content = read_file(path);
-  if (!script_content) {
-    return 0;
+  // the commands of the script inherit the redirected descriptors
+  int *saved;
+  if (!redirect_stage_apply(stage, &shell->arena, &saved)) {
+    *status_code = 1;
+    return 1;
   }
 
-  char *saveptr;
-  for (char *cmd = reentrant_strtok(script_content, "\n", &saveptr); cmd;
-       cmd = reentrant_strtok(NULL, "\n", &saveptr)) {
-    process_command(shell, cmd, status_code);
-  }
+  int ran = run_script(shell, path, status_code);
+  redirect_stage_restore(stage, saved);
+  return ran;
+}
 
-  free(script_content);
-  return 1;
+static const char *lookup_variable(void *userdata, const char *name,
+                                   int len) {
+  tinyshell *shell = userdata;
+  return env_lookup(&shell->env, name, len);
 }
 
 static void process_command(tinyshell *shell, const char *command,
                             int *status_code_ret) {
+  // everything allocated for this command is released by rewinding here
+  arena_mark mark = arena_save(&shell->arena);
+
   command_parse_result parse_result;
   char *error_msg = NULL;
-  if (!parse_command(command, &parse_result, &error_msg)) {
+  // directory listings shared by the patterns of this command
+  glob_cache globs;
+  glob_cache_init(&globs);
+  parse_vars vars = {lookup_variable, shell, shell->last_status, &globs};
+  long long start = monotonic_ns();
+  int parsed = parse_command(command, &vars, &shell->arena, &parse_result,
+                             &error_msg);
+  glob_cache_destroy(&globs);
+  stats_record(&shell->stats, STATS_PARSE, monotonic_ns() - start);
+  if (!parsed) {
+    shell->last_status = 2;
     if (!error_msg) {
-      printf("invalid command\n");
+      output_printf("invalid command\n");
     } else {
-      printf("invalid command: %s\n", error_msg);
+      output_printf("invalid command: %s\n", error_msg);
     }
 
+    free(error_msg);
+    goto done;
+  }
+
+  run_command(shell, command, &parse_result, status_code_ret);
+
+done:
+  arena_rewind(&shell->arena, mark);
+}
+
+// `time <command>`, while `time` alone or followed by a strftime format is
+// the builtin printing the clock
+static int is_time_prefix(const command_parse_result *parse_result) {
+  return parse_result->argc >= 2 &&
+         strcmp(parse_result->argv[0], "time") == 0 &&
+         !strchr(parse_result->argv[1], '%');
+}
+
+// runs the command after `time` and prints what its foreground processes used
+static void run_timed_command(tinyshell *shell, const char *command,
+                              const command_parse_result *parse_result,
+                              int *status_code_ret) {
+  int stages_len = parse_result->stages_len;
+  command_stage *stages =
+      arena_alloc(&shell->arena, stages_len * sizeof *stages);
+  if (!stages) {
+    output_printf("unable to allocate memory for command\n");
     return;
   }
 
-  if (parse_result.argc == 0) {
-    goto fail;
+  memcpy(stages, parse_result->stages, stages_len * sizeof *stages);
+  ++stages[0].argv;
+  --stages[0].argc;
+  command_parse_result timed = *parse_result;
+  timed.argc = stages[0].argc;
+  timed.argv = stages[0].argv;
+  timed.stages = stages;
+
+  // a nested `time` also counts towards the outer one
+  process_usage usage = {0};
+  process_usage *outer = shell->fg_usage;
+  shell->fg_usage = &usage;
+  long long start = monotonic_ns();
+  run_command(shell, command, &timed, status_code_ret);
+  long long wall_ns = monotonic_ns() - start;
+  shell->fg_usage = outer;
+  if (outer) {
+    tinyshell_add_usage(outer, &usage);
+  }
+
+  // background jobs report their usage when they exit
+  if (parse_result->foreground) {
+    tinyshell_print_usage(&usage, wall_ns);
+    output_puts("");
+  }
+}
+
+// parse_result is not modified, it may come from the script cache
+static void run_command(tinyshell *shell, const char *command,
+                        command_parse_result *parse_result,
+                        int *status_code_ret) {
+  arena_mark mark = arena_save(&shell->arena);
+  if (parse_result->argc == 0) {
+    goto done;
+  }
+
+  if (is_time_prefix(parse_result)) {
+    run_timed_command(shell, command, parse_result, status_code_ret);
+    goto done;
   }
 
   int status_code = 0;
   const char *type = "builtin command";
-  if (try_run_builtin(shell, &parse_result, &status_code)) {
-    goto check_status_code;
-  }
+  int stages_len = parse_result->stages_len;
+  if (stages_len == 1) {
+    long long start = monotonic_ns();
+    if (try_run_builtin(shell, parse_result, &status_code)) {
+      stats_record(&shell->stats, STATS_BUILTIN, monotonic_ns() - start);
+      goto check_status_code;
+    }
 
-  type = "script";
-  if (try_run_script(shell, parse_result.argv[0], &status_code)) {
-    command_parse_result_free(&parse_result);
-    goto check_status_code;
+    type = "script";
+    if (try_run_script(shell, &parse_result->stages[0], &status_code)) {
+      goto check_status_code;
+    }
   }
 
   type = "process";
-  char *binary_path = find_executable(parse_result.argv[0], shell);
-  if (!binary_path) {
-    printf("executable not found: %s\n", parse_result.argv[0]);
+  const char **binary_paths =
+      arena_alloc(&shell->arena, stages_len * sizeof *binary_paths);
+  if (!binary_paths) {
+    output_printf("unable to allocate memory for pipeline\n");
     goto fail;
   }
 
-  int bg_job_index = -1;
-  if (!parse_result.foreground) {
-    if (!find_bg_job_index(shell, &bg_job_index)) {
-      printf("unable to determine job index for background process");
+  for (int i = 0; i < stages_len; ++i) {
+    const char *arg0 = parse_result->stages[i].argv[0];
+    if (stages_len > 1 && find_builtin(shell, arg0)) {
+      output_printf("builtin commands cannot be used in a pipeline: %s\n",
+                    arg0);
       goto fail;
     }
+
+    long long start = monotonic_ns();
+    binary_paths[i] = find_executable(arg0, shell, &shell->arena);
+    stats_record(&shell->stats, STATS_FIND_EXECUTABLE, monotonic_ns() - start);
+    if (!binary_paths[i]) {
+      output_printf("executable not found: %s\n", arg0);
+      goto fail;
+    }
+  }
+
+  // the processes write to the same descriptor
+  output_flush();
+  if (!parse_result->foreground) {
+    run_job(shell, command, binary_paths, parse_result);
+    goto check_status_code;
   }
 
-  process p;
-  if (!process_create(&p, binary_path, shell, command, &parse_result,
+  process *procs = arena_alloc(&shell->arena, stages_len * sizeof *procs);
+  if (!procs) {
+    output_printf("unable to allocate memory for pipeline\n");
+    goto fail;
+  }
+
+  env_block *env = env_get_block(&shell->env);
+  if (!env) {
+    output_printf("unable to allocate memory for the environment\n");
+    goto fail;
+  }
+
+  char *error_msg = NULL;
+  spawn_context ctx;
+  spawn_context_current(&ctx, shell);
+  long long spawn_start = monotonic_ns();
+  if (!process_create(procs, binary_paths, &ctx, env, command, parse_result,
                       &error_msg)) {
     if (error_msg != NULL) {
-      printf("%s\n", error_msg);
+      output_printf("%s\n", error_msg);
     } else {
-      printf("unable to spawn process\n");
+      output_printf("unable to spawn process\n");
     }
 
-    free(binary_path);
+    free(error_msg);
     goto fail;
   }
-
-  if (parse_result.foreground) {
-    shell->has_fg = 1;
-    shell->fg = p;
-    process_wait_for(&p, &status_code);
-    shell->has_fg = 0;
-    process_free(&p);
-  } else {
-    tinyshell_lock_bg_procs(shell);
-    printf("job %%%d started: %s", bg_job_index + 1, command);
-    bg_process *bg = &shell->bg[bg_job_index];
-    bg->p = p;
-    bg->status = BG_PROCESS_RUNNING;
-    bg->cmd = printf_to_string("%s", command);
-    // FIXME: properly allocate bg_job_index
-    thrd_create(&bg->thread, bg_process_thread, (void *)(size_t)bg_job_index);
-    tinyshell_unlock_bg_procs(shell);
+  tinyshell_record_spawn(shell, ctx.backend, monotonic_ns() - spawn_start,
+                         stages_len);
+
+  shell->fg = procs;
+  shell->fg_len = stages_len;
+  shell->has_fg = 1;
+  // the status of a pipeline is the status of its last stage
+  long long wait_start = monotonic_ns();
+  for (int i = 0; i < stages_len; ++i) {
+    process_usage usage;
+    if (process_wait_for(&procs[i], &status_code, &usage) && shell->fg_usage) {
+      tinyshell_add_usage(shell->fg_usage, &usage);
+    }
+  }
+  stats_record(&shell->stats, STATS_WAIT, monotonic_ns() - wait_start);
+  shell->has_fg = 0;
+  for (int i = 0; i < stages_len; ++i) {
+    process_free(&procs[i]);
   }
 
 check_status_code:
+  shell->last_status = status_code;
   if (status_code_ret) {
     *status_code_ret = status_code;
   } else {
     if (status_code != 0) {
-      printf("%s exited with error code %d\n", type, status_code);
+      output_printf("%s exited with error code %d\n", type, status_code);
     }
   }
+  goto done;
 
-  return;
+// the command could not be run
 fail:
-  command_parse_result_free(&parse_result);
+  shell->last_status = 127;
+
+done:
+  arena_rewind(&shell->arena, mark);
+}
+
+// `!!`, `!n`, `!-n` and `!prefix` at the start of the line are replaced by a
+// command from the history, the rest of the line is kept after it
+static char *expand_history(tinyshell *shell, const char *command) {
+  if (!shell->has_history) {
+    output_printf("history is disabled\n");
+    return NULL;
+  }
+
+  const char *event = command + 1;
+  size_t event_len = strcspn(event, " \t");
+  size_t digits = strspn(event + (event[0] == '-'), "0123456789");
+  char *found;
+  if (event_len == 1 && event[0] == '!') {
+    found = history_get(&shell->history, -1);
+  } else if (digits > 0 && digits + (event[0] == '-') == event_len) {
+    found = history_get(&shell->history, atoi(event));
+  } else {
+    found = history_find(&shell->history, event, event_len);
+  }
+
+  if (!found) {
+    output_printf("%.*s: event not found\n", (int)event_len + 1, command);
+    return NULL;
+  }
+
+  char *expanded = printf_to_string("%s%s", found, event + event_len);
+  free(found);
+  if (!expanded) {
+    output_printf("unable to allocate memory for command\n");
+  }
+  return expanded;
+}
+
+// like most shells, lines starting with a space are not saved
+static void add_to_history(tinyshell *shell, const char *command) {
+  if (!shell->has_history || command[0] == ' ' ||
+      command[strspn(command, " \t")] == '\0') {
+    return;
+  }
+
+  if (!history_add(&shell->history, command, strlen(command))) {
+    output_printf("unable to save the command to the history\n");
+  }
 }
 
 // Ham nay de chay tinyshell
 int tinyshell_run(tinyshell *shell) {
   while (!shell->exit) {
     update_jobs(shell);
+    output_print_notices();
+    // the line editor prints the prompt itself
+    const char *prompt = "tinyshell$ ";
+    if (!shell->has_editor && !shell->batch) {
 #ifdef _WIN32
-    char *cwd = get_current_directory();
-    printf("TS %s>", cwd);
-    free(cwd);
+      char *cwd = get_current_directory();
+      output_printf("TS %s>", cwd);
+      free(cwd);
 #else
-    printf("tinyshell$ ");
+      output_printf("%s", prompt);
 #endif
-    char *command = get_command(shell);
+      output_flush();
+    }
+    const char *command = get_command(shell, prompt);
+    if (shell->batch) {
+      // like the commands of a script, failures only show in $?
+      int status_code;
+      process_command(shell, command, &status_code);
+      continue;
+    }
+
     if (!POSIX_WIN32(isatty)(POSIX_WIN32(fileno)(shell->input))) {
-      puts(command);
+      output_puts(command);
     }
+
+    char *expanded = NULL;
+    if (command[0] == '!' && command[1] && !strchr(" \t", command[1])) {
+      expanded = expand_history(shell, command);
+      if (!expanded) {
+        shell->last_status = 1;
+        output_puts("");
+        continue;
+      }
+      // the expanded command is printed, and saved instead of the event
+      output_puts(expanded);
+      command = expanded;
+    }
+
+    add_to_history(shell, command);
     process_command(shell, command, NULL);
-    free(command);
-    puts("");
+    free(expanded);
+    output_puts("");
   }
 
   return 1;
 }
 
+void tinyshell_run_command(tinyshell *shell, const char *command) {
+  int status_code;
+  process_command(shell, command, &status_code);
+}
+
+int tinyshell_run_script(tinyshell *shell, const char *path) {
+  int status_code;
+  if (!run_script(shell, path, &status_code)) {
+    shell->last_status = 127;
+    return 0;
+  }
+  return 1;
+}
+
 void tinyshell_destroy(tinyshell *shell) {
   tinyshell_lock_bg_procs(shell);
-  for (int i = 0; i < shell->bg_cap; ++i) {
-    if (shell->bg[i].status == BG_PROCESS_EMPTY) {
-      continue;
-    }
-
-    if (shell->bg[i].status != BG_PROCESS_FINISHED) {
-      process_kill(&shell->bg[i].p);
+  // nothing may be started while the running jobs are shutting down
+  while (shell->queue_head >= 0) {
+    tinyshell_cancel_queued_job(shell, shell->queue_head);
+  }
+  for (int slot = shell->jobs.first; slot >= 0;) {
+    bg_process *bg = job_table_get(&shell->jobs, slot);
+    int status = atomic_int_load(&bg->status);
+    if (status == BG_PROCESS_RUNNING || status == BG_PROCESS_STOPPED) {
+      for (int j = 0; j < bg->stages_len; ++j) {
+        if (!atomic_int_load(&bg->stages[j].exited)) {
+          process_kill(&bg->stages[j].p);
+        }
+      }
     }
-
-    tinyshell_unlock_bg_procs(shell);
-    thrd_join(shell->bg[i].thread, NULL);
-    tinyshell_lock_bg_procs(shell);
+    slot = bg->live_next;
   }
   tinyshell_unlock_bg_procs(shell);
+
+  // waits for the killed jobs to exit
+  reaper_destroy(&shell->reaper);
+  update_jobs(shell);
   mtx_destroy(&shell->bg_lock);
 
-  free(shell->bg);
-  free(shell->path);
+  job_table_destroy(&shell->jobs);
+  free(shell->finished);
+  env_destroy(&shell->env);
+  exec_cache_destroy(&shell->exec_cache);
+  line_reader_destroy(&shell->reader);
+  if (shell->has_editor) {
+    line_editor_destroy(&shell->editor);
+    exec_index_destroy(&shell->exec_index);
+  }
+  if (shell->has_history) {
+    history_close(&shell->history);
+  }
+  arena_free(&shell->arena);
+  free_registered_builtins(shell);
+  script_cache_destroy(&shell->scripts);
+  output_destroy();
 }
 
 const char *tinyshell_get_path_env(const tinyshell *shell) {
-  return shell->path ? shell->path : "";
+  const char *path = env_get(&shell->env, "PATH");
+  return path ? path : "";
+}
+
+int tinyshell_set_env(tinyshell *shell, const char *name, const char *value) {
+  if (value) {
+    if (!env_set(&shell->env, name, value)) {
+      return 0;
+    }
+  } else if (!env_unset(&shell->env, name)) {
+    // was not set, nothing changed
+    return 1;
+  }
+
+  if (env_same_name(name, "PATH")) {
+    exec_cache_flush(&shell->exec_cache);
+    if (shell->has_editor &&
+        !exec_index_update(&shell->exec_index, tinyshell_get_path_env(shell))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void tinyshell_add_usage(process_usage *total, const process_usage *usage) {
+  total->user_us += usage->user_us;
+  total->sys_us += usage->sys_us;
+  if (usage->max_rss_kb > total->max_rss_kb) {
+    total->max_rss_kb = usage->max_rss_kb;
+  }
+  total->voluntary_switches += usage->voluntary_switches;
+  total->involuntary_switches += usage->involuntary_switches;
+}
+
+void tinyshell_print_usage(const process_usage *usage, long long wall_ns) {
+  output_printf("real %.3fs user %.3fs sys %.3fs maxrss %lldk csw %lld/%lld",
+                wall_ns / 1e9, usage->user_us / 1e6, usage->sys_us / 1e6,
+                usage->max_rss_kb, usage->voluntary_switches,
+                usage->involuntary_switches);
+}
+
+void tinyshell_job_usage(bg_process *job, process_usage *usage) {
+  memset(usage, 0, sizeof *usage);
+  for (int i = 0; i < job->stages_len; ++i) {
+    if (atomic_int_load(&job->stages[i].exited)) {
+      tinyshell_add_usage(usage, &job->stages[i].usage);
+    }
+  }
+}
+
+void tinyshell_record_spawn(tinyshell *shell, int backend, long long elapsed_ns,
+                            int processes) {
+  spawn_stats *stats = &shell->spawn_stats[backend];
+  long long per_process = elapsed_ns / processes;
+  if (stats->count == 0 || per_process < stats->min_ns) {
+    stats->min_ns = per_process;
+  }
+  if (per_process > stats->max_ns) {
+    stats->max_ns = per_process;
+  }
+  stats->count += processes;
+  stats->total_ns += elapsed_ns;
+
+  stats_record(&shell->stats, STATS_SPAWN, elapsed_ns);
+  stats_count(&shell->stats, STATS_SPAWNS, processes);
 }
@@ -1,39 +1,143 @@
 #pragma once
 
+#include "arena.h"
+#include "env.h"
+#include "exec_cache.h"
+#include "exec_index.h"
+#include "history.h"
+#include "job_table.h"
+#include "line_editor.h"
+#include "line_reader.h"
 #include "process.h"
+#include "script_cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <tinycthread.h>
 
+// latency of process_create with a spawn backend, per process
 typedef struct {
-  thrd_t thread;
-  process p;
-  char *cmd;
-  enum {
-    BG_PROCESS_RUNNING,
-    BG_PROCESS_STOPPED,
-    BG_PROCESS_EMPTY,
-    BG_PROCESS_FINISHED
-  } status;
-} bg_process;
+  long long count;
+  long long total_ns;
+  long long min_ns;
+  long long max_ns;
+} spawn_stats;
+
+#define SPAWN_BACKENDS_MAX 4
+
+typedef int (*tinyshell_builtin)(struct tinyshell *shell, int argc,
+                                 char *argv[]);
+
+typedef struct tinyshell_builtin_entry {
+  struct tinyshell_builtin_entry *next;
+  unsigned hash;
+  tinyshell_builtin func;
+  char name[];
+} tinyshell_builtin_entry;
 
 typedef struct tinyshell {
   int exit;
+  // created by tinyshell_new_batch
+  int batch;
   int has_fg;
-  process fg;
-  bg_process *bg;
+  // status code of the last command, $?
+  int last_status;
+  // processes of the foreground pipeline
+  process *fg;
+  int fg_len;
+  // when set by the `time` prefix, the usage of every foreground process is
+  // added to it
+  process_usage *fg_usage;
+  // background jobs, see job_table.h for what may be read without bg_lock
+  job_table jobs;
+  // protects the job queue, running_jobs and the finished list
   mtx_t bg_lock;
-  int bg_cap;
-  char *path;
+  reaper reaper;
+  // slots of jobs that exited but were not reported yet, in completion order,
+  // with room for every job in the table so the reaper thread never allocates
+  int *finished;
+  int finished_len;
+  int finished_cap;
+  // set once `finished` is not empty, so the prompt does not take the lock for
+  // nothing
+  atomic_int_t has_finished;
+  // at most max_jobs jobs run at once (0 for no limit), the others wait in a
+  // FIFO queue of slots linked through bg_process.next
+  int max_jobs;
+  // jobs started and not finished yet, including the stopped ones
+  int running_jobs;
+  int queue_head;
+  int queue_tail;
+  // exported to every process, PATH is also where executables are looked up
+  shell_env env;
+  exec_cache exec_cache;
+  // executables of the PATH, for completion, only valid if has_editor is set
+  exec_index exec_index;
+  // per-command allocations, see process_command
+  arena arena;
+  // commands registered with tinyshell_register_builtin
+  tinyshell_builtin_entry **builtins;
+  int builtins_bucket_count;
+  int builtins_len;
+  script_cache scripts;
+  // requested pipe buffer size for pipelines (Linux only), 0 for the default
+  int pipe_size;
+  // index into spawn_backends
+  int spawn_backend;
+  spawn_stats spawn_stats[SPAWN_BACKENDS_MAX];
+  // see the `stats` builtin
+  shell_stats stats;
+  // commands read by tinyshell_run, only valid if has_history is set
+  history history;
+  int has_history;
   FILE *input;
+  // commands are read from the file descriptor of `input` directly, bypassing
+  // the stdio buffer
+  line_reader reader;
+  // replaces `reader` when the input is a terminal
+  line_editor editor;
+  int has_editor;
 } tinyshell;
 
 int tinyshell_new(tinyshell *shell, FILE *input);
+// a shell for commands which are not typed by a user: tinyshell_run prints no
+// prompt, does not echo the commands nor add blank lines after them, there is
+// no history and no line editing, and failed commands only set last_status,
+// like the commands of a script
+int tinyshell_new_batch(tinyshell *shell, FILE *input);
 int tinyshell_run(tinyshell *shell);
+// runs one command line, like `tinyshell -c`
+void tinyshell_run_command(tinyshell *shell, const char *command);
+// runs the commands of a script, whatever its extension, returns 0 (with
+// last_status set to 127) if it cannot be read
+int tinyshell_run_script(tinyshell *shell, const char *path);
 void tinyshell_destroy(tinyshell *shell);
 
+// register an in-process command, which is run like the builtin commands
+// fails if `name` is already a builtin or was registered before
+int tinyshell_register_builtin(tinyshell *shell, const char *name,
+                               tinyshell_builtin func);
+
 const char *tinyshell_get_path_env(const tinyshell *shell);
+// sets the variable, or unsets it if `value` is NULL, flushing the executable
+// cache and rebuilding the completion index when PATH changes
+int tinyshell_set_env(tinyshell *shell, const char *name, const char *value);
+// `elapsed_ns` is the time process_create took to start `processes` processes,
+// on the shell thread
+void tinyshell_record_spawn(tinyshell *shell, int backend, long long elapsed_ns,
+                            int processes);
+// max_rss_kb keeps the largest of the two, the other fields are summed
+void tinyshell_add_usage(process_usage *total, const process_usage *usage);
+// prints `usage` on one line, without the newline
+void tinyshell_print_usage(const process_usage *usage, long long wall_ns);
+// usage of the stages of the job which exited, the others are not known yet
+void tinyshell_job_usage(bg_process *job, process_usage *usage);
 void tinyshell_lock_bg_procs(tinyshell* shell);
 void tinyshell_unlock_bg_procs(tinyshell* shell);
+// starts queued jobs while fewer than max_jobs jobs are running, must be called
+// without the jobs lock
+void tinyshell_start_queued_jobs(tinyshell *shell);
+// removes a queued job before it runs, with the jobs lock held
+void tinyshell_cancel_queued_job(tinyshell *shell, int slot);
 
 char *get_current_directory();
@@ -5,6 +5,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #define CONCAT(x, y) x##y
 #ifdef _WIN32
 #define POSIX_WIN32(func) CONCAT(_, func)
@@ -73,3 +80,44 @@ inline static int string_ends_with(const char *str, const char *suffix) {
   size_t str_len = strlen(str), suf_len = strlen(suffix);
   return str_len >= suf_len && strcmp(str + str_len - suf_len, suffix) == 0;
 }
+
+// 32-bit FNV-1a
+inline static unsigned hash_string(const char *str) {
+  unsigned hash = 2166136261u;
+  for (; *str; ++str) {
+    hash ^= (unsigned char)*str;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// nanoseconds since an arbitrary point, for measuring durations
+inline static long long monotonic_ns(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart / frequency.QuadPart * 1000000000LL +
+         counter.QuadPart % frequency.QuadPart * 1000000000LL /
+             frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// number of online processors, at least 1
+inline static int processor_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+#endif
+}
@@ -1,15 +1,44 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "tinyshell.h"
 
-int main() {
+static int usage(void) {
+  fprintf(stderr, "usage: tinyshell [-q | -c command | script]\n");
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  const char *command = NULL;
+  const char *script = NULL;
+  int quiet = 0;
+  if (argc == 2 && strcmp(argv[1], "-q") == 0) {
+    quiet = 1;
+  } else if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    command = argv[2];
+  } else if (argc == 2 && argv[1][0] != '-') {
+    script = argv[1];
+  } else if (argc != 1) {
+    return usage();
+  }
+
   tinyshell shell;
-  if(!tinyshell_new(&shell, stdin)) {
+  int batch = quiet || command || script;
+  if (!(batch ? tinyshell_new_batch(&shell, stdin)
+              : tinyshell_new(&shell, stdin))) {
     printf("unable to initialize tinyshell\n");
+    return 1;
   }
 
-  tinyshell_run(&shell);
-  tinyshell_destroy(&shell);
+  if (command) {
+    tinyshell_run_command(&shell, command);
+  } else if (script) {
+    tinyshell_run_script(&shell, script);
+  } else {
+    tinyshell_run(&shell);
+  }
 
-  return 0;
+  int status = shell.last_status;
+  tinyshell_destroy(&shell);
+  return status;
 }
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "tinyshell.h"
+
+#define SCRIPT_PATH "batch_test_script"
+#define OUTPUT_PATH "batch_test_output"
+#define STREAM_PATH "batch_test_stream"
+// longer than the blocks scripts are streamed in
+#define BLANK_LINE_LEN (100 * 1024)
+#ifdef _WIN32
+#define JOBS_SCRIPT "batch_test_jobs.tbat"
+#define JOB "ping 127.0.0.1 -n 1 &"
+#else
+#define JOBS_SCRIPT "./batch_test_jobs.tsh"
+#define JOB "sleep 0.1 &"
+#endif
+
+int main() {
+  // the commands are read from the input, and the last status is kept
+  FILE* input = tmpfile();
+  assert(input);
+  fputs("cd .\ncd /nonexistent/directory\n", input);
+  rewind(input);
+  tinyshell shell;
+  assert(tinyshell_new_batch(&shell, input));
+  assert(shell.batch && !shell.has_history && !shell.has_editor);
+  assert(tinyshell_run(&shell));
+  assert(shell.exit && shell.last_status == 1);
+  // the input ended
+  shell.exit = 0;
+
+  tinyshell_run_command(&shell, "cd .");
+  assert(shell.last_status == 0);
+
+  // exit stops the script, with its own status
+  FILE* script = fopen(SCRIPT_PATH, "w");
+  assert(script);
+  fputs("cd /nonexistent/directory\nexit 3\ncd .\n", script);
+  fclose(script);
+  assert(tinyshell_run_script(&shell, SCRIPT_PATH));
+  assert(shell.exit && shell.last_status == 3);
+  assert(remove(SCRIPT_PATH) == 0);
+
+  assert(!tinyshell_run_script(&shell, SCRIPT_PATH));
+  assert(shell.last_status == 127);
+
+  // without a prompt in between, every message of a job is a line of its own
+  shell.exit = 0;
+  script = fopen(JOBS_SCRIPT, "w");
+  assert(script);
+  fputs("maxjobs 1\n" JOB "\n" JOB "\n", script);
+  fclose(script);
+  tinyshell_run_command(&shell, JOBS_SCRIPT " > " OUTPUT_PATH);
+  assert(shell.last_status == 0);
+  FILE* output = fopen(OUTPUT_PATH, "r");
+  assert(output);
+  char text[256];
+  size_t len = fread(text, 1, sizeof text - 1, output);
+  text[len] = '\0';
+  fclose(output);
+  assert(strcmp(text, "job %1 started: " JOB "\njob %2 queued: " JOB "\n") ==
+         0);
+  assert(remove(JOBS_SCRIPT) == 0 && remove(OUTPUT_PATH) == 0);
+
+  // scripts larger than the cache are run while they are read, in order, and
+  // the last line needs no newline
+  shell.scripts.memory_cap = 16;
+  script = fopen(STREAM_PATH, "w");
+  assert(script);
+  fputs("export A=1\nexport A=${A}2\n", script);
+  for (int i = 0; i < BLANK_LINE_LEN; ++i) {
+    fputc(' ', script);
+  }
+  fputs("\nexport A=${A}3", script);
+  fclose(script);
+  assert(tinyshell_run_script(&shell, STREAM_PATH));
+  assert(!shell.exit && shell.last_status == 0);
+  assert(strcmp(env_get(&shell.env, "A"), "123") == 0);
+
+  script = fopen(STREAM_PATH, "w");
+  assert(script);
+  fputs("export A=4\nexit 5\nexport A=6\n", script);
+  fclose(script);
+  assert(tinyshell_run_script(&shell, STREAM_PATH));
+  assert(shell.exit && shell.last_status == 5);
+  assert(strcmp(env_get(&shell.env, "A"), "4") == 0);
+  assert(remove(STREAM_PATH) == 0);
+
+  shell.exit = 0;
+  assert(!tinyshell_run_script(&shell, STREAM_PATH));
+  assert(shell.last_status == 127);
+  tinyshell_destroy(&shell);
+  fclose(input);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "builtin.h"
+#include "tinyshell.h"
+
+static int greet_calls = 0;
+
+int builtin_greet(tinyshell* shell, int argc, char* argv[]) {
+  ++greet_calls;
+  return argc;
+}
+
+static int count_builtin(void* userdata, const char* name) {
+  ++*(int*)userdata;
+  return 1;
+}
+
+int main() {
+  tinyshell shell;
+  assert(tinyshell_new(&shell, stdin));
+
+  // every static builtin must have its own slot in the perfect hash table, and
+  // be listed here
+  const char* names[] = {"cd",   "pwd",  "date",   "time",    "exit",
+                         "help", "ls",   "dir",    "jobs",    "list",
+                         "kill", "stop", "resume", "addpath", "setpath",
+                         "path", "hash", "pipesize", "spawn",
+                         "maxjobs", "stats", "export", "unset", "env",
+                         "history"};
+  for (size_t i = 0; i < sizeof names / sizeof names[0]; ++i) {
+    assert(find_builtin(&shell, names[i]));
+  }
+  int count = 0;
+  assert(list_builtins(&shell, count_builtin, &count));
+  assert(count == sizeof names / sizeof names[0]);
+  assert(find_builtin(&shell, "ls") == find_builtin(&shell, "dir"));
+  assert(find_builtin(&shell, "jobs") == find_builtin(&shell, "list"));
+  assert(find_builtin(&shell, "greet") == NULL);
+  assert(find_builtin(&shell, "l") == NULL);
+
+  assert(tinyshell_register_builtin(&shell, "greet", builtin_greet));
+  assert(!tinyshell_register_builtin(&shell, "greet", builtin_greet));
+  assert(!tinyshell_register_builtin(&shell, "ls", builtin_greet));
+  assert(find_builtin(&shell, "greet") == builtin_greet);
+
+  // enough registrations to grow the table
+  char name[32];
+  for (int i = 0; i < 100; ++i) {
+    sprintf(name, "greet%d", i);
+    assert(tinyshell_register_builtin(&shell, name, builtin_greet));
+  }
+  assert(find_builtin(&shell, "greet42") == builtin_greet);
+
+  char* argv[] = {"greet", "a", "b", NULL};
+  command_stage stage = {3, argv, NULL, 0};
+  command_parse_result result = {3, argv, 1, &stage, 1};
+  int status_code = 0;
+  assert(try_run_builtin(&shell, &result, &status_code));
+  assert(status_code == 3 && greet_calls == 1);
+
+  tinyshell_destroy(&shell);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "env.h"
+
+int main() {
+  shell_env env;
+  env_init(&env);
+  assert(env_get(&env, "HOME") == NULL);
+
+  char* imported[] = {"HOME=/home/user", "A1=x=y", "=C:=C:\\", "B=", NULL};
+  assert(env_import(&env, imported));
+  assert(strcmp(env_get(&env, "HOME"), "/home/user") == 0);
+  assert(strcmp(env_get(&env, "A1"), "x=y") == 0);
+  assert(strcmp(env_get(&env, "B"), "") == 0);
+  assert(env.size == 3);
+
+  // sorted by name, and reused until a variable changes
+  env_block* block = env_get_block(&env);
+  assert(block && block->len == 3);
+  assert(strcmp(block->envp[0], "A1=x=y") == 0);
+  assert(strcmp(block->envp[1], "B=") == 0);
+  assert(strcmp(block->envp[2], "HOME=/home/user") == 0);
+  assert(block->envp[3] == NULL);
+  assert(env_get_block(&env) == block);
+
+  // a queued job keeps its snapshot after the change
+  env_block_acquire(block);
+  assert(env_set(&env, "HOME", "/root"));
+  assert(strcmp(env_get(&env, "HOME"), "/root") == 0);
+  assert(strcmp(block->envp[2], "HOME=/home/user") == 0);
+  env_block* changed = env_get_block(&env);
+  assert(changed && strcmp(changed->envp[2], "HOME=/root") == 0);
+  env_block_release(block);
+
+  assert(env_unset(&env, "A1"));
+  assert(!env_unset(&env, "A1"));
+  assert(env_get(&env, "A1") == NULL);
+  assert(env_get_block(&env)->len == 2);
+
+  // enough variables to grow the table
+  char name[32];
+  for (int i = 0; i < 200; ++i) {
+    sprintf(name, "VAR%d", i);
+    assert(env_set(&env, name, name));
+  }
+  assert(strcmp(env_get(&env, "VAR142"), "VAR142") == 0);
+  assert(env_get_block(&env)->len == 202);
+
+  assert(env_valid_name("_A1", 3));
+  assert(!env_valid_name("1A", 2));
+  assert(!env_valid_name("A-B", 3));
+  assert(!env_valid_name("", 0));
+
+  env_destroy(&env);
+  return 0;
+}
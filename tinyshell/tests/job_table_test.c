@@ -0,0 +1,55 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "tinyshell.h"
+
+int main() {
+  job_table t;
+  job_table_init(&t);
+  assert(job_table_find(&t, 1) == -1);
+
+  // enough jobs for several chunks and bucket resizes
+  int n = JOB_TABLE_CHUNK_SIZE * 3 + 7;
+  int* slots = malloc(n * sizeof(int));
+  bg_process** jobs = malloc(n * sizeof(bg_process*));
+  for (int i = 0; i < n; ++i) {
+    slots[i] = job_table_add(&t);
+    assert(slots[i] >= 0);
+    jobs[i] = job_table_get(&t, slots[i]);
+    atomic_int_store(&jobs[i]->status, BG_PROCESS_RUNNING);
+    assert(jobs[i]->id == i + 1);
+  }
+
+  // entries never move
+  for (int i = 0; i < n; ++i) {
+    assert(job_table_find(&t, i + 1) == slots[i]);
+    assert(job_table_get(&t, slots[i]) == jobs[i]);
+  }
+
+  // every other job exits, the others are still found
+  for (int i = 0; i < n; i += 2) {
+    job_table_remove(&t, slots[i]);
+  }
+  for (int i = 0; i < n; ++i) {
+    assert(job_table_find(&t, i + 1) == (i % 2 ? slots[i] : -1));
+  }
+
+  // the jobs are listed in id order
+  int expected_id = 2;
+  for (int slot = t.first; slot >= 0; slot = job_table_get(&t, slot)->live_next) {
+    assert(job_table_get(&t, slot)->id == expected_id);
+    expected_id += 2;
+  }
+  assert(t.len == n / 2);
+
+  // freed slots are reused, ids are not
+  int slot = job_table_add(&t);
+  assert(slot == slots[n - 1]);
+  assert(job_table_get(&t, slot)->id == n + 1);
+  assert(job_table_find(&t, n) == -1);
+  assert(job_table_find(&t, n + 1) == slot);
+
+  free(slots);
+  free(jobs);
+  job_table_destroy(&t);
+  return 0;
+}
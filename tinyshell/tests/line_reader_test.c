@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "line_reader.h"
+#include "utils.h"
+
+void check_line(line_reader* reader, const char* expected, size_t expected_len) {
+  size_t len;
+  char* line = line_reader_next(reader, &len);
+  assert(line);
+  assert(len == expected_len);
+  assert(memcmp(line, expected, len) == 0);
+  assert(line[len] == '\0');
+}
+
+int main() {
+  FILE* f = tmpfile();
+  assert(f);
+
+  // a line spanning several blocks
+  size_t long_len = 1000000;
+  char* long_line = malloc(long_len);
+  assert(long_line);
+  for (size_t i = 0; i < long_len; ++i) {
+    long_line[i] = 'a' + (char)(i % 26);
+  }
+
+  fputs("echo 123\n\n", f);
+  fwrite(long_line, 1, long_len, f);
+  fputs("\nsmall\nno trailing newline", f);
+  fflush(f);
+  rewind(f);
+
+  line_reader reader;
+  assert(line_reader_init(&reader, POSIX_WIN32(fileno)(f)));
+  check_line(&reader, "echo 123", 8);
+  check_line(&reader, "", 0);
+  check_line(&reader, long_line, long_len);
+  check_line(&reader, "small", 5);
+  check_line(&reader, "no trailing newline", 19);
+
+  size_t len;
+  assert(line_reader_next(&reader, &len) == NULL);
+  assert(!reader.error);
+  line_reader_destroy(&reader);
+
+  free(long_line);
+  fclose(f);
+  return 0;
+}
@@ -4,10 +4,26 @@
 #include <string.h>
 #include "parse_cmd.h"
 
+static const char* lookup(void* userdata, const char* name, int len) {
+  const char** defined = userdata;
+  for(; defined[0]; defined += 2) {
+    if((int)strlen(defined[0]) == len && strncmp(defined[0], name, len) == 0) {
+      return defined[1];
+    }
+  }
+  return NULL;
+}
+
+static const char* defined_vars[] = {"HOME", "/home/user", "A", "a b",
+                                     "EMPTY", "", "CMD", "ls", NULL};
+static parse_vars vars = {lookup, defined_vars, 3, NULL};
+
 void check_testcase_generic(const char* cmd, const char** argv, int fg) {
+  arena arena;
+  arena_init(&arena);
   command_parse_result result;
   char* error = NULL;
-  if(parse_command(cmd, &result, &error)) {
+  if(parse_command(cmd, &vars, &arena, &result, &error)) {
     assert(error == NULL && "error should not be set");
     int i = 0;
     while(1) {
@@ -21,13 +37,13 @@ void check_testcase_generic(const char* cmd, const char** argv, int fg) {
     }
 
     assert(result.foreground == fg || fg == -1);
-
-    command_parse_result_free(&result);
   } else {
     assert(argv == NULL);
     free(error);
   }
 
+  arena_free(&arena);
+
 }
 
 void check_testcase(const char* cmd, const char** argv) {
@@ -38,6 +54,62 @@ void check_testcase_bg(const char* cmd, const char** argv) {
   check_testcase_generic(cmd, argv, 0);
 }
 
+void check_pipeline(const char* cmd, int stages_len, const char*** stages) {
+  arena arena;
+  arena_init(&arena);
+  command_parse_result result;
+  char* error = NULL;
+  if(parse_command(cmd, &vars, &arena, &result, &error)) {
+    assert(stages && result.stages_len == stages_len);
+    assert(result.argv == result.stages[0].argv);
+    for(int s = 0; s < stages_len; ++s) {
+      int i = 0;
+      for(; stages[s][i]; ++i) {
+        assert(result.stages[s].argv[i]);
+        assert(strcmp(result.stages[s].argv[i], stages[s][i]) == 0);
+      }
+      assert(result.stages[s].argv[i] == NULL);
+      assert(result.stages[s].argc == i);
+    }
+  } else {
+    assert(stages == NULL);
+    free(error);
+  }
+
+  arena_free(&arena);
+}
+
+// redirections of the last stage
+void check_redirections(const char* cmd, const char** argv, int len,
+                        const redirection* expected) {
+  arena arena;
+  arena_init(&arena);
+  command_parse_result result;
+  char* error = NULL;
+  if(parse_command(cmd, &vars, &arena, &result, &error)) {
+    assert(argv);
+    command_stage* stage = &result.stages[result.stages_len - 1];
+    for(int i = 0; argv[i] || stage->argv[i]; ++i) {
+      assert(argv[i] && stage->argv[i]);
+      assert(strcmp(stage->argv[i], argv[i]) == 0);
+    }
+    assert(stage->redirections_len == len);
+    for(int i = 0; i < len; ++i) {
+      const redirection* r = &stage->redirections[i];
+      assert(r->type == expected[i].type);
+      assert(r->fd == expected[i].fd);
+      assert(r->target_fd == expected[i].target_fd);
+      assert((r->path == NULL) == (expected[i].path == NULL));
+      assert(!r->path || strcmp(r->path, expected[i].path) == 0);
+    }
+  } else {
+    assert(argv == NULL);
+    free(error);
+  }
+
+  arena_free(&arena);
+}
+
 int main() {
   check_testcase("", (const char*[]) {NULL});
   check_testcase("  ", (const char*[]) {NULL});
@@ -64,5 +136,75 @@ int main() {
   check_testcase("echo ^ ^", NULL);
 #endif
   check_testcase_bg("echo & ", (const char*[]){"echo", NULL});
+  check_testcase("echo a&", (const char*[]){"echo", "a", NULL});
+  check_testcase("echo & a", NULL);
+  check_testcase("echo \"&\" a", (const char*[]){"echo", "&", "a", NULL});
+
+  check_pipeline("echo a | tr a b", 2, (const char**[]){
+      (const char*[]){"echo", "a", NULL},
+      (const char*[]){"tr", "a", "b", NULL}});
+  check_pipeline("a|b|c &", 3, (const char**[]){
+      (const char*[]){"a", NULL},
+      (const char*[]){"b", NULL},
+      (const char*[]){"c", NULL}});
+  check_pipeline("echo \"a | b\"", 1, (const char**[]){
+      (const char*[]){"echo", "a | b", NULL}});
+  check_pipeline("echo a |", 0, NULL);
+  check_pipeline("| echo a", 0, NULL);
+  check_pipeline("echo a || b", 0, NULL);
+
+  check_redirections("ls -l > out.txt", (const char*[]){"ls", "-l", NULL}, 1,
+      (redirection[]){{REDIRECT_OUTPUT, 1, -1, "out.txt"}});
+  check_redirections("sort<in >>out 2>&1", (const char*[]){"sort", NULL}, 3,
+      (redirection[]){{REDIRECT_INPUT, 0, -1, "in"},
+                      {REDIRECT_APPEND, 1, -1, "out"},
+                      {REDIRECT_DUP, 2, 1, NULL}});
+  check_redirections("a | b 2> \"err file\" x", (const char*[]){"b", "x", NULL},
+      1, (redirection[]){{REDIRECT_OUTPUT, 2, -1, "err file"}});
+  check_redirections("echo \">\" 2", (const char*[]){"echo", ">", "2", NULL},
+      0, NULL);
+  check_redirections("echo a>b", (const char*[]){"echo", "a", NULL}, 1,
+      (redirection[]){{REDIRECT_OUTPUT, 1, -1, "b"}});
+  check_redirections("echo >", NULL, 0, NULL);
+  check_redirections("echo > | cat", NULL, 0, NULL);
+  check_redirections("echo 12>x", NULL, 0, NULL);
+  check_redirections("echo 2>&x", NULL, 0, NULL);
+
+  check_testcase("echo $HOME/x ${A}c", (const char*[]){"echo", "/home/user/x", "a bc", NULL});
+  check_testcase("echo $? ${?}1", (const char*[]){"echo", "3", "31", NULL});
+  check_testcase("echo \"$A\"", (const char*[]){"echo", "a b", NULL});
+  check_testcase("echo $UNSET $EMPTY x", (const char*[]){"echo", "x", NULL});
+  check_testcase("echo \"$EMPTY\" $EMPTY\"\"", (const char*[]){"echo", "", "", NULL});
+  check_testcase("$CMD -l", (const char*[]){"ls", "-l", NULL});
+  check_testcase("echo $ a$ $1 $-", (const char*[]){"echo", "$", "a$", "$1", "$-", NULL});
+  check_testcase("echo ${HOME", NULL);
+  check_testcase("echo ${}", NULL);
+  check_testcase("echo ${1}", NULL);
+  check_pipeline("$CMD|$CMD", 2, (const char**[]){
+      (const char*[]){"ls", NULL},
+      (const char*[]){"ls", NULL}});
+  check_pipeline("$EMPTY | ls", 0, NULL);
+  check_redirections("$CMD >$HOME/out", (const char*[]){"ls", NULL}, 1,
+      (redirection[]){{REDIRECT_OUTPUT, 1, -1, "/home/user/out"}});
+  check_redirections("ls > $EMPTY", NULL, 0, NULL);
+#ifndef _WIN32
+  check_testcase("echo '$HOME' \\$HOME \"'$A'\"", (const char*[]){"echo", "$HOME", "$HOME", "'a b'", NULL});
+  // patterns are kept as they are without a glob cache
+  check_testcase("ls *.c \"*\"x \"\\\\\"* \\[a]", (const char*[]){"ls", "*.c", "*x", "\\*", "[a]", NULL});
+  check_redirections("ls >*.txt", (const char*[]){"ls", NULL}, 1,
+      (redirection[]){{REDIRECT_OUTPUT, 1, -1, "*.txt"}});
+#endif
+
+  // arguments spanning several arena blocks
+  size_t long_len = 40000;
+  char* long_arg = malloc(long_len + 1);
+  char* long_cmd = malloc(long_len * 2 + 16);
+  assert(long_arg && long_cmd);
+  memset(long_arg, 'x', long_len);
+  long_arg[long_len] = '\0';
+  sprintf(long_cmd, "echo %s %s", long_arg, long_arg);
+  check_testcase(long_cmd, (const char*[]) {"echo", long_arg, long_arg, NULL});
+  free(long_arg);
+  free(long_cmd);
   return 0;
 }
@@ -0,0 +1,81 @@
+#include "builtin.h"
+#include "process.h"
+#include "tinyshell.h"
+#include "utils.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void create_file(const char *path, mode_t mode) {
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+  assert(fd >= 0);
+  close(fd);
+  assert(chmod(path, mode) == 0);
+}
+
+static void check_lookup(tinyshell *shell, const char *name,
+                         const char *expected) {
+  arena_mark mark = arena_save(&shell->arena);
+  const char *binary_path = find_executable(name, shell, &shell->arena);
+  if (expected) {
+    assert(binary_path && strcmp(binary_path, expected) == 0);
+  } else {
+    assert(binary_path == NULL);
+  }
+  arena_rewind(&shell->arena, mark);
+}
+
+int main() {
+  char first[] = "/tmp/tinyshell_exec_cache_XXXXXX";
+  char second[] = "/tmp/tinyshell_exec_cache_XXXXXX";
+  assert(mkdtemp(first) && mkdtemp(second));
+
+  tinyshell shell;
+  assert(tinyshell_new(&shell, stdin));
+
+  char *path = printf_to_string("%s:%s", first, second);
+  char *setpath_argv[] = {"setpath", path, NULL};
+  assert(builtin_setpath(&shell, 2, setpath_argv) == 0);
+  free(path);
+
+  char *in_first = printf_to_string("%s/prog", first);
+  char *in_second = printf_to_string("%s/prog", second);
+
+  // negative entries are invalidated when the file shows up
+  check_lookup(&shell, "prog", NULL);
+  check_lookup(&shell, "prog", NULL);
+  create_file(in_second, 0755);
+  check_lookup(&shell, "prog", in_second);
+  check_lookup(&shell, "prog", in_second);
+
+  // a new executable in an earlier directory shadows the cached one
+  create_file(in_first, 0644);
+  check_lookup(&shell, "prog", in_second);
+  assert(chmod(in_first, 0755) == 0);
+  check_lookup(&shell, "prog", in_first);
+
+  unlink(in_first);
+  check_lookup(&shell, "prog", in_second);
+  unlink(in_second);
+  check_lookup(&shell, "prog", NULL);
+
+  // prewarm and clear
+  create_file(in_first, 0755);
+  char *hash_argv[] = {"hash", "prog", NULL};
+  assert(builtin_hash(&shell, 2, hash_argv) == 0);
+  assert(shell.exec_cache.size == 1);
+  char *clear_argv[] = {"hash", "-r", NULL};
+  assert(builtin_hash(&shell, 2, clear_argv) == 0);
+  assert(shell.exec_cache.size == 0);
+  unlink(in_first);
+
+  free(in_first);
+  free(in_second);
+  rmdir(first);
+  rmdir(second);
+  tinyshell_destroy(&shell);
+  return 0;
+}
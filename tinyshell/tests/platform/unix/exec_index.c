@@ -0,0 +1,168 @@
+#include "completion.h"
+#include "exec_index.h"
+#include "tinyshell.h"
+#include "utils.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  char names[8][32];
+  int len;
+} name_list;
+
+static int collect(void *userdata, const char *name) {
+  name_list *list = userdata;
+  assert(list->len < 8 && strlen(name) < 32);
+  strcpy(list->names[list->len++], name);
+  return 1;
+}
+
+static void check_names(exec_index *index, const char *prefix,
+                        const char **expected) {
+  name_list list = {.len = 0};
+  assert(exec_index_complete(index, prefix, collect, &list));
+  int i = 0;
+  for (; expected[i]; ++i) {
+    assert(i < list.len && strcmp(list.names[i], expected[i]) == 0);
+  }
+  assert(list.len == i);
+}
+
+// the index is built on another thread
+static void wait_for(exec_index *index, const char *name) {
+  for (int i = 0; i < 500; ++i) {
+    name_list list = {.len = 0};
+    assert(exec_index_complete(index, name, collect, &list));
+    if (list.len > 0 && strcmp(list.names[0], name) == 0) {
+      return;
+    }
+    nanosleep(&(struct timespec){0, 10 * 1000 * 1000}, NULL);
+  }
+  assert(!"the index was not built");
+}
+
+static void create_file(const char *dir, const char *name, mode_t mode) {
+  char path[128];
+  sprintf(path, "%s/%s", dir, name);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+  assert(fd >= 0);
+  close(fd);
+  assert(chmod(path, mode) == 0);
+}
+
+static void remove_file(const char *dir, const char *name) {
+  char path[128];
+  sprintf(path, "%s/%s", dir, name);
+  assert(remove(path) == 0);
+}
+
+static void check_completion(tinyshell *shell, const char *line,
+                             const char *replacement,
+                             const char **candidates) {
+  completion c;
+  completion_init(&c);
+  assert(complete_line(shell, line, strlen(line), &c));
+  assert((c.replacement == NULL) == (replacement == NULL));
+  assert(!replacement || strcmp(c.replacement, replacement) == 0);
+  int i = 0;
+  for (; candidates[i]; ++i) {
+    assert(i < c.candidates_len && strcmp(c.candidates[i], candidates[i]) == 0);
+  }
+  assert(c.candidates_len == i);
+  completion_destroy(&c);
+}
+
+int main() {
+  char first[] = "/tmp/tinyshell_exec_index_XXXXXX";
+  char second[] = "/tmp/tinyshell_exec_index_XXXXXX";
+  assert(mkdtemp(first) && mkdtemp(second));
+  create_file(first, "tsfoo", 0755);
+  create_file(first, "tsfoobar", 0755);
+  create_file(first, "tsnotexec", 0644);
+  create_file(second, "tsfoo", 0755);
+  create_file(second, "tsbaz", 0755);
+
+  exec_index index;
+  assert(exec_index_init(&index));
+  check_names(&index, "ts", (const char *[]){NULL});
+  char *path = printf_to_string("%s:%s", first, second);
+  assert(path && exec_index_update(&index, path));
+  wait_for(&index, "tsbaz");
+  check_names(&index, "ts",
+              (const char *[]){"tsbaz", "tsfoo", "tsfoobar", NULL});
+  check_names(&index, "tsfoo", (const char *[]){"tsfoo", "tsfoobar", NULL});
+  check_names(&index, "tsq", (const char *[]){NULL});
+
+  // the previous trie is used until the new one is built
+  assert(exec_index_update(&index, second));
+  wait_for(&index, "tsbaz");
+  wait_for(&index, "tsfoo");
+  for (int i = 0; i < 500; ++i) {
+    name_list list = {.len = 0};
+    assert(exec_index_complete(&index, "tsfoob", collect, &list));
+    if (list.len == 0) {
+      break;
+    }
+    nanosleep(&(struct timespec){0, 10 * 1000 * 1000}, NULL);
+  }
+  check_names(&index, "ts", (const char *[]){"tsbaz", "tsfoo", NULL});
+  exec_index_destroy(&index);
+
+  // the shell only builds the index for a terminal, so it is set up here
+  tinyshell shell;
+  assert(tinyshell_new(&shell, stdin));
+  assert(!shell.has_editor);
+  assert(exec_index_init(&shell.exec_index));
+  assert(exec_index_update(&shell.exec_index, path));
+  wait_for(&shell.exec_index, "tsbaz");
+
+  check_completion(&shell, "tsf", "tsfoo", (const char *[]){"tsfoo",
+                   "tsfoobar", NULL});
+  check_completion(&shell, "ls | tsb", "tsbaz ", (const char *[]){"tsbaz",
+                   NULL});
+  // builtins are completed too
+  check_completion(&shell, "hist", "history ",
+                   (const char *[]){"history", NULL});
+  check_completion(&shell, "ex", NULL, (const char *[]){"exit", "export",
+                   NULL});
+
+  // other words are file names, with their directory hidden
+  char *line = printf_to_string("tsfoo %s/tsq", first);
+  check_completion(&shell, line, NULL, (const char *[]){NULL});
+  free(line);
+  line = printf_to_string("tsfoo %s/tsnot", first);
+  char *expected = printf_to_string("%s/tsnotexec ", first);
+  check_completion(&shell, line, expected, (const char *[]){"tsnotexec",
+                   NULL});
+  free(line);
+  free(expected);
+  line = printf_to_string("tsfoo %s/tsf", first);
+  expected = printf_to_string("%s/tsfoo", first);
+  check_completion(&shell, line, expected, (const char *[]){"tsfoo",
+                   "tsfoobar", NULL});
+  free(line);
+  free(expected);
+  // directories end with a slash, and the word goes on
+  line = printf_to_string("cd %s", first);
+  expected = printf_to_string("%s/", first);
+  check_completion(&shell, line, expected,
+                   (const char *[]){expected + strlen("/tmp/"), NULL});
+  free(line);
+  free(expected);
+  exec_index_destroy(&shell.exec_index);
+  tinyshell_destroy(&shell);
+  free(path);
+
+  remove_file(first, "tsfoo");
+  remove_file(first, "tsfoobar");
+  remove_file(first, "tsnotexec");
+  remove_file(second, "tsfoo");
+  remove_file(second, "tsbaz");
+  assert(rmdir(first) == 0 && rmdir(second) == 0);
+  return 0;
+}
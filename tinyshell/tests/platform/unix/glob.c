@@ -0,0 +1,116 @@
+#include "glob.h"
+#include "parse_cmd.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/tinyshell_glob_XXXXXX";
+
+static void create_file(const char *name) {
+  char path[128];
+  sprintf(path, "%s/%s", dir, name);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  assert(fd >= 0);
+  close(fd);
+}
+
+static void remove_file(const char *name) {
+  char path[128];
+  sprintf(path, "%s/%s", dir, name);
+  assert(remove(path) == 0);
+}
+
+typedef struct {
+  char matches[16][128];
+  int len;
+} match_list;
+
+static int collect(void *userdata, const char *path) {
+  match_list *list = userdata;
+  assert(list->len < 16);
+  // relative to the test directory
+  assert(strncmp(path, dir, strlen(dir)) == 0);
+  strcpy(list->matches[list->len++], path + strlen(dir) + 1);
+  return 1;
+}
+
+static void check_glob(glob_cache *cache, const char *pattern,
+                       const char **expected) {
+  char full[128];
+  sprintf(full, "%s/%s", dir, pattern);
+  match_list list = {.len = 0};
+  int matches = glob_expand(cache, full, collect, &list);
+  int i = 0;
+  for (; expected[i]; ++i) {
+    assert(i < list.len && strcmp(list.matches[i], expected[i]) == 0);
+  }
+  assert(matches == i && list.len == i);
+}
+
+int main() {
+  assert(mkdtemp(dir));
+  const char *files[] = {"b.c", "a.c", "c.h", ".hidden.c", "x[1]",
+                         "sub/z.c", "sub/y.txt", "sub2/w.c", NULL};
+  char path[128];
+  sprintf(path, "%s/sub", dir);
+  assert(mkdir(path, 0755) == 0);
+  sprintf(path, "%s/sub2", dir);
+  assert(mkdir(path, 0755) == 0);
+  for (int i = 0; files[i]; ++i) {
+    create_file(files[i]);
+  }
+
+  glob_cache cache;
+  glob_cache_init(&cache);
+  check_glob(&cache, "*.c", (const char *[]){"a.c", "b.c", NULL});
+  check_glob(&cache, "?.[ch]", (const char *[]){"a.c", "b.c", "c.h", NULL});
+  check_glob(&cache, ".*", (const char *[]){".hidden.c", NULL});
+  check_glob(&cache, "x\\[1]", (const char *[]){"x[1]", NULL});
+  check_glob(&cache, "x\\*", (const char *[]){NULL});
+  check_glob(&cache, "*.txt", (const char *[]){NULL});
+  check_glob(&cache, "sub*/*.c", (const char *[]){"sub/z.c", "sub2/w.c", NULL});
+  check_glob(&cache, "*/y.txt", (const char *[]){"sub/y.txt", NULL});
+  check_glob(&cache, "*/", (const char *[]){"sub/", "sub2/", NULL});
+
+  // the listings are reused for the lifetime of the cache
+  create_file("d.c");
+  check_glob(&cache, "*.c", (const char *[]){"a.c", "b.c", NULL});
+  glob_cache_destroy(&cache);
+  glob_cache_init(&cache);
+  check_glob(&cache, "*.c", (const char *[]){"a.c", "b.c", "d.c", NULL});
+
+  // patterns in commands, with the parts to match literally quoted
+  char command[256];
+  sprintf(command, "ls %s/*.h '%s/*.c' %s/\"x[\"* %s/*.none", dir, dir, dir,
+          dir);
+  arena arena;
+  arena_init(&arena);
+  parse_vars vars = {NULL, NULL, 0, &cache};
+  command_parse_result result;
+  char *error = NULL;
+  assert(parse_command(command, &vars, &arena, &result, &error));
+  assert(result.expanded && result.argc == 5);
+  sprintf(path, "%s/c.h", dir);
+  assert(strcmp(result.argv[1], path) == 0);
+  sprintf(path, "%s/*.c", dir);
+  assert(strcmp(result.argv[2], path) == 0);
+  sprintf(path, "%s/x[1]", dir);
+  assert(strcmp(result.argv[3], path) == 0);
+  sprintf(path, "%s/*.none", dir);
+  assert(strcmp(result.argv[4], path) == 0);
+  arena_free(&arena);
+  glob_cache_destroy(&cache);
+
+  for (int i = 0; files[i]; ++i) {
+    remove_file(files[i]);
+  }
+  remove_file("d.c");
+  remove_file("sub");
+  remove_file("sub2");
+  assert(rmdir(dir) == 0);
+  return 0;
+}
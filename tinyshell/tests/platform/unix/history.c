@@ -0,0 +1,219 @@
+#include "history.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  int numbers[8];
+  char commands[8][64];
+  int len;
+} entry_list;
+
+static int collect(void *userdata, int number, const char *command,
+                   size_t len) {
+  entry_list *list = userdata;
+  assert(list->len < 8 && len < 64);
+  list->numbers[list->len] = number;
+  memcpy(list->commands[list->len], command, len);
+  list->commands[list->len][len] = '\0';
+  ++list->len;
+  return 1;
+}
+
+static void check_list(history *h, const char *prefix, int count,
+                       const char **expected) {
+  entry_list list = {.len = 0};
+  assert(history_list(h, prefix, strlen(prefix), count, collect, &list));
+  int i = 0;
+  for (; expected[i]; ++i) {
+    assert(i < list.len && strcmp(list.commands[i], expected[i]) == 0);
+  }
+  assert(list.len == i);
+}
+
+static void check_find(history *h, const char *prefix, const char *expected) {
+  char *found = history_find(h, prefix, strlen(prefix));
+  assert((found == NULL) == (expected == NULL));
+  assert(!found || strcmp(found, expected) == 0);
+  free(found);
+}
+
+// replaces the history with one line of `size` bytes
+static void write_line(const char *path, char c, long size) {
+  FILE *log = fopen(path, "w");
+  assert(log);
+  for (long i = 0; i + 1 < size; ++i) {
+    fputc(c, log);
+  }
+  fputc('\n', log);
+  fclose(log);
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  return (long)st.st_size;
+}
+
+// fills both tables of the index, keeping its header valid: the tables follow
+// the 48-byte header and the 32-byte records, whose capacity is at byte 28
+static void fill_tables(const char *index_path) {
+  FILE *index = fopen(index_path, "r+");
+  uint32_t records_cap;
+  assert(index && fseek(index, 28, SEEK_SET) == 0 &&
+         fread(&records_cap, sizeof records_cap, 1, index) == 1);
+  long start = 48 + (long)records_cap * 32;
+  long size = file_size(index_path);
+  assert(start < size && fseek(index, start, SEEK_SET) == 0);
+  for (long i = start; i < size; ++i) {
+    fputc(1, index);
+  }
+  fclose(index);
+}
+
+static void add(history *h, const char *command) {
+  assert(history_add(h, command, strlen(command)));
+}
+
+int main() {
+  char dir[] = "/tmp/tinyshell_history_XXXXXX";
+  assert(mkdtemp(dir));
+  char path[64], index_path[64];
+  sprintf(path, "%s/history", dir);
+  sprintf(index_path, "%s/history.idx", dir);
+
+  history h;
+  assert(history_open(&h, path));
+  check_list(&h, "", 0, (const char *[]){NULL});
+  check_find(&h, "ls", NULL);
+  assert(history_get(&h, -1) == NULL);
+
+  add(&h, "ls -l");
+  add(&h, "make");
+  add(&h, "ls -la /tmp/some/long/path");
+  add(&h, "make");
+  check_find(&h, "l", "ls -la /tmp/some/long/path");
+  check_find(&h, "ls -l", "ls -la /tmp/some/long/path");
+  // longer than the longest indexed prefix
+  check_find(&h, "ls -la /tmp/some/", "ls -la /tmp/some/long/path");
+  check_find(&h, "ls -la /tmp/other", NULL);
+  check_find(&h, "mak", "make");
+  check_find(&h, "", "make");
+
+  // the same command again is moved to the end, and listed once
+  add(&h, "ls -l");
+  check_list(&h, "", 0,
+             (const char *[]){"ls -la /tmp/some/long/path", "make", "ls -l",
+                              NULL});
+  check_list(&h, "", 2, (const char *[]){"make", "ls -l", NULL});
+  check_list(&h, "ls", 0,
+             (const char *[]){"ls -la /tmp/some/long/path", "ls -l", NULL});
+  check_find(&h, "ls -l", "ls -l");
+  char *command = history_get(&h, 1);
+  assert(command && strcmp(command, "ls -l") == 0);
+  free(command);
+  command = history_get(&h, -2);
+  assert(command && strcmp(command, "make") == 0);
+  free(command);
+
+  // another shell sees the commands, and adds to the same history
+  history other;
+  assert(history_open(&other, path));
+  check_find(&other, "m", "make");
+  add(&other, "make test");
+  check_find(&h, "m", "make test");
+  history_close(&other);
+
+  // enough commands to grow the index
+  char line[32];
+  for (int i = 0; i < 5000; ++i) {
+    sprintf(line, "echo %d", i);
+    add(&h, line);
+  }
+  check_find(&h, "echo 12", "echo 1299");
+  check_find(&h, "echo 4999", "echo 4999");
+  check_find(&h, "ls -la", "ls -la /tmp/some/long/path");
+  check_list(&h, "echo 499", 2,
+             (const char *[]){"echo 4998", "echo 4999", NULL});
+  history_close(&h);
+
+  // lines written without the index, including a partial one, are indexed
+  // when the history is opened
+  FILE *log = fopen(path, "a");
+  assert(log);
+  fputs("cat a\ncat", log);
+  fclose(log);
+  assert(history_open(&h, path));
+  check_find(&h, "c", "cat a");
+  add(&h, "pwd");
+  check_list(&h, "", 3, (const char *[]){"cat a", "cat", "pwd", NULL});
+  history_close(&h);
+
+  // an invalid index is rebuilt from the history
+  FILE *index = fopen(index_path, "w");
+  assert(index);
+  fputs("garbage", index);
+  fclose(index);
+  assert(history_open(&h, path));
+  check_find(&h, "make", "make test");
+  check_list(&h, "ca", 0, (const char *[]){"cat a", "cat", NULL});
+  history_close(&h);
+
+  // so is an index whose tables have no empty slot left, when a lookup goes
+  // through a whole table
+  fill_tables(index_path);
+  assert(history_open(&h, path));
+  check_find(&h, "make", "make test");
+  check_list(&h, "ca", 0, (const char *[]){"cat a", "cat", NULL});
+  history_close(&h);
+  fill_tables(index_path);
+  assert(history_open(&h, path));
+  check_list(&h, "ca", 0, (const char *[]){"cat a", "cat", NULL});
+  add(&h, "cat b");
+  history_close(&h);
+  fill_tables(index_path);
+  assert(history_open(&h, path));
+  add(&h, "cat c");
+  check_find(&h, "cat", "cat c");
+  check_list(&h, "ca", 0,
+             (const char *[]){"cat a", "cat", "cat b", "cat c", NULL});
+  history_close(&h);
+
+  // a history rewritten to the same size, or larger, is indexed again
+  long size = file_size(path);
+  write_line(path, 'a', size);
+  assert(history_open(&h, path));
+  command = history_get(&h, -1);
+  assert(command && strlen(command) == (size_t)size - 1 && command[0] == 'a');
+  free(command);
+  history_close(&h);
+  write_line(path, 'b', size + 10);
+  assert(history_open(&h, path));
+  command = history_get(&h, 1);
+  assert(command && strlen(command) == (size_t)size + 9 && command[0] == 'b');
+  free(command);
+  assert(history_get(&h, 2) == NULL);
+  history_close(&h);
+
+  // a corrupt record offset gives an empty command, the records follow the
+  // 48-byte header and start with their offset
+  index = fopen(index_path, "r+");
+  assert(index && fseek(index, 48, SEEK_SET) == 0);
+  fputs("\xff\xff\xff\xff\xff\xff\xff\x7f", index);
+  fclose(index);
+  assert(history_open(&h, path));
+  command = history_get(&h, 1);
+  assert(command && strcmp(command, "") == 0);
+  free(command);
+  check_find(&h, "b", NULL);
+  history_close(&h);
+
+  assert(remove(path) == 0);
+  assert(remove(index_path) == 0);
+  assert(rmdir(dir) == 0);
+  return 0;
+}
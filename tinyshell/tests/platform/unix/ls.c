@@ -1,12 +1,20 @@
+#define _XOPEN_SOURCE 700
+#include "ls.h"
+#include "output.h"
 #include "parse_cmd.h"
 #include "process.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 
-int main() {
-  tinyshell shell;
+static void spawn_ls(void) {
+  spawn_context ctx = {{0, 1, 2}, NULL, 0, 0};
   process p;
   command_parse_result cpr;
   cpr.argc = 2;
@@ -15,12 +23,316 @@ int main() {
   cpr.argv[1] = strdup("-la");
   cpr.argv[2] = NULL;
   cpr.foreground = 0;
+  command_stage stage = {cpr.argc, cpr.argv, NULL, 0};
+  cpr.stages = &stage;
+  cpr.stages_len = 1;
+  shell_env env;
+  env_init(&env);
+  assert(env_set(&env, "LC_ALL", "C"));
   char* error;
-  int status = process_create(&p, strdup("/bin/ls"), &shell, "/bin/ls -la", &cpr, &error);
+  int status = process_create(&p, (const char *const[]){"/bin/ls"}, &ctx, env_get_block(&env), "/bin/ls -la", &cpr, &error);
   assert(status);
   int code = 0;
-  status = process_wait_for(&p, &code);
+  status = process_wait_for(&p, &code, NULL);
   assert(status && code == 0);
   process_free(&p);
+  env_destroy(&env);
+  free(cpr.argv[0]);
+  free(cpr.argv[1]);
+  free(cpr.argv);
+}
+
+// text appended to a growing buffer
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} text;
+
+static void append(text *t, const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int len = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  while (t->cap < t->len + len + 1) {
+    t->cap = t->cap ? t->cap * 2 : 4096;
+    t->data = realloc(t->data, t->cap);
+    assert(t->data);
+  }
+  va_start(va, fmt);
+  vsnprintf(t->data + t->len, len + 1, fmt, va);
+  va_end(va);
+  t->len += len;
+}
+
+// what exec_ls prints, with the shell output sent to a file
+static char *run_ls(const char *dir, int flags, int *status_code) {
+  FILE *file = tmpfile();
+  assert(file);
+  output_flush();
+  int saved = dup(1);
+  assert(saved >= 0 && dup2(fileno(file), 1) == 1);
+  *status_code = exec_ls(dir, flags);
+  output_flush();
+  assert(dup2(saved, 1) == 1);
+  close(saved);
+
+  off_t size = lseek(fileno(file), 0, SEEK_END);
+  assert(size >= 0 && lseek(fileno(file), 0, SEEK_SET) == 0);
+  char *output = malloc(size + 1);
+  assert(output && read(fileno(file), output, size) == size);
+  output[size] = '\0';
+  fclose(file);
+  return output;
+}
+
+static void make_dir(const char *root, const char *name) {
+  char path[256];
+  snprintf(path, sizeof path, "%s/%s", root, name);
+  assert(mkdir(path, 0755) == 0);
+}
+
+static void make_file(const char *path, const char *content) {
+  FILE *file = fopen(path, "w");
+  assert(file);
+  fputs(content, file);
+  fclose(file);
+}
+
+static int remove_entry(const char *path, const struct stat *s, int flag,
+                        struct FTW *ftw) {
+  return remove(path);
+}
+
+static void remove_tree(const char *dir) {
+  assert(nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0);
+}
+
+// more directories than are read ahead of the printer, a few levels deep, most
+// of them empty
+#define TREE_DIRS 300
+
+static void check_recursive(void) {
+  char root[] = "/tmp/tinyshell_ls_XXXXXX";
+  assert(mkdtemp(root));
+  char path[256];
+  for (int i = 0; i < TREE_DIRS; ++i) {
+    snprintf(path, sizeof path, "d%03d", i);
+    make_dir(root, path);
+  }
+  make_dir(root, "d000/deep");
+  make_dir(root, "d000/deep/deeper");
+  snprintf(path, sizeof path, "%s/d000/deep/f", root);
+  make_file(path, "1234\n");
+  snprintf(path, sizeof path, "%s/top", root);
+  make_file(path, "abc\n");
+
+  // depth-first, sorted by name
+  text expected = {NULL, 0, 0};
+  append(&expected, "%s:\ntotal %d\n.\n..\n", root, TREE_DIRS + 3);
+  for (int i = 0; i < TREE_DIRS; ++i) {
+    append(&expected, "d%03d\n", i);
+  }
+  append(&expected, "top\n");
+  append(&expected, "\n%s/d000:\ntotal 3\n.\n..\ndeep\n", root);
+  append(&expected, "\n%s/d000/deep:\ntotal 4\n.\n..\ndeeper\nf\n", root);
+  append(&expected, "\n%s/d000/deep/deeper:\ntotal 2\n.\n..\n", root);
+  for (int i = 1; i < TREE_DIRS; ++i) {
+    append(&expected, "\n%s/d%03d:\ntotal 2\n.\n..\n", root, i);
+  }
+  append(&expected, "\n%d directories, %d entries, %d bytes in files\n",
+         TREE_DIRS + 3, TREE_DIRS + 4, 9);
+
+  // the workers finish in a different order every time
+  for (int run = 0; run < 3; ++run) {
+    int status_code;
+    char *output = run_ls(root, LS_RECURSIVE, &status_code);
+    assert(status_code == 0);
+    assert(strcmp(output, expected.data) == 0);
+    free(output);
+  }
+  free(expected.data);
+
+  remove_tree(root);
+  int status_code;
+  char *output = run_ls(root, LS_RECURSIVE, &status_code);
+  assert(status_code == 1);
+  free(output);
+}
+
+// one line of `ls -l`
+typedef struct {
+  char mode[16];
+  char user[64];
+  char group[64];
+  char name[256];
+} details_line;
+
+static const char *parse_details(const char *line, details_line *d) {
+  long links;
+  long long size;
+  char date[32];
+  int len;
+  assert(sscanf(line, "%15s %ld %63s %63s %lld %31s %255s\n%n", d->mode,
+                &links, d->user, d->group, &size, date, d->name, &len) == 7);
+  return line + len;
+}
+
+// enough entries for the stats to be split between threads (if there is more
+// than one processor)
+#define DETAILS_FILES 2100
+
+static void check_details(void) {
+  char root[] = "/tmp/tinyshell_ls_XXXXXX";
+  assert(mkdtemp(root));
+  char path[256];
+  for (int i = 0; i < DETAILS_FILES; ++i) {
+    snprintf(path, sizeof path, "%s/f%04d", root, i);
+    make_file(path, "");
+  }
+  // the names of unknown ids are their number
+  int as_root = geteuid() == 0;
+  snprintf(path, sizeof path, "%s/orphan", root);
+  make_file(path, "");
+  if (as_root) {
+    assert(chown(path, 54321, 54322) == 0);
+  }
+  // not followed, so not an error
+  snprintf(path, sizeof path, "%s/dangling", root);
+  assert(symlink("missing", path) == 0);
+
+  int status_code;
+  char *output = run_ls(root, LS_DETAILS, &status_code);
+  assert(status_code == 0);
+  int total;
+  const char *line = output;
+  int len;
+  assert(sscanf(line, "total %d\n%n", &total, &len) == 1);
+  assert(total == DETAILS_FILES + 4);
+  line += len;
+
+  char previous[256] = "";
+  int files = 0, orphans = 0, links = 0;
+  for (int i = 0; i < total; ++i) {
+    details_line d;
+    line = parse_details(line, &d);
+    assert(strcmp(previous, d.name) < 0);
+    strcpy(previous, d.name);
+    files += d.name[0] == 'f' && d.mode[0] == '-';
+    if (strcmp(d.name, "orphan") == 0) {
+      ++orphans;
+      assert(!as_root ||
+             (strcmp(d.user, "54321") == 0 && strcmp(d.group, "54322") == 0));
+    }
+    if (strcmp(d.name, "dangling") == 0) {
+      ++links;
+      assert(d.mode[0] == 'l');
+    }
+  }
+  assert(*line == '\0');
+  assert(files == DETAILS_FILES && orphans == 1 && links == 1);
+  free(output);
+  remove_tree(root);
+}
+
+// long names, so the names take more than the first 4096-byte buffer and the
+// entries more than one 256 KiB getdents64 call
+#define LARGE_FILES 3500
+#define LARGE_NAME_LEN 64
+
+static void large_name(char *name, int i) {
+  snprintf(name, LARGE_NAME_LEN + 1, "n%04d", i);
+  memset(name + 5, 'x', LARGE_NAME_LEN - 5);
+  name[LARGE_NAME_LEN] = '\0';
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// the names in `output`, one per line or at the end of `ls -l` lines, are
+// . and .. and every large name, once
+static void check_large_names(const char *output, int details) {
+  int cap = LARGE_FILES + 2;
+  char **names = malloc(cap * sizeof *names);
+  assert(names);
+  int len = 0;
+  for (const char *line = output; *line;) {
+    assert(len < cap);
+    if (details) {
+      details_line d;
+      line = parse_details(line, &d);
+      names[len++] = strdup(d.name);
+    } else {
+      const char *end = strchr(line, '\n');
+      assert(end);
+      names[len++] = strndup(line, end - line);
+      line = end + 1;
+    }
+  }
+  assert(len == cap);
+  qsort(names, len, sizeof *names, compare_strings);
+
+  assert(strcmp(names[0], ".") == 0 && strcmp(names[1], "..") == 0);
+  char name[LARGE_NAME_LEN + 1];
+  for (int i = 0; i < LARGE_FILES; ++i) {
+    large_name(name, i);
+    assert(strcmp(names[i + 2], name) == 0);
+  }
+  for (int i = 0; i < len; ++i) {
+    free(names[i]);
+  }
+  free(names);
+}
+
+static void check_large_directory(void) {
+  char root[] = "/tmp/tinyshell_ls_XXXXXX";
+  assert(mkdtemp(root));
+  char name[LARGE_NAME_LEN + 1];
+  char path[256];
+  for (int i = 0; i < LARGE_FILES; ++i) {
+    large_name(name, i);
+    snprintf(path, sizeof path, "%s/%s", root, name);
+    make_file(path, "");
+  }
+
+  // sorted, after the total
+  int status_code;
+  char *output = run_ls(root, 0, &status_code);
+  assert(status_code == 0);
+  int len;
+  int total;
+  assert(sscanf(output, "total %d\n%n", &total, &len) == 1);
+  assert(total == LARGE_FILES + 2);
+  assert(strncmp(output + len, ".\n..\n", 5) == 0);
+  const char *line = output + len + 5;
+  for (int i = 0; i < LARGE_FILES; ++i) {
+    large_name(name, i);
+    assert(strncmp(line, name, LARGE_NAME_LEN) == 0 &&
+           line[LARGE_NAME_LEN] == '\n');
+    line += LARGE_NAME_LEN + 1;
+  }
+  assert(*line == '\0');
+  free(output);
+
+  // streamed in directory order, without a total
+  output = run_ls(root, LS_UNSORTED, &status_code);
+  assert(status_code == 0 && strncmp(output, "total", 5) != 0);
+  check_large_names(output, 0);
+  free(output);
+  output = run_ls(root, LS_UNSORTED | LS_DETAILS, &status_code);
+  assert(status_code == 0 && strncmp(output, "total", 5) != 0);
+  check_large_names(output, 1);
+  free(output);
+  remove_tree(root);
+}
+
+int main() {
+  output_init();
+  spawn_ls();
+  check_recursive();
+  check_details();
+  check_large_directory();
+  output_destroy();
   return 0;
 }
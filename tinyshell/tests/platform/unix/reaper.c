@@ -0,0 +1,97 @@
+#include "process.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHILDREN 4
+
+static atomic_int_t exited;
+static int statuses[CHILDREN];
+
+static void on_exit_cb(void *userdata, int job, int stage, int status_code,
+                       const process_usage *usage) {
+  statuses[job] = status_code;
+  atomic_int_fetch_add(&exited, 1);
+}
+
+// a child which exited, and is not reaped yet
+static process exited_child(int status_code) {
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    _exit(status_code);
+  }
+  siginfo_t info;
+  assert(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0);
+  return pid;
+}
+
+static void wait_for_children(int count) {
+  for (int i = 0; i < 500 && atomic_int_load(&exited) < count; ++i) {
+    nanosleep(&(struct timespec){0, 10 * 1000 * 1000}, NULL);
+  }
+  assert(atomic_int_load(&exited) == count);
+}
+
+int main() {
+  atomic_int_store(&exited, 0);
+  reaper r;
+  assert(reaper_init(&r, on_exit_cb, NULL));
+
+  // without any descriptor left, pidfd_open fails and the processes are
+  // polled instead
+  struct rlimit saved, limit;
+  assert(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+  int free_fd = dup(0);
+  assert(free_fd >= 0);
+  close(free_fd);
+  limit = saved;
+  limit.rlim_cur = free_fd;
+  assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+  // the first poll may come before the watch is set up
+  process p = exited_child(9);
+  assert(reaper_watch_process(&r, &p, 0, 0));
+  wait_for_children(1);
+  assert(statuses[0] == 9);
+  atomic_int_store(&exited, 0);
+
+  for (int i = 0; i < CHILDREN; ++i) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      usleep(20 * 1000);
+      _exit(i + 1);
+    }
+    p = pid;
+    assert(reaper_watch_process(&r, &p, i, 0));
+  }
+  wait_for_children(CHILDREN);
+  for (int i = 0; i < CHILDREN; ++i) {
+    assert(statuses[i] == i + 1);
+  }
+  assert(setrlimit(RLIMIT_NOFILE, &saved) == 0);
+
+  // and with pidfd_open working again
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    _exit(7);
+  }
+  p = pid;
+  assert(reaper_watch_process(&r, &p, 0, 0));
+  wait_for_children(CHILDREN + 1);
+  assert(statuses[0] == 7);
+
+  // a process which exited before it is watched, its event comes at once
+  p = exited_child(8);
+  assert(reaper_watch_process(&r, &p, 1, 0));
+  wait_for_children(CHILDREN + 2);
+  assert(statuses[1] == 8);
+
+  reaper_destroy(&r);
+  return 0;
+}
@@ -0,0 +1,106 @@
+#include "parse_cmd.h"
+#include "process.h"
+#include "tinyshell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int running_jobs(tinyshell *shell) {
+  tinyshell_lock_bg_procs(shell);
+  int running = shell->running_jobs;
+  tinyshell_unlock_bg_procs(shell);
+  return running;
+}
+
+static void wait_for_jobs(tinyshell *shell) {
+  for (int i = 0; i < 500; ++i) {
+    tinyshell_lock_bg_procs(shell);
+    int done = shell->running_jobs == 0 && shell->queue_head < 0;
+    tinyshell_unlock_bg_procs(shell);
+    if (done) {
+      return;
+    }
+    nanosleep(&(struct timespec){0, 10 * 1000 * 1000}, NULL);
+  }
+  assert(!"the jobs did not finish");
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+int main() {
+  char dir[] = "/tmp/tinyshell_redirect_XXXXXX";
+  assert(mkdtemp(dir) && chdir(dir) == 0);
+  FILE *script = fopen("bg.tsh", "w");
+  assert(script);
+  fputs("/bin/sleep 0.1 &\n", script);
+  fclose(script);
+  script = fopen("slow.tsh", "w");
+  assert(script);
+  fputs("/bin/sleep 0.5\n", script);
+  fclose(script);
+  assert(mkdir("sub", 0755) == 0);
+
+  tinyshell shell;
+  assert(tinyshell_new_batch(&shell, stdin));
+  // what the shell keeps open is out of reach of redirections
+  assert(shell.reaper.poll_fd > REDIRECT_MAX_FD);
+  assert(shell.reaper.wake_pipe[0] > REDIRECT_MAX_FD);
+  assert(shell.reaper.wake_pipe[1] > REDIRECT_MAX_FD);
+
+  // a job started while every low descriptor is redirected is still reaped
+  tinyshell_run_command(&shell, "./bg.tsh 3>out 4>out 5>out 6>out 7>out 8>out "
+                                "9>out");
+  assert(shell.last_status == 0);
+  for (int i = 0; i < 500 && running_jobs(&shell) > 0; ++i) {
+    nanosleep(&(struct timespec){0, 10 * 1000 * 1000}, NULL);
+  }
+  assert(running_jobs(&shell) == 0);
+
+  // queued jobs start on the reaper thread, with the descriptors and the
+  // directory of the shell when they were entered, not those of whatever the
+  // shell runs at that time
+  tinyshell_run_command(&shell, "maxjobs 1");
+  tinyshell_run_command(&shell, "/bin/sleep 0.2 &");
+  tinyshell_run_command(&shell, "/bin/echo QUEUED &");
+  tinyshell_run_command(&shell, "/bin/echo MOVED > moved &");
+  tinyshell_run_command(&shell, "cd sub");
+  tinyshell_run_command(&shell, "../slow.tsh > captured");
+  assert(shell.last_status == 0);
+  wait_for_jobs(&shell);
+  assert(file_size("captured") == 0);
+  assert(file_size("../moved") == 6 && file_size("moved") < 0);
+  tinyshell_run_command(&shell, "cd ..");
+
+  // nor the other descriptors a script is redirected with: readlink prints
+  // nothing unless the job got descriptor 5
+  for (int i = 0; i < spawn_backends_len; ++i) {
+#ifdef __SANITIZE_ADDRESS__
+    // the vfork interceptor of ASan aborts when called from the reaper thread
+    if (strcmp(spawn_backends[i], "vfork") == 0) {
+      continue;
+    }
+#endif
+    shell.spawn_backend = i;
+    tinyshell_run_command(&shell, "/bin/sleep 0.2 &");
+    tinyshell_run_command(&shell, "/bin/readlink /proc/self/fd/5 > link &");
+    tinyshell_run_command(&shell, "./slow.tsh 5>leak");
+    assert(shell.last_status == 0);
+    wait_for_jobs(&shell);
+    assert(file_size("link") == 0);
+  }
+  tinyshell_destroy(&shell);
+
+  assert(remove("bg.tsh") == 0 && remove("out") == 0);
+  assert(remove("slow.tsh") == 0 && remove("moved") == 0);
+  assert(remove("link") == 0 && remove("leak") == 0);
+  assert(remove("sub/captured") == 0 && rmdir("sub") == 0);
+  assert(chdir("/") == 0 && rmdir(dir) == 0);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "script_cache.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+static void write_file(const char *path, const char *content) {
+  FILE *f = fopen(path, "w");
+  assert(f);
+  fputs(content, f);
+  fclose(f);
+
+  // files modified in the current second are always reloaded
+  struct utimbuf times;
+  times.actime = times.modtime = time(NULL) - 10;
+  assert(utime(path, &times) == 0);
+}
+
+int main() {
+  char dir[] = "/tmp/tinyshell_script_cache_XXXXXX";
+  assert(mkdtemp(dir));
+  char first[64], second[64];
+  sprintf(first, "%s/first.tsh", dir);
+  sprintf(second, "%s/second.tsh", dir);
+  write_file(first,
+             "echo 1\n\n  \necho \"2 3\" &\n\"unclosed\n$CMD\necho '$A'\n");
+  write_file(second, "echo 4\n");
+
+  script_cache cache;
+  assert(script_cache_init(&cache, SCRIPT_CACHE_DEFAULT_CAP));
+
+  script_cache_entry *entry, *again;
+  assert(script_cache_acquire(&cache, first, &entry) == SCRIPT_CACHE_OK);
+  assert(entry->commands_len == 5);
+  assert(strcmp(entry->commands[0].parse_result.argv[0], "echo") == 0);
+  assert(strcmp(entry->commands[1].parse_result.argv[1], "2 3") == 0);
+  assert(!entry->commands[1].parse_result.foreground);
+  assert(entry->commands[2].invalid);
+  assert(strcmp(entry->commands[2].line, "\"unclosed") == 0);
+  // parsed again with the variables of the shell when run
+  assert(entry->commands[3].parse_result.expanded);
+  assert(!entry->commands[4].parse_result.expanded);
+
+  // a script running itself gets the same entry
+  assert(script_cache_acquire(&cache, first, &again) == SCRIPT_CACHE_OK);
+  assert(again == entry);
+  script_cache_release(&cache, again);
+
+  // the file changed while the old entry is still in use
+  write_file(first, "echo 5\necho 6\n");
+  assert(script_cache_acquire(&cache, first, &again) == SCRIPT_CACHE_OK);
+  assert(again != entry && entry->detached);
+  assert(again->commands_len == 2);
+  script_cache_release(&cache, again);
+  script_cache_release(&cache, entry);
+
+  assert(script_cache_acquire(&cache, dir, &entry) == SCRIPT_CACHE_ERROR);
+  script_cache_destroy(&cache);
+
+  // least recently used scripts are evicted when the cache is full
+  assert(script_cache_init(&cache, 20 * 1024));
+  assert(script_cache_acquire(&cache, first, &entry) == SCRIPT_CACHE_OK);
+  script_cache_release(&cache, entry);
+  assert(script_cache_acquire(&cache, second, &entry) == SCRIPT_CACHE_OK);
+  script_cache_release(&cache, entry);
+  assert(cache.len == 1 && cache.lru_head == entry);
+  assert(cache.memory <= cache.memory_cap);
+  script_cache_destroy(&cache);
+
+  // scripts larger than the cache are not cached
+  assert(script_cache_init(&cache, 16));
+  assert(script_cache_acquire(&cache, first, &entry) == SCRIPT_CACHE_UNCACHED);
+  script_cache_destroy(&cache);
+
+  unlink(first);
+  unlink(second);
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#include <assert.h>
+#include "stats.h"
+
+int main() {
+  shell_stats stats;
+  stats_reset(&stats);
+  assert(stats_percentile(&stats.steps[STATS_PARSE], 50) == 0);
+
+  // 1..1000 us
+  for (long long i = 1; i <= 1000; ++i) {
+    stats_record(&stats, STATS_PARSE, i * 1000);
+  }
+
+  const stats_histogram* h = &stats.steps[STATS_PARSE];
+  assert(h->count == 1000);
+  assert(h->max_ns == 1000000);
+  // bucket bounds are at most 25% above the exact value
+  long long p50 = stats_percentile(h, 50), p99 = stats_percentile(h, 99);
+  assert(p50 >= 500000 && p50 <= 500000 * 5 / 4);
+  assert(p99 >= 990000 && p99 <= 1000000);
+  assert(stats_percentile(h, 100) == 1000000);
+
+  // small values get exact buckets
+  stats_record(&stats, STATS_WAIT, 3);
+  assert(stats_percentile(&stats.steps[STATS_WAIT], 50) == 3);
+
+  stats_count(&stats, STATS_SPAWNS, 2);
+  assert(stats.counters[STATS_SPAWNS] == 2);
+  stats_reset(&stats);
+  assert(stats.counters[STATS_SPAWNS] == 0);
+  assert(stats.steps[STATS_PARSE].count == 0);
+
+  return 0;
+}